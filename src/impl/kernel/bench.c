@@ -0,0 +1,276 @@
+#include "bench.h"
+
+// compiled for every kernel, only the bench-x86_64 one (-DBENCH) gets the
+// code and its 128 KiB of copy buffers
+#ifdef BENCH
+#include "guard.h"
+#include "plugbox.h"
+#include "cpu.h"
+#include "panic.h"
+#include "thread/scheduler.h"
+#include "machine/cpuid.h"
+#include "machine/lapic.h"
+#include "machine/percpu.h"
+#include "machine/tsc.h"
+#include "machine/pmu.h"
+#include "stdlib/algorithm.h"
+#include "stdlib/stdio.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BENCH_OPS 10000
+#define BENCH_RUNS 5 // the fastest run is reported, the others caught noise
+#define COPY_SIZE (64 * 1024)
+
+static bool has_rdtscp = false;
+
+// rdtsc may execute early or late, fence it in
+static inline uint64_t bench_begin()
+{
+    asm volatile("lfence" ::: "memory");
+    uint64_t t = rdtsc();
+    asm volatile("lfence" ::: "memory");
+    return t;
+}
+
+static inline uint64_t bench_end()
+{
+    uint64_t t;
+    if(has_rdtscp)
+    {
+        uint32_t low, high, aux;
+        asm volatile("rdtscp" : "=a"(low), "=d"(high), "=c"(aux) :: "memory");
+        t = ((uint64_t)high << 32) | low;
+    }
+    else
+    {
+        asm volatile("lfence" ::: "memory");
+        t = rdtsc();
+    }
+    asm volatile("lfence" ::: "memory");
+    return t;
+}
+
+// the fastest run, with what the PMU counted during it
+typedef struct
+{
+    uint64_t cycles;
+    PmuCounts counts;
+} Measurement;
+
+static void report(const char *name, Measurement m, uint64_t ops, const char *unit)
+{
+    printf("bench: %s %lu cycles/%s\n", name, m.cycles / ops, unit);
+    if(pmu_available())
+        printf("bench:   %lu instructions, %lu cache misses, %lu branch misses per 1000 %s\n",
+                m.counts.instructions * 1000 / ops, m.counts.cache_misses * 1000 / ops,
+                m.counts.branch_misses * 1000 / ops, unit);
+}
+
+// runs `body` BENCH_RUNS times, each doing `ops` operations
+static Measurement fastest(void (*body)(uint64_t ops), uint64_t ops)
+{
+    Measurement best = {UINT64_MAX, {0, 0, 0, 0}};
+    for(unsigned int run = 0; run < BENCH_RUNS; run++)
+    {
+        PmuRegion region;
+        pmu_begin(&region);
+        uint64_t start = bench_begin();
+        body(ops);
+        uint64_t cycles = bench_end() - start;
+        PmuCounts counts;
+        pmu_end(&region, &counts);
+        if(cycles < best.cycles)
+        {
+            best.cycles = cycles;
+            best.counts = counts;
+        }
+    }
+    return best;
+}
+
+// ---- toc_switch ping-pong, bypasses the scheduler ----
+static Coroutine *self = NULL;
+static Coroutine *partner = NULL;
+
+static void partner_action()
+{
+    int_disable();
+    for(;;)
+        coroutine_resume(partner, self);
+}
+
+static void raw_switch(uint64_t ops)
+{
+    for(uint64_t i = 0; i < ops; i++)
+        coroutine_resume(self, partner);
+}
+
+// ---- scheduler_resume between two ready coroutines ----
+static void yielder_action()
+{
+    for(;;)
+    {
+        guard_enter();
+        scheduler_resume();
+        guard_leave();
+    }
+}
+
+static void yield(uint64_t ops)
+{
+    for(uint64_t i = 0; i < ops; i++)
+    {
+        guard_enter();
+        scheduler_resume();
+        guard_leave();
+    }
+}
+
+// ---- interrupts ----
+static volatile uint64_t prologues = 0;
+static volatile uint64_t epilogues = 0;
+
+static bool count_prologue()
+{
+    prologues++;
+    return false;
+}
+
+static bool relay_prologue()
+{
+    return true;
+}
+
+static void count_epilogue(unsigned int count)
+{
+    epilogues += count;
+}
+
+static void software_interrupt(uint64_t ops)
+{
+    for(uint64_t i = 0; i < ops; i++)
+        asm volatile("int %0" :: "i"(int_bench) : "memory");
+}
+
+static void self_ipi(uint64_t ops)
+{
+    unsigned int id = lapic_id();
+    for(uint64_t i = 0; i < ops; i++)
+    {
+        uint64_t seen = prologues;
+        lapic_send_ipi(id, int_bench);
+        while(prologues == seen)
+            asm volatile("pause");
+    }
+}
+
+static void guard_pair(uint64_t ops)
+{
+    for(uint64_t i = 0; i < ops; i++)
+    {
+        guard_enter();
+        guard_leave();
+    }
+}
+
+// the prologue finds the guard taken, guard_leave runs the queued epilogue
+static void queued_epilogue(uint64_t ops)
+{
+    for(uint64_t i = 0; i < ops; i++)
+    {
+        guard_enter();
+        asm volatile("int %0" :: "i"(int_bench_relay) : "memory");
+        guard_leave();
+    }
+}
+
+// with the guard free the epilogue runs right away
+static void direct_epilogue(uint64_t ops)
+{
+    for(uint64_t i = 0; i < ops; i++)
+        asm volatile("int %0" :: "i"(int_bench_relay) : "memory");
+}
+
+// ---- throughput ----
+static unsigned char source[COPY_SIZE];
+static unsigned char target[COPY_SIZE];
+
+static void copy(uint64_t ops)
+{
+    for(uint64_t i = 0; i < ops; i++)
+        memcpy(target, source, COPY_SIZE);
+}
+
+static void format(uint64_t ops)
+{
+    char buffer[64];
+    for(uint64_t i = 0; i < ops; i++)
+        snprintf(buffer, sizeof(buffer), "%d %s 0x%lx\n", (int)i, "bench", i);
+}
+
+static void bench_action()
+{
+    has_rdtscp = cpuid(0x80000001, 0).edx & (1 << 27);
+    if(!tsc_hz)
+        tsc_calibrate();
+    printf("bench: TSC at %lu kHz, rdtscp %s, PMU %s\n", tsc_hz / 1000, has_rdtscp ? "yes" : "no",
+            pmu_available() ? "yes" : "no");
+
+    self = cpu_this()->active;
+    partner = coroutine_create(partner_action);
+    if(!partner)
+        panic("bench: out of memory");
+    // kickoff leaves the guard on its first run
+    unsigned long flags = int_save();
+    guard_enter();
+    coroutine_resume(self, partner);
+    report("toc_switch", fastest(raw_switch, BENCH_OPS), 2 * BENCH_OPS, "switch");
+    int_restore(flags);
+
+    // an idle CPU would be offered the yielder, the pair has to share one
+    if(cpu_count() == 1)
+    {
+        Coroutine *yielder = coroutine_create(yielder_action);
+        if(!yielder)
+            panic("bench: out of memory");
+        guard_enter();
+        scheduler_ready(yielder);
+        guard_leave();
+        report("scheduler_resume", fastest(yield, BENCH_OPS), 2 * BENCH_OPS, "switch");
+        guard_enter();
+        scheduler_kill(yielder);
+        guard_leave();
+    }
+    else
+        printf("bench: scheduler_resume skipped, boot with cpus=1\n");
+
+    static interrupt_handler count_handler = INTERRUPT_HANDLER(count_prologue, NULL);
+
+    plugbox_assign(int_bench, &count_handler);
+    static interrupt_handler relay_handler = INTERRUPT_HANDLER(relay_prologue, count_epilogue);
+    plugbox_assign(int_bench_relay, &relay_handler);
+    report("int round trip", fastest(software_interrupt, BENCH_OPS), BENCH_OPS, "interrupt");
+    if(lapic_enabled())
+        report("self-IPI round trip", fastest(self_ipi, BENCH_OPS), BENCH_OPS, "interrupt");
+    report("guard_enter/leave", fastest(guard_pair, BENCH_OPS), BENCH_OPS, "pair");
+    report("queued epilogue", fastest(queued_epilogue, BENCH_OPS), BENCH_OPS, "interrupt");
+    report("direct epilogue", fastest(direct_epilogue, BENCH_OPS), BENCH_OPS, "interrupt");
+
+    report("memcpy 64 KiB", fastest(copy, 100), 100 * (COPY_SIZE / 1024), "KiB");
+    report("snprintf", fastest(format, BENCH_OPS), BENCH_OPS, "call");
+    printf("bench: done\n");
+
+    for(;;)
+        cpu_halt();
+}
+
+Coroutine *bench()
+{
+    Coroutine *c = coroutine_create(bench_action);
+    if(!c)
+        panic("bench: out of memory");
+    return c;
+}
+
+#endif
@@ -0,0 +1,80 @@
+#include "boot/boottrace.h"
+#include "machine/tsc.h"
+#include "stdlib/stdio.h"
+#include <stddef.h>
+
+#define BOOTTRACE_PHASES 64
+
+typedef struct
+{
+    const char *phase;      // NULL for a constructor
+    void (*constructor)();
+    uint64_t end;           // TSC at the mark
+} BootPhase;
+
+static uint64_t start = 0;
+static BootPhase phases[BOOTTRACE_PHASES];
+static unsigned int count = 0;
+static unsigned int lost = 0;
+
+void boottrace_start(uint64_t tsc)
+{
+    start = tsc;
+}
+
+static void record(const char *phase, void (*constructor)())
+{
+    uint64_t now = rdtsc();
+    if(count == BOOTTRACE_PHASES)
+    {
+        lost++;
+        return;
+    }
+    BootPhase p = {phase, constructor, now};
+    phases[count++] = p;
+}
+
+void boottrace_mark(const char *phase)
+{
+    record(phase, NULL);
+}
+
+void boottrace_constructor(void (*constructor)())
+{
+    record(NULL, constructor);
+}
+
+static uint64_t duration(unsigned int i)
+{
+    return phases[i].end - (i ? phases[i - 1].end : start);
+}
+
+void boottrace_report()
+{
+    if(!count)
+        return;
+    tsc_calibrate();
+
+    // insertion sort by duration, there are only a few dozen
+    unsigned int order[BOOTTRACE_PHASES];
+    for(unsigned int i = 0; i < count; i++)
+    {
+        unsigned int j = i;
+        for(; j > 0 && duration(order[j - 1]) < duration(i); j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    printf("boot: %lu us until now, TSC at %lu kHz\n",
+            tsc_to_us(phases[count - 1].end - start), tsc_hz / 1000);
+    for(unsigned int i = 0; i < count; i++)
+    {
+        BootPhase *p = &phases[order[i]];
+        if(p->phase)
+            printf("  %lu us  %s\n", tsc_to_us(duration(order[i])), p->phase);
+        else
+            printf("  %lu us  constructor at 0x%lx\n", tsc_to_us(duration(order[i])), (unsigned long)p->constructor);
+    }
+    if(lost)
+        printf("boot: %u phases not traced\n", lost);
+}
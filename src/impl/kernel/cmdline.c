@@ -0,0 +1,103 @@
+#include "boot/cmdline.h"
+#include "stdlib/string.h"
+
+static const char *cmdline = "";
+
+void cmdline_set(const char *s)
+{
+    cmdline = s ? s : "";
+}
+
+static bool span_is(const char *s, size_t length, const char *word)
+{
+    return strlen(word) == length && !memcmp(s, word, length);
+}
+
+bool cmdline_find(const char *key, const char **value, size_t *length)
+{
+    size_t key_length = strlen(key);
+    bool found = false;
+    for(const char *p = cmdline; *p;)
+    {
+        while(*p == ' ')
+            p++;
+        const char *token = p;
+        while(*p && *p != ' ')
+            p++;
+
+        size_t n = p - token;
+        if(n < key_length || memcmp(token, key, key_length) || (n > key_length && token[key_length] != '='))
+            continue;
+        const char *v = n > key_length ? token + key_length + 1 : p;
+        if(value)
+            *value = v;
+        if(length)
+            *length = p - v;
+        found = true;
+    }
+    return found;
+}
+
+// decimal or 0x prefixed hex, anything else gives the fallback
+uint64_t cmdline_uint(const char *key, uint64_t fallback)
+{
+    const char *v;
+    size_t length;
+    if(!cmdline_find(key, &v, &length) || !length)
+        return fallback;
+
+    unsigned int base = 10;
+    if(length > 2 && v[0] == '0' && (v[1] == 'x' || v[1] == 'X'))
+    {
+        base = 16;
+        v += 2;
+        length -= 2;
+    }
+
+    uint64_t n = 0;
+    for(size_t i = 0; i < length; i++)
+    {
+        unsigned int digit;
+        char c = v[i];
+        if(c >= '0' && c <= '9')
+            digit = c - '0';
+        else if(c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return fallback;
+        if(digit >= base)
+            return fallback;
+        n = n * base + digit;
+    }
+    return n;
+}
+
+bool cmdline_flag(const char *key, bool fallback)
+{
+    const char *v;
+    size_t length;
+    if(!cmdline_find(key, &v, &length))
+        return fallback;
+    return !(span_is(v, length, "0") || span_is(v, length, "off") || span_is(v, length, "no"));
+}
+
+bool cmdline_has(const char *key, const char *item)
+{
+    const char *v;
+    size_t length;
+    if(!cmdline_find(key, &v, &length))
+        return false;
+
+    const char *end = v + length;
+    while(v < end)
+    {
+        const char *comma = memchr(v, ',', end - v);
+        const char *stop = comma ? comma : end;
+        if(span_is(v, stop - v, item))
+            return true;
+        v = stop + 1;
+    }
+    return false;
+}
@@ -1,22 +1,62 @@
 #include "plugbox.h"
 #include "guard.h"
+#include "panic.h"
+#include "machine/lapic.h"
+#include "machine/tsc.h"
+#include "intstat.h"
+#include "profile.h"
+#include "machine/pmu.h"
+#include "machine/percpu.h"
+#include "exception.h"
+#include <stddef.h>
 
 extern void guardian(unsigned int slot, unsigned int *error_code);
 
 void guardian(unsigned int slot, unsigned int *error_code)
 {
-    int e = 0;
-    if(slot == 8
-        || (slot >= 10 && slot <= 14)
-        || slot == 17
-        || slot == 21
-        || slot == 29
-        || slot == 30)
-    {
-        e = *error_code;
-    }
-    // TODO: pass error code to exceptions
-    interrupt_handler *gate = plugbox_report(slot);
-    if(gate->prologue())
-        guard_relay(gate);
+    uint64_t entry = rdtsc();
+    // every stub pushes an error code, 0 for vectors without one, the rest
+    // of the frame follows it
+    if((slot == int_timer || slot == int_sample) && __atomic_load_n(&profiling, __ATOMIC_RELAXED) == profile_timer)
+        profile_sample((const uint64_t *)error_code);
+    // counter overflows share the NMI with real hardware trouble
+    if(slot == int_nmi && pmu_nmi((const uint64_t *)error_code))
+        return;
+
+    // all prologues of a shared line run before any epilogue may enable interrupts
+    interrupt_handler *relay[PLUGBOX_SHARED];
+    unsigned int relays = 0;
+    // lock-free, a replaced chain outlives every interrupt still walking it
+    interrupt_handler *h = plugbox_report(slot);
+    if(!h)
+        panic("Interrupt received but no matching routine registered");
+    // exceptions may nest, e.g. a page fault inside a prologue
+    PerCPU *cpu = slot < 32 ? cpu_this() : NULL;
+    ExceptionFrame *outer = cpu ? cpu->exception : NULL;
+    if(cpu)
+        cpu->exception = (ExceptionFrame *)error_code;
+    for(; h && relays < PLUGBOX_SHARED; h = __atomic_load_n(&h->shared, __ATOMIC_ACQUIRE))
+        if(h->prologue())
+            relay[relays++] = h;
+    if(cpu)
+        cpu->exception = outer;
+    uint64_t done = rdtsc();
+    intstat_fired(slot, done - entry, relays);
+
+    // LAPIC delivered vectors need an EOI before an epilogue may switch
+    // coroutines; 8259 IRQs are auto-EOI and spurious ones must not get one
+    if(slot >= 32 && slot != int_spurious)
+        lapic_eoi();
+    // Several are queued before the first runs: leaving the guard after it
+    // would be a quiescent point, and the others could already be retired.
+    bool batch = relays > 1 && !cpu_this()->guard_locked;
+    if(batch)
+        guard_enter();
+    for(unsigned int i = 0; i < relays; i++)
+        guard_relay(relay[i], done);
+    if(batch)
+        guard_leave();
+    // a prologue may have deferred work of its own, see guard_defer
+    if(!relays)
+        guard_poll();
 }
@@ -7,15 +7,33 @@
 #include "cpu.h"
 #include "user/app.h"
 #include "thread/scheduler.h"
+#include "thread/workqueue.h"
 #include "device/watch.h"
+#include "device/timer.h"
+#include "device/serial.h"
+#include "machine/smp.h"
+#include "machine/irq.h"
+#include "machine/clock.h"
+#include "machine/pmu.h"
+#include "memory/paging.h"
+#include "memory/address_space.h"
+#include "syscall.h"
+#include "klog.h"
+#include "bench.h"
+#include "profile.h"
+#include "boot/cmdline.h"
+#include "boot/boottrace.h"
+#include "boot/module.h"
+#include "user/elf.h"
 #include <stdint.h>
 
 extern void set_kernel_stack(uint64_t stackptr);
-extern void jump_usermode(uint64_t start_addr);
 
-void test_user_function()
+// Runs in user mode from a page of its own, see user_spawn_page: it must not
+// call or reference anything outside, not even the inline syscall() at -O0
+__attribute__((section(".user.text"), aligned(PAGE_SIZE))) void test_user_function()
 {
-    CGA_show(0, 0, 'U');
+    asm volatile("syscall" : : "a"(sys_show), "D"(0), "S"(0), "d"('U') : "rcx", "r11", "memory");
     for(;;);
 }
 
@@ -28,27 +46,64 @@ void kmain()
     asm volatile("mov %%rsp, %0" : "=r"(rsp));
     set_kernel_stack(rsp);
     guard_enter();
+    boottrace_mark("kmain entry");
 
     CGA_clear();
+    boottrace_mark("CGA_clear");
+    paging_init();
+    paging_cpu_init();
+    boottrace_mark("paging_init");
+    if(CGA_use_framebuffer())
+        boottrace_mark("CGA_use_framebuffer");
+    address_space_init();
+    boottrace_mark("address_space_init");
+    syscall_init();
+    boottrace_mark("syscall_init");
+    smp_init();
+    boottrace_mark("smp_init");
+    pmu_init();
+    irq_init();
+    boottrace_mark("irq_init");
 
     ps2kbd_plugin();
+    serial_plugin();
+    timer_init();
+    boottrace_mark("device plugins");
+    clock_init();
+    boottrace_mark("clock_init");
+    if(cmdline_uint("profile", 0))
+        profile_start(cmdline_uint("profile", 0));
+    boottrace_report();
     int_enable();
 
-    jump_usermode((uint64_t)test_user_function);
-
-    // temporary stacks for testing context switches
-    unsigned char stack1[(1 << 10)];
-    void* stack1_bp = stack1 + sizeof(stack1);
-
-    unsigned char stack2[(1 << 10)];
-    void* stack2_bp = stack2 + sizeof(stack2);
+#ifdef BENCH
+    scheduler_ready(bench());
+    scheduler_schedule();
+#endif
 
-    Coroutine *c1 = app(stack1_bp);
-    Coroutine *c2 = app2(stack2_bp);
+    Coroutine *c1 = app();
+    Coroutine *c2 = app2();
     scheduler_ready(c1);
     scheduler_ready(c2);
-    watch_set(60000, 20);
-    watch_plugin(scheduler_resume);
+    scheduler_ready(echo());
+    for(unsigned int i = 0; i < module_count(); i++)
+    {
+        Coroutine *program = elf_spawn(module_get(i)->start, module_get(i)->end);
+        if(program)
+            scheduler_ready(program);
+    }
+    // programs come as multiboot modules, without any the built-in one runs
+    if(!module_count())
+    {
+        Coroutine *program = user_spawn_page(test_user_function);
+        if(program)
+            scheduler_ready(program);
+    }
+    klog_init();
+    workqueue_init();
+    scheduler_set_quantum(cmdline_uint("quantum", 60000 * 21));
+    watch_set(cmdline_uint("slice_tick", 10000), 0);
+    watch_plugin(scheduler_tick);
     scheduler_schedule();
 
     /*CGA_clear();
@@ -0,0 +1,25 @@
+#include "boot/module.h"
+#include "memory/frame.h"
+#include "panic.h"
+#include <stddef.h>
+
+static BootModule modules[MAX_MODULES];
+static unsigned int count = 0;
+
+void module_add(uintptr_t start, uintptr_t end, const char *cmdline)
+{
+    if(count == MAX_MODULES)
+        panic("module_add: too many modules");
+    frame_add_reserved(start, end);
+    modules[count++] = (BootModule){start, end, phys_to_virt(cmdline)};
+}
+
+unsigned int module_count()
+{
+    return count;
+}
+
+const BootModule *module_get(unsigned int index)
+{
+    return index < count ? &modules[index] : NULL;
+}
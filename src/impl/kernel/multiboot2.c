@@ -2,17 +2,29 @@
 #include "cgascr.h"
 #include "panic.h"
 #include "stdlib/stdio.h"
+#include "memory/frame.h"
+#include "machine/acpi.h"
+#include "device/serial.h"
+#include "boot/cmdline.h"
+#include "boot/boottrace.h"
+#include "boot/module.h"
+#include "fbcon.h"
+#include <stddef.h>
 
 void check_multiboot2(unsigned long magic, unsigned long addr)
 {
+    // nothing printed before, boot messages reach the serial console as well
+    serial_init();
     CGA_clear();
+    boottrace_mark("serial_init, CGA_clear");
 
     if (magic != MULTIBOOT2_BOOTLOADER_MAGIC)
         panicf("Invalid magic number: 0x%x\n", (unsigned) magic);
     if(addr & 7)
-        panicf("Unaligned mbi: 0x%x\n", addr);
+        panicf("Unaligned mbi: 0x%lx\n", addr);
 
     struct multiboot_tag *tag;
+    struct multiboot_tag_mmap *memory_map = NULL;
     unsigned int size = *(unsigned int *) addr;
     printf("Announced mbi size 0x%x\n", size);
     for(tag = (struct multiboot_tag *)(addr + 8);
@@ -24,6 +36,8 @@ void check_multiboot2(unsigned long magic, unsigned long addr)
         {
         case MULTIBOOT_TAG_TYPE_CMDLINE:
             printf("Command line = %s\n", ((struct multiboot_tag_string *)tag)->string);
+            // through the direct map, the identity mapping goes away with smp_init
+            cmdline_set(phys_to_virt(((struct multiboot_tag_string *)tag)->string));
             break;
         case MULTIBOOT_TAG_TYPE_BOOT_LOADER_NAME:
             printf("Boot loader name = %s\n", ((struct multiboot_tag_string *)tag)->string);
@@ -33,6 +47,9 @@ void check_multiboot2(unsigned long magic, unsigned long addr)
                     ((struct multiboot_tag_module *)tag)->mod_start,
                     ((struct multiboot_tag_module *)tag)->mod_end,
                     ((struct multiboot_tag_module *)tag)->cmdline);
+            module_add(((struct multiboot_tag_module *)tag)->mod_start,
+                    ((struct multiboot_tag_module *)tag)->mod_end,
+                    ((struct multiboot_tag_module *)tag)->cmdline);
             break;
         case MULTIBOOT_TAG_TYPE_BASIC_MEMINFO:
             printf("mem_lower = %uKB, mem_upper = %uKB\n",
@@ -45,10 +62,20 @@ void check_multiboot2(unsigned long magic, unsigned long addr)
                     ((struct multiboot_tag_bootdev *)tag)->slice,
                     ((struct multiboot_tag_bootdev *)tag)->part);
             break;
+        case MULTIBOOT_TAG_TYPE_ACPI_OLD:
+            acpi_set_rsdp(((struct multiboot_tag_old_acpi *)tag)->rsdp);
+            break;
+        case MULTIBOOT_TAG_TYPE_ACPI_NEW:
+            acpi_set_rsdp(((struct multiboot_tag_new_acpi *)tag)->rsdp);
+            break;
+        case MULTIBOOT_TAG_TYPE_FRAMEBUFFER:
+            fbcon_set_info((struct multiboot_tag_framebuffer *)tag);
+            break;
         case MULTIBOOT_TAG_TYPE_MMAP:
         {
             multiboot_memory_map_t *mmap;
             printf("mmap\n");
+            memory_map = (struct multiboot_tag_mmap *)tag;
     
             for(mmap = ((struct multiboot_tag_mmap *)tag)->entries;
                 (multiboot_uint8_t *)mmap 
@@ -67,4 +94,14 @@ void check_multiboot2(unsigned long magic, unsigned long addr)
     }
     tag = (struct multiboot_tag *)((multiboot_uint8_t *)tag + ((tag->size + 7) & ~7));
     printf("Total mbi size 0x%x\n", (unsigned) tag - addr);
+
+    if(!memory_map)
+        panic("No memory map");
+    frame_add_reserved(addr, addr + size);
+    boottrace_mark("multiboot2 tags");
+    frame_init(memory_map);
+    boottrace_mark("frame_init");
+    // options can be read from here on, frame_init set up the direct map
+    stdio_init();
+    printf("%u KiB free\n", (unsigned)(frame_available() * (FRAME_SIZE / 1024)));
 }
@@ -0,0 +1,126 @@
+; Startup code for the application processors (APs).
+; The block between ap_trampoline_start and ap_trampoline_end is copied to
+; AP_TRAMPOLINE_BASE by smp_init, which also fills in the data fields at its
+; end. Every AP enters it in real mode and leaves it on its own stack in the
+; higher half, see ap_long_mode_start.
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_trampoline_cr3
+global ap_trampoline_stacks
+global ap_trampoline_stack_size
+global ap_trampoline_max
+global ap_trampoline_count
+
+; C entry point: void smp_ap_main(unsigned int index)
+extern smp_ap_main
+
+%define AP_TRAMPOLINE_BASE 0x8000
+; address of a trampoline label after it has been copied
+%define REL(x) (AP_TRAMPOLINE_BASE + (x) - ap_trampoline_start)
+
+section .text
+bits 16
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; enter protected mode with a temporary flat gdt
+    lgdt [REL(ap_trampoline_gdt.pointer)]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword 0x08:REL(.protected_mode)
+
+bits 32
+.protected_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; enable PAE
+    mov eax, cr4
+    or eax, 1 << 5
+    mov cr4, eax
+
+    ; share the BSP's page tables
+    mov eax, [REL(ap_trampoline_cr3)]
+    mov cr3, eax
+
+    ; enable long mode
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, 1 << 8
+    wrmsr
+
+    ; enable paging
+    mov eax, cr0
+    or eax, 1 << 31
+    mov cr0, eax
+
+    jmp 0x18:REL(.long_mode)
+
+bits 64
+.long_mode:
+    ; draw an index, APs are started all at once and race for it
+    mov eax, 1
+    lock xadd dword [REL(ap_trampoline_count)], eax
+    cmp eax, dword [REL(ap_trampoline_max)]
+    jae .surplus
+
+    ; stack top = stacks + (index + 1) * stack_size
+    mov ecx, eax
+    inc rcx
+    imul rcx, qword [REL(ap_trampoline_stack_size)]
+    add rcx, qword [REL(ap_trampoline_stacks)]
+    mov rsp, rcx
+
+    mov edi, eax
+    mov rax, ap_long_mode_start
+    jmp rax
+
+.surplus:
+    cli
+    hlt
+    jmp .surplus
+
+align 8
+ap_trampoline_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF ; 0x08: 32-bit code
+    dq 0x00CF92000000FFFF ; 0x10: data
+    dq 0x00AF9A000000FFFF ; 0x18: 64-bit code
+.pointer:
+    dw $ - ap_trampoline_gdt - 1
+    dd REL(ap_trampoline_gdt)
+
+; filled in by smp_init
+align 8
+ap_trampoline_cr3: dq 0
+ap_trampoline_stacks: dq 0
+ap_trampoline_stack_size: dq 0
+ap_trampoline_max: dd 0
+ap_trampoline_count: dd 0
+ap_trampoline_end:
+
+; runs at the kernel's link address again
+ap_long_mode_start:
+    xor ax, ax
+    mov ss, ax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    fninit
+    xor rbp, rbp ; null stack frame as an anchor for stack backtracing
+    call smp_ap_main
+.hlt:
+    cli
+    hlt
+    jmp .hlt
@@ -6,11 +6,14 @@ global gdt64.user_data
 global gdt64.tss
 global gdt64.tss.descriptor
 global gdt64.pointer
+global gdt64.pointer_phys
 
 global tss64
 global tss64.length
 global set_kernel_stack
 
+%define KERNEL_VMA 0xFFFFFFFF80000000 ; see linker.ld
+
 section .rodata
 ; global descriptor table
 gdt64:
@@ -27,18 +30,19 @@ gdt64:
     db 0x92 ; access byte
     db 0xCF ; limit & flags
     db 0 ; base
-.user_code: equ $ - gdt64
-    dw 0xFFFF ; limit
-    db 0, 0, 0 ; base
-    db 0xFA ; access byte
-    db 0xAF ; limit & flags
-    db 0 ; base
+; sysret expects user data right before user code
 .user_data: equ $ - gdt64
     dw 0xFFFF ; limit
     db 0, 0, 0 ; base
     db 0xF2 ; access byte
     db 0xCF ; limit & flags
     db 0 ; base
+.user_code: equ $ - gdt64
+    dw 0xFFFF ; limit
+    db 0, 0, 0 ; base
+    db 0xFA ; access byte
+    db 0xAF ; limit & flags
+    db 0 ; base
 .tss: equ $ - gdt64
 .tss.descriptor:
     dw tss64.length & 0xFFFF ; limit
@@ -52,6 +56,10 @@ gdt64:
 .pointer:
     dw $ - gdt64 - 1 ; gtd length
     dq gdt64 ; gdt location
+; the same for the 32-bit boot code, which only reaches the identity mapping
+.pointer_phys:
+    dw .pointer - gdt64 - 1
+    dd gdt64 - KERNEL_VMA
 
 section .data
 ; task state segment
@@ -76,7 +84,8 @@ tss64:
 section .text
 bits 64
 ; void set_kernel_stack(uint64_t stackptr)
+; sets RSP0 in the TSS of the calling CPU (PerCPU.tss at gs:16)
 set_kernel_stack:
-    mov	rsi, tss64
+    mov	rsi, [gs:16]
     mov qword[rsi+4], rdi
     ret
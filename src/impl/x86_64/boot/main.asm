@@ -15,6 +15,7 @@ extern gdt64.kernel_code
 extern gdt64.tss
 extern gdt64.tss.descriptor
 extern gdt64.pointer
+extern gdt64.pointer_phys
 
 ; tss
 extern tss64
@@ -30,6 +31,15 @@ extern long_mode_start
 extern _readonly_start
 extern _readonly_end
 
+; Everything outside this file is linked at -2 GiB, until the jump to
+; long_mode_start it is reached through the identity mapping instead
+%define KERNEL_VMA 0xFFFFFFFF80000000
+%define phys(x) ((x) - KERNEL_VMA)
+
+; PTs covering the first BOOT_L1S * 2 MiB, the whole image must fit (see
+; the ASSERT in linker.ld and BOOT_MAPPED in boot/page_table.h)
+%define BOOT_L1S 4
+
 section .entry.text progbits alloc exec nowrite align=16
 bits 32
 start:
@@ -49,13 +59,13 @@ start:
     call setup_page_tables
     call enable_paging
 
-    lgdt [gdt64.pointer] ; load gdt
+    lgdt [phys(gdt64.pointer_phys)] ; load gdt
 
     call init_tss
     mov ax, gdt64.tss
     ltr ax ; load tss
 
-    jmp gdt64.kernel_code:long_mode_start ; reload cs register, activating gdt and jumping to 64-bit code
+    jmp gdt64.kernel_code:long_mode_entry ; reload cs register, activating gdt and jumping to 64-bit code
 
     hlt
 
@@ -189,14 +199,17 @@ setup_page_tables:
     mov ecx, page_table.length >> 2
     rep stosd
 
+    ; Nothing here is usermode-accessible: every space shares these tables,
+    ; user pages are mapped later with pte_user all the way down
+
     ; map one PDPT
     mov eax, page_table.l3
-    or eax, 0b111                ; present, writable, usermode-accessible
+    or eax, 0b11                 ; present, writable
     mov [page_table.l4], eax
 
     ; map four PDs (adressing 1 GiB each)
     mov eax, page_table.l2
-    or eax, 0b111                ; present, writable, usermode-accessible
+    or eax, 0b11                 ; present, writable
     mov [page_table.l3], eax
     add eax, 0x1000
     mov [page_table.l3 + 8], eax
@@ -205,15 +218,24 @@ setup_page_tables:
     add eax, 0x1000
     mov [page_table.l3 + 24], eax
 
-    ; map one PT (adressing 2 MiB each)
+    ; map the PTs (adressing 2 MiB each), at 0 and at -2 GiB alike
     mov eax, page_table.l1
-    or eax, 0b111                ; present, writable, usermode-accessible
-    mov [page_table.l2], eax
+    or eax, 0b11                 ; present, writable
+    mov edi, page_table.l2
+    mov esi, page_table.l2_kernel
+    mov ecx, BOOT_L1S
+.SetTable:
+    mov [edi], eax
+    mov [esi], eax
+    add eax, 0x1000
+    add edi, 8
+    add esi, 8
+    loop .SetTable
 
-    ; Identity map first 2 MiB kernel memory
+    ; Identity map the first BOOT_L1S * 2 MiB, the kernel image included
     mov edi, page_table.l1
-    mov ebx, 0b101               ; present, not writable TODO: remove user bit
-    mov ecx, 512
+    mov ebx, 0b1                 ; present, not writable
+    mov ecx, 512 * BOOT_L1S
 .SetEntry:
     ; if address in ebx is between _readonly_start and _readonly_end, do not add `writable` bit
     cmp ebx, _readonly_start
@@ -222,7 +244,7 @@ setup_page_tables:
     jb  .readonly
 .writable:
     mov eax, ebx
-    or  eax, 0b11                ; present, writable TODO: remove user bit
+    or  eax, 0b11                ; present, writable
     mov DWORD [edi], eax
     jmp .cont
 .readonly:
@@ -232,10 +254,13 @@ setup_page_tables:
     add edi, 8
     loop .SetEntry
 
-    ; Map kernel memory to 0xC0000000 as well
-    mov eax, page_table.l1
-    or eax, 0b111                 ; present, writable, usermode-accessible
-    mov [page_table.l2 + 0x3000], eax
+    ; Map kernel memory to -2 GiB as well: L4[511] -> L3[510] -> the same PTs
+    mov eax, page_table.l3_kernel
+    or eax, 0b11                  ; present, writable
+    mov [page_table.l4 + 511 * 8], eax
+    mov eax, page_table.l2_kernel
+    or eax, 0b11
+    mov [page_table.l3_kernel + 510 * 8], eax
 
     ret
 
@@ -259,13 +284,15 @@ enable_paging:
     ret
 
 init_tss:
-    mov	edi, tss64
+    mov	edi, phys(tss64)
     ; RSP0 (lower 32 bits)
     mov dword [edi+4], stack_top
 
-    ; update gdt entry
-    mov	edi,			gdt64.tss.descriptor
-    mov	eax,			tss64
+    ; update gdt entry with the linked address of the TSS
+    mov	edi,			phys(gdt64.tss.descriptor)
+    mov	dword [edi+8],	KERNEL_VMA >> 32 ; Base Upper [63:32]
+    mov	eax,			phys(tss64)
+    add	eax,			KERNEL_VMA & 0xFFFFFFFF
     ; Set Base Low [15:00]
     mov	[edi+2],		ax
     shr	eax,			16
@@ -285,6 +312,12 @@ error:
     mov byte [0xb800a], al
     hlt
 
+bits 64
+long_mode_entry:
+    ; still identity mapped, continue at the link address
+    mov rax, long_mode_start
+    jmp rax
+
 section .bootstrap_stack nobits alloc noexec write align=4
 ; reserve memory for stack
 align 16
@@ -303,5 +336,9 @@ page_table:
 .l2:
     resb 4096*4
 .l1:
+    resb 4096 * BOOT_L1S
+.l3_kernel:
+    resb 4096
+.l2_kernel:
     resb 4096
 .length: equ $ - page_table
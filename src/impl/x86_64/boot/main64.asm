@@ -1,5 +1,6 @@
 global long_mode_start
 global jump_usermode
+global enter_usermode
 
 ; page tables
 extern page_table
@@ -14,6 +15,7 @@ extern gdt64.kernel_code
 extern gdt64.kernel_data
 extern gdt64.user_code
 extern gdt64.user_data
+extern gdt64.pointer
 
 ; multiboot information
 extern mb_magic
@@ -23,6 +25,12 @@ extern mbi_addr
 extern check_multiboot2
 extern kmain
 extern guardian
+extern plugbox_fast
+extern intstat_fast
+extern lapic
+extern boottrace_start
+extern boottrace_mark
+extern boottrace_constructor
 
 ; linker supplied addresses
 extern ___BSS_START__
@@ -33,9 +41,14 @@ extern __fini_array_start
 extern __fini_array_end
 
 
+; as in boot/main.asm
+%define BOOT_L1S 4
+
 section .head.text progbits alloc exec nowrite align=16
 bits 64
 long_mode_start:
+    ; the GDT as linked, the boot code had to load it through the identity mapping
+    lgdt [rel gdt64.pointer]
     ; reload data segment registers
     mov ax, gdt64.kernel_data
     mov ss, ax
@@ -44,6 +57,12 @@ long_mode_start:
     mov fs, ax
     mov gs, ax
 
+    ; boot trace starts here, r12 keeps the timestamp until the BSS is clear
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r12, rax
+
     ; clear BSS
 	mov    rdi, ___BSS_START__
 .clear_bss:
@@ -51,23 +70,37 @@ long_mode_start:
 	inc    rdi
 	cmp    rdi, ___BSS_END__
 	jne    .clear_bss
+	mov rdi, r12
+	call boottrace_start
+	mov rdi, phase_bss
+	call boottrace_mark
 
     call setup_idt ; fill IDT with guardian calls
+	mov rdi, phase_idt
+	call boottrace_mark
     call remap_pics ; remap PICs to not conflict with CPU exceptions and mask all PIC lines (for now)
+	mov rdi, phase_pics
+	call boottrace_mark
     call setup_cursor ; restore blinking cursor (switched off by GRUB)
+	mov rdi, phase_cursor
+	call boottrace_mark
 
     fninit ; activate FPU
-    call _init ; call global constructors
+    call _init ; call global constructors, each one is traced
 
 	xor rsi, rsi
 	xor rdi, rdi
 	mov esi, DWORD [mbi_addr] ; get GRUB multiboot info
 	mov edi, DWORD [mb_magic] ; get multiboot magic number
 	call check_multiboot2
-
-	; unmap identity paging
-	mov rax, 0
-    mov [page_table.l2], rax
+	mov rdi, phase_multiboot
+	call boottrace_mark
+
+	; unmap identity paging, the PDEs of all BOOT_L1S PTs
+	mov rdi, page_table.l2
+	xor rax, rax
+	mov rcx, BOOT_L1S
+	rep stosq
 	mov rcx, cr3 ; reload cr3 to force a TLB flush so the changes take effect
 	mov cr3, rcx
 	mov rsp, stack_top ; load new stack
@@ -80,7 +113,7 @@ long_mode_start:
 
 	; remap identity paging TODO: obviously doesn't work because page_table isn't identity mapped anymore!
 	mov rax, page_table.l1
-    or rax, 0b111
+    or rax, 0b11
     mov [page_table.l2], rax
 
     call _fini ; call global destructors
@@ -89,8 +122,15 @@ long_mode_start:
     hlt
     jmp .hlt
 
-; void jump_usermode(uint64_t start_addr)
+; void jump_usermode(uint64_t start_addr), keeps using the current stack
 jump_usermode:
+	mov rsi, rsp
+; void enter_usermode(uint64_t start_addr, uint64_t stack)
+enter_usermode:
+	; no interrupts until iretq, they would find the user GS base
+	cli
+	; park the per-CPU block in KERNEL_GS_BASE, interrupts from ring 3 swap it back
+	swapgs
 	mov ax, gdt64.user_data
 	or ax, 3 ; usermode data segment with bottom 2 bits set for ring 3
 	mov ds, ax
@@ -99,7 +139,7 @@ jump_usermode:
 	mov gs, ax ; SS is handled by iretq
 
 	; set up the stack frame iretq expects
-	mov rax, rsp
+	mov rax, rsi
 	mov rbx, gdt64.user_data
 	or rbx, 3
 	mov rcx, gdt64.user_code
@@ -107,33 +147,42 @@ jump_usermode:
 	push rbx ; data selector
 	push rax ; stack pointer
 	pushf ; rflags
+	or qword [rsp], 1 << 9 ; with interrupts enabled
 	push rcx ; code selector
 	push rdi ; instruction address (of ring 3 function) to jump to
 
 	iretq
 
 
-; interrupt handler head
+;
+; Interrupt entry, one complete stub per vector. Everything that depends on
+; the vector is decided here at assembly time: vectors without an error code
+; push a 0 in its place, so every stub builds the same frame
+;   [rbp] rbp, [rbp+8] error code, [rbp+16] rip, [rbp+24] cs, rflags, rsp, ss
+; and guardian() never has to ask. IRQs and IPIs whose handler has no
+; epilogue take the fast path: their prologue is called straight from
+; plugbox_fast, followed by the EOI, without going through guardian(). They
+; are only counted, in intstat_fast.
+;
+; NMI, #DF and #MC may arrive anywhere, also right after syscall or right
+; before sysret/iretq, where RSP or the GS base still are the user's. They
+; run on IST stacks of their own (see percpu_bsp_init and load_descriptors)
+; and are paranoid: the GS base itself tells whether to swapgs, not CS.
+;
+%define ERROR_CODE_VECTORS 0x60227d00 ; 8, 10-14, 17, 21, 29, 30
+%define IST_VECTORS 0x00040104       ; 2, 8, 18
+%define LAPIC_EOI 0xb0
+%define MSR_GS_BASE 0xc0000101
+
 %macro wrapper 1
 wrapper_%1:
+%if %1 >= 32 || (ERROR_CODE_VECTORS & (1 << %1)) == 0
+	push   0 ; no error code, keep the frame uniform
+%endif
 	push   rbp
 	mov    rbp, rsp
+	; preserve volatile registers, rsp is 16 byte aligned afterwards
 	push   rax
-	mov    al, %1
-	jmp    wrapper_body
-%endmacro
-
-%assign i 0
-%rep 256
-wrapper i
-%assign i i+1
-%endrep
-
-; interrupt handler body
-wrapper_body:
-	; expected by gcc
-	cld
-	; preserve volatile registers
 	push   rcx
 	push   rdx
 	push   rdi
@@ -142,18 +191,65 @@ wrapper_body:
 	push   r9
 	push   r10
 	push   r11
+%if %1 < 32 && (IST_VECTORS & (1 << %1))
+	; rbx remembers the swapgs, the second push keeps the alignment
+	push   rbx
+	sub    rsp, 8
+	xor    ebx, ebx
+	mov    ecx, MSR_GS_BASE
+	rdmsr
+	test   edx, edx
+	js     %%kernel_gs ; the per-CPU block is in the upper half
+	swapgs
+	mov    ebx, 1
+%else
+	; interrupted in ring 3: load the kernel GS base (per-CPU block)
+	test   byte [rbp + 24], 3
+	jz     %%kernel_gs
+	swapgs
+%endif
+%%kernel_gs:
+	; expected by gcc
+	cld
 
-	; generated wrapper provides only 8 bits
-	and    rax, 0xff
-
-	; pass interrupt number as argument
-	mov    rdi, rax
-	; pass location of error code as argument (might not be valid if no error code exists)
-	mov    rsi, rbp
-	add    rsi, 8
+%if %1 >= 32
+	mov    rax, [rel plugbox_fast + %1 * 8]
+	test   rax, rax
+	jz     %%generic
+	; guardian() keeps the statistics of everything else
+	lock inc qword [rel intstat_fast + %1 * 8]
+	call   rax
+%if %1 != 255
+	; spurious interrupts must not be acknowledged
+	mov    rax, [rel lapic]
+	test   rax, rax
+	jz     %%done
+	mov    dword [rax + LAPIC_EOI], 0
+%endif
+	jmp    %%done
+%endif
+
+%%generic:
+	mov    edi, %1 ; interrupt number
+	lea    rsi, [rbp + 8] ; location of the error code
 	call   guardian
 
-	; restore volatile registers
+%%done:
+%if %1 < 32 && (IST_VECTORS & (1 << %1))
+	; put back whichever GS base was there
+	test   ebx, ebx
+	jz     %%kernel_return
+	swapgs
+%%kernel_return:
+	add    rsp, 8
+	pop    rbx
+%else
+	; returning to ring 3: restore the user GS base
+	test   byte [rbp + 24], 3
+	jz     %%kernel_return
+	swapgs
+%%kernel_return:
+%endif
 	pop    r11
 	pop    r10
 	pop    r9
@@ -162,12 +258,17 @@ wrapper_body:
 	pop    rdi
 	pop    rdx
 	pop    rcx
-
-    ; pushed by wrapper
 	pop    rax
 	pop    rbp
-
+	add    rsp, 8 ; error code
 	iretq
+%endmacro
+
+%assign i 0
+%rep 256
+wrapper i
+%assign i i+1
+%endrep
 
 setup_idt:
 	mov    rax, wrapper_0
@@ -274,6 +375,8 @@ _init_loop:
 	je     _init_done
 	mov    rax, [rbx]
 	call   rax
+	mov    rdi, [rbx]
+	call   boottrace_constructor
 	add    rbx, 8
 	ja     _init_loop
 _init_done:
@@ -300,6 +403,15 @@ delay:
 	ret
 
 
+section .rodata
+; boot trace phases
+phase_bss:       db "clear BSS", 0
+phase_idt:       db "setup_idt", 0
+phase_pics:      db "remap_pics", 0
+phase_cursor:    db "setup_cursor", 0
+phase_multiboot: db "check_multiboot2", 0
+
+
 section .idt.rodata progbits alloc noexec nowrite align=4
 ;
 ; interrupt descriptor table with 256 entries
@@ -321,11 +433,32 @@ idt:
 	dd  ((wrapper_%1 - wrapper_0) & 0xffffffff00000000) >> 32 ; offset 32..63
 	dd  0x00000000 ; reserved
 %endmacro
+; interrupt gate switching to IST stack %2 of the TSS
+%macro idt_ist_entry 2
+	dw  (wrapper_%1 - wrapper_0) & 0xffff ; offset 0 .. 15
+	dw  gdt64.kernel_code ; segment selector
+	dw  0x8e00 | %2 ; 64-bit interrupt gate, present, IST
+	dw  ((wrapper_%1 - wrapper_0) & 0xffff0000) >> 16 ; offset 16 .. 31
+	dd  ((wrapper_%1 - wrapper_0) & 0xffffffff00000000) >> 32 ; offset 32..63
+	dd  0x00000000 ; reserved
+%endmacro
 
 ; first 32 vectors are reserved for exceptions (as mandated by Intel)
+; page faults keep interrupts off until CR2 is read, NMI, #DF and #MC get
+; IST stacks 1-3 (IST_NMI, IST_DF, IST_MC in machine/percpu.h)
 %assign i 0
 %rep 32
+%if i == 2
+idt_ist_entry i, 1
+%elif i == 8
+idt_ist_entry i, 2
+%elif i == 18
+idt_ist_entry i, 3
+%elif i == 14
+idt_interrupt_entry i
+%else
 idt_trap_entry i
+%endif
 %assign i i+1
 %endrep
 %rep 224
@@ -9,6 +9,20 @@ header_start:
     ; checksum
     dd 0x100000000 - (0xe85250d6 + 0 + (header_end - header_start))
 
+    ; module alignment tag: page aligned modules, the ELF loader maps them in place
+    dw 6
+    dw 0
+    dd 8
+
+    ; framebuffer tag: optional, any size at 32 bpp; without one the console stays CGA text
+    dw 5
+    dw 1
+    dd 20
+    dd 0 ; width
+    dd 0 ; height
+    dd 32 ; depth
+    dd 0 ; tags are 8-byte aligned
+
     ; end tag
     dw 0
     dw 0
@@ -0,0 +1,54 @@
+global syscall_entry
+
+extern syscall_table
+
+%define SYSCALL_COUNT 64
+
+section .text
+bits 64
+; SYSCALL lands here with IF, DF and TF masked, rcx = user rip, r11 = user rflags.
+; rax = number, arguments in rdi, rsi, rdx, r10, r8, r9, result in rax.
+; Everything but rax, rcx and r11 is preserved for the caller.
+; Until RSP0 is loaded and again from `pop rsp` on, RSP and GS are the
+; user's: only NMI, #DF and #MC can hit, and those run paranoid on IST
+; stacks (see the interrupt stubs in main64.asm).
+syscall_entry:
+	swapgs
+	mov    [gs:24], rsp     ; PerCPU.user_rsp
+	mov    rsp, [gs:16]     ; PerCPU.tss
+	mov    rsp, [rsp + 4]   ; its RSP0, see set_kernel_stack
+	and    rsp, -16
+
+	push   qword [gs:24]
+	push   r11
+	push   rcx
+	push   rdi
+	push   rsi
+	push   rdx
+	push   r10
+	push   r8
+	push   r9
+	sub    rsp, 8           ; keep the stack 16-byte aligned for gcc
+
+	cmp    rax, SYSCALL_COUNT
+	jae    .invalid
+	mov    rcx, r10         ; 4th argument as the C calling convention wants it
+	mov    r11, syscall_table
+	call   [r11 + rax * 8]
+	jmp    .return
+.invalid:
+	mov    rax, -1
+
+.return:
+	add    rsp, 8
+	pop    r9
+	pop    r8
+	pop    r10
+	pop    rdx
+	pop    rsi
+	pop    rdi
+	pop    rcx
+	pop    r11
+	pop    rsp
+	swapgs
+	o64 sysret
@@ -1,12 +1,17 @@
 #include "cgascr.h"
+#include "fbcon.h"
 #include "stdlib/algorithm.h"
 #include "stdlib/assert.h"
+#include "machine/spinlock.h"
 #include "io_port.h"
+#include "boot/page_table.h"
 #include "panic.h"
+#include "cpu.h"
 #include <stdint.h>
+#include <stdbool.h>
 
-static const size_t WIDTH = 80;
-static const size_t HEIGHT = 25;
+static const size_t WIDTH = CGA_COLUMNS;
+static const size_t HEIGHT = CGA_ROWS;
 
 typedef struct
 {
@@ -15,67 +20,189 @@ typedef struct
 } glyph;
 static const glyph clear_glyph = {0, CGA_DEFAULT_COLOR};
 
-glyph *screen = (glyph*) 0xC00B8000;
+glyph *screen = (glyph*) phys_to_kernel(0xB8000); // inside the kernel mapping
 size_t cursor_x = 0;
 size_t cursor_y = 0;
 
+// rows of 32 KiB video memory, the CRTC start address may point at any of them
+#define VIDEO_ROWS (0x8000 / sizeof(glyph) / CGA_COLUMNS)
+#define LINE_MASK (CGA_SCROLLBACK - 1)
+
+// Everything is drawn into a ring of lines first and copied to video memory
+// by flush(). Scrolling only advances `top`. Video memory is used as a window
+// as well: the CRTC start address follows the output until the window hits
+// the end, then the screen is repainted at row 0.
+glyph lines[CGA_SCROLLBACK][CGA_COLUMNS];
+// Columns [dirty_from, dirty_to) of a line differ, dirty_to == 0 means clean
+uint8_t dirty_from[CGA_SCROLLBACK];
+uint8_t dirty_to[CGA_SCROLLBACK];
+size_t top = 0;       // line shown in row 0 of the live screen
+size_t history = 0;   // lines kept above `top`
+size_t view = 0;      // lines scrolled back, 0 shows the live screen
+size_t shown = 0;     // line video row `origin` holds since the last flush
+size_t origin = 0;    // first video row the CRTC displays
+bool repaint = true;  // video memory doesn't match any lines
+bool cursor_moved = false;
 CGA_Color color = CGA_DEFAULT_COLOR;
 
-void show_glyph(size_t x, size_t y, glyph g)
+// Serializes all CPUs. Taken with interrupts disabled, since epilogues print too.
+Spinlock cga_lock = SPINLOCK_INIT;
+
+static inline unsigned long lock()
 {
-    assert(y < HEIGHT && x < WIDTH, "CGA video memory indexed out of bounds");
-    screen[y * WIDTH + x] = g;
+    unsigned long flags = spin_lock_irqsave(&cga_lock);
+    return flags;
 }
 
-void clear_row(size_t row)
+static inline void unlock(unsigned long flags)
 {
-    for(size_t col = 0; col < WIDTH; col++)
-        show_glyph(col, row, clear_glyph);
-    if(cursor_y == row)
-        CGA_setpos(0, cursor_y);
+    spin_unlock_irqrestore(&cga_lock, flags);
 }
 
-void CGA_clear()
+static inline size_t line_of(size_t row)
 {
-    for(size_t i = 0; i < HEIGHT; i++)
-        clear_row(i);
-    CGA_setpos(0, 0);
+    return (top + row) & LINE_MASK;
 }
 
-void CGA_show(size_t x, size_t y, char c)
+void show_glyph(size_t x, size_t y, glyph g)
 {
-    glyph g = {c, color};
-    show_glyph(x, y, g);
+    assert(y < HEIGHT && x < WIDTH, "CGA video memory indexed out of bounds");
+    size_t l = line_of(y);
+    lines[l][x] = g;
+    if(!dirty_to[l])
+    {
+        dirty_from[l] = x;
+        dirty_to[l] = x + 1;
+    }
+    else if(x < dirty_from[l])
+        dirty_from[l] = x;
+    else if(x >= dirty_to[l])
+        dirty_to[l] = x + 1;
 }
 
-void CGA_setpos(size_t x, size_t y)
+void setpos(size_t x, size_t y)
 {
     assert(y < HEIGHT && x < WIDTH, "CGA screen indexed out of bounds");
     cursor_x = x;
     cursor_y = y;
+    cursor_moved = true;
+}
 
-    size_t pos = y * WIDTH + x;
-    unsigned char high = (pos & 0xFF00) >> 8;
-    unsigned char low = pos & 0x00FF;
+static void crtc_write(uint8_t reg, uint16_t value)
+{
+    outb(0x3D4, reg);
+    outb(0x3D5, value >> 8);
+    outb(0x3D4, reg + 1);
+    outb(0x3D5, value & 0xFF);
+}
+
+// There is no start address to move on the framebuffer, a shifted view is
+// redrawn as a whole. fbcon skips the cells that stayed the same.
+static void flush_framebuffer()
+{
+    size_t first = (top - view) & LINE_MASK;
+    bool all = repaint || first != shown;
+
+    for(size_t row = 0; row < HEIGHT; row++)
+    {
+        size_t l = (first + row) & LINE_MASK;
+        if(all)
+            fbcon_draw(row, 0, WIDTH, (const uint8_t *)lines[l]);
+        else if(dirty_to[l])
+            fbcon_draw(row, dirty_from[l], dirty_to[l], (const uint8_t *)lines[l]);
+        dirty_to[l] = 0;
+    }
+    shown = first;
+    repaint = false;
 
-    outb(0x3D4, 14);
-    outb(0x3D5, high);
-    outb(0x3D4, 15);
-    outb(0x3D5, low);
+    if(cursor_moved || all)
+    {
+        cursor_moved = false;
+        fbcon_cursor(cursor_x, view + cursor_y);
+    }
+    fbcon_flush();
 }
 
-void CGA_getpos(size_t *x, size_t *y)
+// Brings video memory up to date with the viewed lines: moves the CRTC
+// start address along if the view only advanced, copies the dirty ranges
+// and places the hardware cursor.
+void flush()
 {
-    *x = cursor_x;
-    *y = cursor_y;
+    if(fbcon_enabled())
+    {
+        flush_framebuffer();
+        return;
+    }
+
+    size_t first = (top - view) & LINE_MASK;
+    size_t shift = (first - shown) & LINE_MASK;
+    size_t fresh = 0; // bottom rows to rewrite entirely
+
+    if(repaint || shift)
+    {
+        if(!repaint && shift < HEIGHT && origin + shift + HEIGHT <= VIDEO_ROWS)
+        {
+            origin += shift;
+            fresh = shift;
+        }
+        else
+        {
+            origin = 0;
+            fresh = HEIGHT;
+        }
+        crtc_write(12, origin * WIDTH);
+        shown = first;
+        repaint = false;
+        cursor_moved = true;
+    }
+
+    for(size_t row = 0; row < HEIGHT; row++)
+    {
+        size_t l = (first + row) & LINE_MASK;
+        glyph *video = &screen[(origin + row) * WIDTH];
+        if(row >= HEIGHT - fresh)
+            memcpy(video, lines[l], sizeof(lines[l]));
+        else if(dirty_to[l])
+            memcpy(&video[dirty_from[l]], &lines[l][dirty_from[l]], (dirty_to[l] - dirty_from[l]) * sizeof(glyph));
+        dirty_to[l] = 0;
+    }
+
+    if(!cursor_moved)
+        return;
+    cursor_moved = false;
+
+    // the CRTC cursor is addressed absolutely, hide it below the screen while
+    // the live screen is scrolled out of view
+    size_t row = view + cursor_y;
+    size_t pos = row < HEIGHT ? (origin + row) * WIDTH + cursor_x : (origin + HEIGHT) * WIDTH;
+    crtc_write(14, pos);
 }
 
-void CGA_scroll()
+void clear_row(size_t row)
+{
+    size_t l = line_of(row);
+    for(size_t col = 0; col < WIDTH; col++)
+        lines[l][col] = clear_glyph;
+    dirty_from[l] = 0;
+    dirty_to[l] = WIDTH;
+    if(cursor_y == row)
+        setpos(0, cursor_y);
+}
+
+// O(1): the oldest kept line becomes the new bottom row
+void scroll()
 {
-    memcpy(screen, &screen[WIDTH], (HEIGHT - 1) * WIDTH);
+    top = (top + 1) & LINE_MASK;
+    if(history < CGA_SCROLLBACK - HEIGHT)
+        history++;
+    // someone looking at the scrollback keeps seeing the same lines
+    if(view && view < history)
+        view++;
     clear_row(HEIGHT - 1);
 }
 
+void put_char(char c);
+
 void handle_control_char(char c)
 {
     switch(c)
@@ -98,9 +225,9 @@ void handle_control_char(char c)
         show_glyph(cursor_x, cursor_y, clear_glyph);
         break;
     case '\t':
-        CGA_putchar(' ');
+        put_char(' ');
         while (cursor_x % 4 != 0 && cursor_x < 80)
-            CGA_putchar(' ');
+            put_char(' ');
         break;
     case '\n':
         cursor_x = 0;
@@ -111,7 +238,7 @@ void handle_control_char(char c)
             cursor_y++;
             break;
         }
-        CGA_scroll();
+        scroll();
         break;
     case '\r': cursor_x = 0; break;
     default:
@@ -120,7 +247,7 @@ void handle_control_char(char c)
     }
 }
 
-void CGA_putchar(char c)
+void put_char(char c)
 {
     if(cursor_x == WIDTH)
         handle_control_char('\n');
@@ -131,19 +258,117 @@ void CGA_putchar(char c)
     }
     else
     {
-        CGA_show(cursor_x, cursor_y, c);
+        glyph g = {c, color};
+        show_glyph(cursor_x, cursor_y, g);
         cursor_x++;
     }
-    CGA_setpos(cursor_x, cursor_y);
+    setpos(cursor_x, cursor_y);
+    // a finished line goes out in one batch
+    if(c == '\n')
+        flush();
+}
+
+void CGA_clear()
+{
+    unsigned long flags = lock();
+    for(size_t i = 0; i < HEIGHT; i++)
+        clear_row(i);
+    view = 0;
+    repaint = true;
+    setpos(0, 0);
+    flush();
+    unlock(flags);
+}
+
+void CGA_show(size_t x, size_t y, char c)
+{
+    unsigned long flags = lock();
+    glyph g = {c, color};
+    show_glyph(x, y, g);
+    unlock(flags);
+}
+
+void CGA_setpos(size_t x, size_t y)
+{
+    unsigned long flags = lock();
+    setpos(x, y);
+    unlock(flags);
+}
+
+void CGA_getpos(size_t *x, size_t *y)
+{
+    *x = cursor_x;
+    *y = cursor_y;
+}
+
+void CGA_scroll()
+{
+    unsigned long flags = lock();
+    scroll();
+    unlock(flags);
+}
+
+void CGA_flush()
+{
+    unsigned long flags = lock();
+    flush();
+    unlock(flags);
+}
+
+void CGA_scrollback(int delta)
+{
+    unsigned long flags = lock();
+    if(delta < 0)
+        view = (size_t)-delta < view ? view + delta : 0;
+    else
+        view = view + delta < history ? view + delta : history;
+    flush();
+    unlock(flags);
+}
+
+void CGA_putchar(char c)
+{
+    unsigned long flags = lock();
+    put_char(c);
+    unlock(flags);
 }
 
 void CGA_puts(const char *s)
 {
+    unsigned long flags = lock();
     while(*s)
-        CGA_putchar(*s++);
+        put_char(*s++);
+    unlock(flags);
+}
+
+void CGA_write(const char *s, size_t n)
+{
+    unsigned long flags = lock();
+    for(size_t i = 0; i < n; i++)
+        put_char(s[i]);
+    unlock(flags);
 }
 
 void CGA_set_color(CGA_Color c)
 {
     color = c;
 }
+
+bool CGA_use_framebuffer()
+{
+    unsigned long flags = lock();
+    bool ok = fbcon_init();
+    if(ok)
+    {
+        repaint = true;
+        flush();
+    }
+    unlock(flags);
+    return ok;
+}
+
+// A panicking CPU may have been interrupted while holding the lock
+void CGA_force_unlock()
+{
+    spin_unlock(&cga_lock);
+}
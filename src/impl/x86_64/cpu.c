@@ -8,6 +8,24 @@ inline void int_disable()
 {
     asm("cli");
 }
+// disable interrupts and return the previous RFLAGS for int_restore()
+unsigned long int_save()
+{
+    unsigned long flags;
+    asm volatile("pushf\n\tpop %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+void int_restore(unsigned long flags)
+{
+    if(flags & (1 << 9))
+        asm volatile("sti" : : : "memory");
+}
+bool int_enabled()
+{
+    unsigned long flags;
+    asm volatile("pushf\n\tpop %0" : "=r"(flags));
+    return flags & (1 << 9);
+}
 inline void cpu_idle()
 {
     asm("sti");
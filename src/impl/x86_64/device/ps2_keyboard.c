@@ -1,36 +1,158 @@
 #include "device/ps2_keyboard.h"
 #include "plugbox.h"
-#include "pic.h"
-#include "cgascr.h"
+#include "machine/irq.h"
+#include "thread/waitqueue.h"
+#include "thread/workqueue.h"
 #include "key.h"
 #include "keyctrl.h"
+#include "klog.h"
+#include "intstat.h"
+#include "thread/schedtrace.h"
+#include "profile.h"
 #include <stdbool.h>
+#include <stddef.h>
 
-Key key;
+#define KEYBOARD_BUFFER 64 // power of two
+#define PROFILE_PERIOD 1000 // us between samples started by Ctrl-Alt-F10
+
+// ---------------- QUEUE START ----------------
+// Single producer (the prologue, on the CPU the IRQ is routed to) and single
+// consumer (whoever holds readers.lock). Both indices only grow, their
+// difference is the number of buffered keys.
+typedef struct
+{
+    Key slots[KEYBOARD_BUFFER];
+    unsigned int head; // next slot to read, only written by the consumer
+    unsigned int tail; // next slot to write, only written by the producer
+} KeyRing;
+
+bool ring_put(KeyRing *r, Key key)
+{
+    unsigned int tail = r->tail;
+    if(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == KEYBOARD_BUFFER)
+        return false;
+    r->slots[tail % KEYBOARD_BUFFER] = key;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool ring_get(KeyRing *r, Key *key)
+{
+    unsigned int head = r->head;
+    if(head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+        return false;
+    *key = r->slots[head % KEYBOARD_BUFFER];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+// ----------------- QUEUE END -----------------
+
+KeyRing ring;
+unsigned int keyboard_dropped = 0; // keys lost to a full buffer
+
+// Its lock also serializes readers. Only taken at epilogue level, so
+// prologues never wait for it.
+WaitQueue readers = WAITQUEUE_INIT;
+// key combos handled by the epilogue
+bool dump_intstat = false;     // Ctrl-Alt-F12, with the lock statistics
+bool export_schedtrace = false; // Ctrl-Alt-F11
+bool toggle_profile = false;    // Ctrl-Alt-F10, stopping exports the samples
+
+// Exports wait for the serial port, a worker does them outside the guard
+static void export_schedtrace_work(Work *work)
+{
+    (void)work;
+    schedtrace_export();
+}
+
+static void export_profile_work(Work *work)
+{
+    (void)work;
+    profile_export();
+}
+
+static Work schedtrace_work = WORK_INIT(export_schedtrace_work);
+static Work profile_work = WORK_INIT(export_profile_work);
 
 bool ps2kbd_prologue()
 {
-    key = keyctrl_key_hit();
+    Key key = keyctrl_key_hit();
     if (!key_valid(key))
         return false;
 
     if (key_ctrl(key) && key_alt(key) && key.scancode == key_del)
         keyctrl_reboot();
 
+    if (key_ctrl(key) && key_alt(key) && key.scancode == key_f12)
+    {
+        __atomic_store_n(&dump_intstat, true, __ATOMIC_RELAXED);
+        return true;
+    }
+    if (key_ctrl(key) && key_alt(key) && key.scancode == key_f11)
+    {
+        __atomic_store_n(&export_schedtrace, true, __ATOMIC_RELAXED);
+        return true;
+    }
+    if (key_ctrl(key) && key_alt(key) && key.scancode == key_f10)
+    {
+        __atomic_store_n(&toggle_profile, true, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    if (!ring_put(&ring, key))
+    {
+        if(!keyboard_dropped++)
+            klog_at(KLOG_WARNING, "ps2kbd: buffer full, dropping keys\n");
+        return false;
+    }
     return true;
 }
 
-void ps2kbd_epilogue()
+void ps2kbd_epilogue(unsigned int count)
+{
+    (void)count; // the keys themselves wait in the ring
+    if(__atomic_exchange_n(&dump_intstat, false, __ATOMIC_RELAXED))
+    {
+        intstat_dump();
+        lock_stats_dump();
+    }
+    if(__atomic_exchange_n(&export_schedtrace, false, __ATOMIC_RELAXED))
+        workqueue_queue(&schedtrace_work);
+    if(__atomic_exchange_n(&toggle_profile, false, __ATOMIC_RELAXED))
+    {
+        if(!profiling)
+            profile_start(PROFILE_PERIOD);
+        else
+        {
+            profile_stop();
+            workqueue_queue(&profile_work);
+        }
+    }
+    // every reader retries, those finding the ring empty block again
+    spin_lock(&readers.lock);
+    waitqueue_wake_all(&readers);
+    spin_unlock(&readers.lock);
+}
+
+Key keyboard_read()
 {
-    pic_forbid(pic_keyboard);
-    Key copy = key;
-    pic_allow(pic_keyboard);
-    CGA_putchar(copy.ascii);
+    Key key;
+    spin_lock(&readers.lock);
+    while(!ring_get(&ring, &key))
+    {
+        // queued before unlocking, the next epilogue is sure to see us
+        waitqueue_sleep(&readers);
+        spin_lock(&readers.lock);
+    }
+    spin_unlock(&readers.lock);
+    return key;
 }
 
 void ps2kbd_plugin()
 {
-    key = new_key();
-    plugbox_assign(int_keyboard, new_interrupt_handler(ps2kbd_prologue, ps2kbd_epilogue));
-    pic_allow(pic_keyboard);
+    static interrupt_handler ps2kbd_handler = INTERRUPT_HANDLER(ps2kbd_prologue, ps2kbd_epilogue);
+    plugbox_assign(int_keyboard, &ps2kbd_handler);
+    irq_allow(pic_keyboard);
+    // the replies to its commands arrive through the handler
+    keyctrl_init();
 }
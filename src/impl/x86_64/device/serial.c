@@ -0,0 +1,217 @@
+#include "device/serial.h"
+#include "plugbox.h"
+#include "machine/irq.h"
+#include "machine/spinlock.h"
+#include "io_port.h"
+#include "cpu.h"
+#include "stdlib/string.h"
+#include <stdbool.h>
+
+#define COM1 0x3F8
+#define SERIAL_FIFO 16      // bytes the 16550 takes at once
+#define SERIAL_BUFFER 4096  // power of two
+#define SERIAL_DIVISOR 1    // 115200 baud
+
+// register offsets from the base port
+enum
+{
+    uart_data = 0,
+    uart_ier = 1,
+    uart_iir = 2, // read
+    uart_fcr = 2, // write
+    uart_lcr = 3,
+    uart_mcr = 4,
+    uart_lsr = 5,
+    uart_msr = 6,
+};
+
+enum
+{
+    ier_thre = 1 << 1,
+    lsr_thre = 1 << 5,
+    iir_none = 1 << 0,
+    lcr_8n1 = 0x03,
+    lcr_dlab = 1 << 7,
+    fcr_enable_clear = 0xC7, // 14 byte receive trigger
+    mcr_dtr_rts_out2 = 0x0B, // OUT2 gates the IRQ line
+    mcr_loopback = 0x1E,
+};
+
+static char buffer[SERIAL_BUFFER];
+static unsigned int head = 0;     // next byte to queue
+static unsigned int tail = 0;     // next byte to send
+static unsigned int dropped = 0;  // lost to a full buffer
+static bool present = false;
+static bool queued = false;       // interrupt driven, else polled
+static bool busy = false;         // bytes in flight, a THRE interrupt will follow
+// taken from prologues as well
+static Spinlock serial_lock = SPINLOCK_INIT;
+
+static void send_polled(char c)
+{
+    while(!(inb(COM1 + uart_lsr) & lsr_thre))
+        asm volatile("pause");
+    outb(COM1 + uart_data, c);
+}
+
+// caller holds serial_lock and knows the transmit FIFO is empty
+static bool fill_fifo()
+{
+    unsigned int n = 0;
+    for(; n < SERIAL_FIFO && tail != head; n++, tail++)
+        outb(COM1 + uart_data, buffer[tail % SERIAL_BUFFER]);
+    return n > 0;
+}
+
+static void put_byte(char c)
+{
+    if(!queued)
+        send_polled(c);
+    else if(head - tail == SERIAL_BUFFER)
+        dropped++;
+    else
+        buffer[head++ % SERIAL_BUFFER] = c;
+}
+
+void serial_init()
+{
+    lock_name(&serial_lock, "serial");
+    outb(COM1 + uart_ier, 0);
+    outb(COM1 + uart_lcr, lcr_dlab);
+    outb(COM1 + uart_data, SERIAL_DIVISOR & 0xFF);
+    outb(COM1 + uart_ier, SERIAL_DIVISOR >> 8);
+    outb(COM1 + uart_lcr, lcr_8n1);
+    outb(COM1 + uart_fcr, fcr_enable_clear);
+
+    // a missing port doesn't echo in loopback mode
+    outb(COM1 + uart_mcr, mcr_loopback);
+    outb(COM1 + uart_data, 0xAE);
+    present = inb(COM1 + uart_data) == 0xAE;
+    outb(COM1 + uart_mcr, mcr_dtr_rts_out2);
+}
+
+bool serial_prologue()
+{
+    spin_lock(&serial_lock);
+    for(uint8_t iir; !((iir = inb(COM1 + uart_iir)) & iir_none);)
+    {
+        switch((iir >> 1) & 7)
+        {
+        case 1: // transmit FIFO empty
+            if(!fill_fifo())
+            {
+                busy = false;
+                outb(COM1 + uart_ier, 0);
+            }
+            break;
+        case 2: // received data, nobody reads it
+        case 6:
+            inb(COM1 + uart_data);
+            break;
+        case 3:
+            inb(COM1 + uart_lsr);
+            break;
+        default:
+            inb(COM1 + uart_msr);
+            break;
+        }
+    }
+    spin_unlock(&serial_lock);
+    return false;
+}
+
+void serial_plugin()
+{
+    if(!present)
+        return;
+    static interrupt_handler serial_handler = INTERRUPT_HANDLER(serial_prologue, NULL);
+    plugbox_assign(int_com1, &serial_handler);
+
+    unsigned long flags = spin_lock_irqsave(&serial_lock);
+    queued = true;
+    spin_unlock_irqrestore(&serial_lock, flags);
+
+    irq_allow(pic_com1);
+}
+
+// an idle transmitter needs a first batch to get the interrupts going,
+// caller holds serial_lock
+static void start()
+{
+    if(queued && !busy && fill_fifo())
+    {
+        busy = true;
+        outb(COM1 + uart_ier, ier_thre);
+    }
+}
+
+void serial_write(const char *s, size_t n)
+{
+    if(!present)
+        return;
+
+    unsigned long flags = spin_lock_irqsave(&serial_lock);
+    for(size_t i = 0; i < n; i++)
+    {
+        if(s[i] == '\n')
+            put_byte('\r');
+        put_byte(s[i]);
+    }
+    start();
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+void serial_write_all(const char *s, size_t n)
+{
+    if(!present)
+        return;
+
+    size_t done = 0;
+    while(done < n)
+    {
+        unsigned long flags = spin_lock_irqsave(&serial_lock);
+        // room for a '\r' as well
+        while(done < n && (!queued || head - tail <= SERIAL_BUFFER - 2))
+        {
+            if(s[done] == '\n')
+                put_byte('\r');
+            put_byte(s[done++]);
+        }
+        // the interrupt may go to a CPU that can't take it right now, refill
+        // an empty FIFO from here as well
+        if(done < n && (inb(COM1 + uart_lsr) & lsr_thre))
+            fill_fifo();
+        start();
+        spin_unlock_irqrestore(&serial_lock, flags);
+        if(done < n)
+            asm volatile("pause");
+    }
+}
+
+unsigned int serial_dropped()
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+void serial_putchar(char c)
+{
+    serial_write(&c, 1);
+}
+
+void serial_puts(const char *s)
+{
+    serial_write(s, strlen(s));
+}
+
+// A panicking CPU may have been interrupted while holding the lock
+void serial_panic()
+{
+    if(!present)
+        return;
+    spin_unlock(&serial_lock);
+    outb(COM1 + uart_ier, 0);
+    queued = false;
+    busy = false;
+    while(tail != head)
+        send_polled(buffer[tail++ % SERIAL_BUFFER]);
+}
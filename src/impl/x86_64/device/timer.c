@@ -0,0 +1,301 @@
+#include "device/timer.h"
+#include "machine/pit.h"
+#include "machine/clock.h"
+#include "machine/spinlock.h"
+#include "plugbox.h"
+#include "machine/irq.h"
+#include "cpu.h"
+#include "boot/cmdline.h"
+#include <stddef.h>
+
+// The PIT only runs until the next deadline. With nothing queued it is still
+// programmed for the longest one-shot, it is the only clock we have.
+#define PIT_MAX_TICKS 0xF000 // leaves room to tell a wrapped counter apart
+#define PIT_MIN_TICKS 60     // ~50 us, against interrupt storms
+
+static Spinlock timer_lock = SPINLOCK_INIT;
+static uint64_t ticks = 0;       // PIT ticks accounted for so far
+static uint16_t programmed = 0;  // length of the running one-shot
+static uint64_t wakeup = 0;      // us at which the running one-shot fires
+static uint64_t max_ticks = PIT_MAX_TICKS; // see the tick= option
+
+static inline uint64_t ticks_to_us(uint64_t t)
+{
+    return t * 1000000 / PIT_HZ;
+}
+
+static inline uint64_t us_to_ticks(uint64_t us)
+{
+    return (us * PIT_HZ + 999999) / 1000000;
+}
+
+// Ticks since the running one-shot was started. After the terminal count
+// mode 0 wraps around to 0xFFFF and keeps counting down, so a count above
+// `programmed` means the interrupt is late by 0x10000 - count ticks.
+static inline uint64_t elapsed(uint16_t count)
+{
+    return count <= programmed ? programmed - count : programmed + (0x10000 - count);
+}
+
+// adds what passed of the running one-shot, caller holds timer_lock
+static void account()
+{
+    if(!programmed)
+        return;
+    ticks += elapsed(pit_count());
+    programmed = 0;
+}
+
+// ---------------- QUEUE START ----------------
+// Hierarchical timing wheel. Level 0 has a slot per jiffy, a slot of level n
+// spans all 64 slots of level n-1. Timers sit in the level their remaining
+// time falls into and cascade down whenever the level below wraps around, so
+// arming, cancelling and expiring are O(1) per timer and jiffy. Every level
+// keeps a bitmap of its non-empty slots, which lets the clock skip idle spans.
+#define JIFFY_SHIFT 8 // 256 us, a timer fires less than one jiffy late
+#define WHEEL_SHIFT 6 // 64 slots for the uint64_t bitmaps
+#define WHEEL_SLOTS (1 << WHEEL_SHIFT)
+#define WHEEL_LEVELS 5 // ~3 days, farther deadlines are re-sorted on the way
+#define BUCKET_DUE (WHEEL_LEVELS * WHEEL_SLOTS)
+
+static Timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t occupied[WHEEL_LEVELS];
+static uint64_t wheel_time = 0; // next jiffy to expire
+static Timer *due = NULL;        // expired, callback pending, oldest first
+static Timer **due_tail = &due;
+
+static inline Timer **bucket_head(unsigned int bucket)
+{
+    return &wheel[bucket / WHEEL_SLOTS][bucket % WHEEL_SLOTS];
+}
+
+static void unlink(Timer *timer)
+{
+    *timer->pprev = timer->next;
+    if(timer->next)
+        timer->next->pprev = timer->pprev;
+    else if(timer->bucket == BUCKET_DUE)
+        due_tail = timer->pprev;
+
+    if(timer->bucket != BUCKET_DUE && !*bucket_head(timer->bucket))
+        occupied[timer->bucket / WHEEL_SLOTS] &= ~(1ULL << (timer->bucket % WHEEL_SLOTS));
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->armed = false;
+}
+
+static void insert(Timer *timer)
+{
+    timer->armed = true;
+    uint64_t expires = (timer->deadline + (1 << JIFFY_SHIFT) - 1) >> JIFFY_SHIFT;
+    if(expires < wheel_time)
+    {
+        timer->bucket = BUCKET_DUE;
+        timer->next = NULL;
+        timer->pprev = due_tail;
+        *due_tail = timer;
+        due_tail = &timer->next;
+        return;
+    }
+
+    uint64_t delta = expires - wheel_time;
+    unsigned int level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >> (WHEEL_SHIFT * (level + 1)))
+        level++;
+    if(delta >> (WHEEL_SHIFT * WHEEL_LEVELS))
+        expires = wheel_time + (1ULL << (WHEEL_SHIFT * WHEEL_LEVELS)) - 1;
+
+    unsigned int slot = (expires >> (WHEEL_SHIFT * level)) & (WHEEL_SLOTS - 1);
+    Timer **head = &wheel[level][slot];
+    timer->bucket = level * WHEEL_SLOTS + slot;
+    timer->next = *head;
+    if(*head)
+        (*head)->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+    occupied[level] |= 1ULL << slot;
+}
+
+// re-sorts one slot into the levels below
+static void cascade(unsigned int level, unsigned int slot)
+{
+    Timer *timer = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    occupied[level] &= ~(1ULL << slot);
+    while(timer)
+    {
+        Timer *next = timer->next;
+        insert(timer);
+        timer = next;
+    }
+}
+
+// first jiffy with anything to do, UINT64_MAX if the wheel is empty
+static uint64_t next_jiffy()
+{
+    uint64_t next = UINT64_MAX;
+    unsigned int index = wheel_time & (WHEEL_SLOTS - 1);
+    if(occupied[0])
+    {
+        // level 0 holds the next 64 jiffies, starting at `index`
+        uint64_t ahead = occupied[0] >> index | (index ? occupied[0] << (WHEEL_SLOTS - index) : 0);
+        next = wheel_time + __builtin_ctzll(ahead);
+    }
+    for(unsigned int level = 1; level < WHEEL_LEVELS; level++)
+    {
+        if(!occupied[level])
+            continue;
+        uint64_t span = 1ULL << (WHEEL_SHIFT * level);
+        uint64_t boundary = (wheel_time + span - 1) & ~(span - 1);
+        if(boundary < next)
+            next = boundary;
+    }
+    return next;
+}
+
+// moves every timer due at `now` (in us) to the due list
+static void advance(uint64_t now)
+{
+    uint64_t jiffy = now >> JIFFY_SHIFT;
+    while(wheel_time <= jiffy)
+    {
+        uint64_t next = next_jiffy();
+        if(next > jiffy)
+        {
+            wheel_time = jiffy + 1;
+            break;
+        }
+        wheel_time = next;
+
+        for(unsigned int level = 1; level < WHEEL_LEVELS; level++)
+        {
+            if(wheel_time & ((1ULL << (WHEEL_SHIFT * level)) - 1))
+                break;
+            cascade(level, (wheel_time >> (WHEEL_SHIFT * level)) & (WHEEL_SLOTS - 1));
+        }
+
+        unsigned int slot = wheel_time & (WHEEL_SLOTS - 1);
+        wheel_time++;
+        // with wheel_time past it, insert() puts everything on the due list
+        cascade(0, slot);
+    }
+}
+
+// first timer due at `now`, removed from the queue
+static Timer *pop_expired(uint64_t now)
+{
+    advance(now);
+    Timer *timer = due;
+    if(timer)
+        unlink(timer);
+    return timer;
+}
+// ----------------- QUEUE END -----------------
+
+// caller holds timer_lock and has called account()
+static void program()
+{
+    uint64_t delta = max_ticks;
+    uint64_t now = ticks_to_us(ticks);
+    uint64_t next = due ? 0 : next_jiffy();
+    if(next != UINT64_MAX)
+    {
+        uint64_t target = next << JIFFY_SHIFT;
+        uint64_t until = target > now ? us_to_ticks(target - now) : 0;
+        if(until < delta)
+            delta = until;
+    }
+    if(delta < PIT_MIN_TICKS)
+        delta = PIT_MIN_TICKS;
+    programmed = delta;
+    wakeup = ticks_to_us(ticks + delta);
+    pit_oneshot(delta);
+}
+
+Timer new_timer(void (*callback)(Timer *timer))
+{
+    Timer t = {0, callback, false, 0, NULL, NULL};
+    return t;
+}
+
+uint64_t timer_now()
+{
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    uint64_t t = ticks;
+    if(programmed)
+        t += elapsed(pit_count());
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return ticks_to_us(t);
+}
+
+void timer_arm(Timer *timer, uint64_t deadline)
+{
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    if(timer->armed)
+        unlink(timer);
+    timer->deadline = deadline;
+    insert(timer);
+    // only a deadline before the programmed one needs the PIT to be reprogrammed
+    if(deadline < wakeup)
+    {
+        account();
+        program();
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+void timer_cancel(Timer *timer)
+{
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    if(timer->armed)
+        unlink(timer);
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+bool timer_prologue()
+{
+    spin_lock(&timer_lock);
+    account();
+    clock_pit_update(ticks_to_us(ticks));
+    advance(ticks_to_us(ticks));
+    bool expired = due != NULL;
+    // keep the clock running until the epilogue gets to the expired timers
+    program();
+    spin_unlock(&timer_lock);
+    return expired;
+}
+
+// handles every expired timer, however many interrupts were coalesced
+void timer_epilogue(unsigned int count)
+{
+    (void)count;
+    for(;;)
+    {
+        unsigned long flags = spin_lock_irqsave(&timer_lock);
+        account();
+        Timer *timer = pop_expired(ticks_to_us(ticks));
+        // with more due, ask for another interrupt in case the callback switches coroutines
+        program();
+        spin_unlock_irqrestore(&timer_lock, flags);
+
+        if(!timer)
+            break;
+        timer->callback(timer);
+    }
+}
+
+void timer_init()
+{
+    lock_name(&timer_lock, "timer");
+    uint64_t tick = us_to_ticks(cmdline_uint("tick", 0));
+    if(tick >= PIT_MIN_TICKS && tick < PIT_MAX_TICKS)
+        max_ticks = tick;
+    static interrupt_handler timer_handler = INTERRUPT_HANDLER(timer_prologue, timer_epilogue);
+    plugbox_assign(int_timer, &timer_handler);
+
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    program();
+    spin_unlock_irqrestore(&timer_lock, flags);
+
+    irq_allow(pic_timer);
+}
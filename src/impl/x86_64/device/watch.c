@@ -0,0 +1,37 @@
+#include "device/watch.h"
+#include "device/timer.h"
+#include <stddef.h>
+
+// periodic tick for time slicing, on top of the timer queue
+static Timer watch_timer;
+static uint64_t period = 0;
+static void (*action)() = NULL;
+
+void watch_epilogue(){}
+
+void watch_fire(Timer *timer)
+{
+    // re-arm first, the action may switch to another coroutine
+    timer_arm(timer, timer->deadline + period);
+    action();
+}
+
+void watch_plugin(void (*epilogue)())
+{
+    if(epilogue == NULL)
+    {
+        epilogue = watch_epilogue;
+    }
+    action = epilogue;
+    watch_timer = new_timer(watch_fire);
+    if(period)
+        timer_arm(&watch_timer, timer_now() + period);
+}
+
+// the epilogue runs once every `iterations` + 1 periods of `us`
+void watch_set(unsigned int us, unsigned int iterations)
+{
+    period = (uint64_t)us * (iterations + 1);
+    if(action)
+        timer_arm(&watch_timer, timer_now() + period);
+}
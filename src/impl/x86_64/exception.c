@@ -1,6 +1,9 @@
 #include "exception.h"
 #include "plugbox.h"
 #include "panic.h"
+#include "machine/fpu.h"
+#include "machine/percpu.h"
+#include "memory/address_space.h"
 #include <stdbool.h>
 #include <stddef.h>
 
@@ -100,7 +103,9 @@ bool ud_prologue()
 // The saved instruction pointer points to the instruction that caused the exception
 bool nm_prologue()
 {
-    panic("Device Not Available");
+    // CR0.TS is set on every context switch, see machine/fpu.h
+    if(!fpu_restore())
+        panic("Device Not Available");
     return false;
 }
 
@@ -164,9 +169,19 @@ bool gp_prologue()
 // Protection check (privileges, read/write) failed
 // Reserved bit in the page directory or table entries is set to 1
 // The saved instruction pointer points to the instruction which caused the exception
+// CR2 holds the faulting address. The vector has an interrupt gate, so no
+// other fault can overwrite it before it is read here.
+// Faults inside regions of the address space are resolved: missing pages
+// are backed on demand, stacks grow and copy-on-write pages are copied.
 bool pf_prologue()
 {
-    panic("Page Fault");
+    uintptr_t addr;
+    asm volatile("mov %%cr2, %0" : "=r"(addr));
+    ExceptionFrame *frame = exception_frame();
+    PerCPU *cpu = cpu_this();
+    AddressSpace *space = cpu->space ? cpu->space : &kernel_space;
+    if(!address_space_fault(space, addr, frame->error_code, frame->rsp))
+        panicf("Page Fault at 0x%lx, error code 0x%lx, rip 0x%lx", addr, frame->error_code, frame->rip);
     return false;
 }
 
@@ -259,29 +274,42 @@ bool sx_prologue()
 }
 
 
+ExceptionFrame *exception_frame()
+{
+    return cpu_this()->exception;
+}
+
+static interrupt_handler handlers[32];
+
+static void assign(interrupt_number slot, bool (*prologue)())
+{
+    handlers[slot] = new_interrupt_handler(prologue, NULL);
+    plugbox_assign(slot, &handlers[slot]);
+}
+
 void exception_defaults()
 {
-    plugbox_assign(int_de, new_interrupt_handler(de_prologue, NULL));
-    plugbox_assign(int_db, new_interrupt_handler(db_prologue, NULL));
-    plugbox_assign(int_nmi, new_interrupt_handler(nmi_prologue, NULL));
-    plugbox_assign(int_bp, new_interrupt_handler(bp_prologue, NULL));
-    plugbox_assign(int_of, new_interrupt_handler(of_prologue, NULL));
-    plugbox_assign(int_br, new_interrupt_handler(br_prologue, NULL));
-    plugbox_assign(int_ud, new_interrupt_handler(ud_prologue, NULL));
-    plugbox_assign(int_nm, new_interrupt_handler(nm_prologue, NULL));
-    plugbox_assign(int_df, new_interrupt_handler(df_prologue, NULL));
-    plugbox_assign(int_ts, new_interrupt_handler(ts_prologue, NULL));
-    plugbox_assign(int_np, new_interrupt_handler(np_prologue, NULL));
-    plugbox_assign(int_ss, new_interrupt_handler(ss_prologue, NULL));
-    plugbox_assign(int_gp, new_interrupt_handler(gp_prologue, NULL));
-    plugbox_assign(int_pf, new_interrupt_handler(pf_prologue, NULL));
-    plugbox_assign(int_mf, new_interrupt_handler(mf_prologue, NULL));
-    plugbox_assign(int_ac, new_interrupt_handler(ac_prologue, NULL));
-    plugbox_assign(int_mc, new_interrupt_handler(mc_prologue, NULL));
-    plugbox_assign(int_xm, new_interrupt_handler(xm_prologue, NULL));
-    plugbox_assign(int_ve, new_interrupt_handler(ve_prologue, NULL));
-    plugbox_assign(int_cp, new_interrupt_handler(cp_prologue, NULL));
-    plugbox_assign(int_hv, new_interrupt_handler(hv_prologue, NULL));
-    plugbox_assign(int_vc, new_interrupt_handler(vc_prologue, NULL));
-    plugbox_assign(int_sx, new_interrupt_handler(sx_prologue, NULL));
+    assign(int_de, de_prologue);
+    assign(int_db, db_prologue);
+    assign(int_nmi, nmi_prologue);
+    assign(int_bp, bp_prologue);
+    assign(int_of, of_prologue);
+    assign(int_br, br_prologue);
+    assign(int_ud, ud_prologue);
+    assign(int_nm, nm_prologue);
+    assign(int_df, df_prologue);
+    assign(int_ts, ts_prologue);
+    assign(int_np, np_prologue);
+    assign(int_ss, ss_prologue);
+    assign(int_gp, gp_prologue);
+    assign(int_pf, pf_prologue);
+    assign(int_mf, mf_prologue);
+    assign(int_ac, ac_prologue);
+    assign(int_mc, mc_prologue);
+    assign(int_xm, xm_prologue);
+    assign(int_ve, ve_prologue);
+    assign(int_cp, cp_prologue);
+    assign(int_hv, hv_prologue);
+    assign(int_vc, vc_prologue);
+    assign(int_sx, sx_prologue);
 }
@@ -0,0 +1,206 @@
+#include "fbcon.h"
+#include "cgascr.h"
+#include "font.h"
+#include "memory/paging.h"
+#include "stdlib/memory.h"
+#include "stdlib/stdio.h"
+
+// The framebuffer gets the last GiB of the address space, above the kernel image
+#define FB_WINDOW 0xFFFFFFFFC0000000UL
+#define FB_WINDOW_SIZE (1UL << 30)
+#define GLYPH_CACHE 256 // rasterized cells, power of two
+#define NO_CELL 0xFFFF  // matches no character/attribute pair a cell is drawn with
+#define PAIRS (FBCON_CELL_WIDTH / 2)
+
+// A cell as stored to the framebuffer, two pixels per 64-bit store
+typedef struct
+{
+    uint16_t key; // character | attribute << 8
+    uint64_t rows[FBCON_CELL_HEIGHT][PAIRS];
+} CachedCell;
+
+// CGA colors as 8-bit RGB, brown being the usual dark yellow
+static const uint8_t cga_rgb[16][3] =
+{
+    {0x00, 0x00, 0x00}, {0x00, 0x00, 0xAA}, {0x00, 0xAA, 0x00}, {0x00, 0xAA, 0xAA},
+    {0xAA, 0x00, 0x00}, {0xAA, 0x00, 0xAA}, {0xAA, 0x55, 0x00}, {0xAA, 0xAA, 0xAA},
+    {0x55, 0x55, 0x55}, {0x55, 0x55, 0xFF}, {0x55, 0xFF, 0x55}, {0x55, 0xFF, 0xFF},
+    {0xFF, 0x55, 0x55}, {0xFF, 0x55, 0xFF}, {0xFF, 0xFF, 0x55}, {0xFF, 0xFF, 0xFF},
+};
+
+static struct
+{
+    uintptr_t phys;
+    uint32_t pitch, width, height;
+    uint8_t shift[3], size[3]; // red, green, blue
+} fb;
+static bool found = false;
+static bool enabled = false;
+static uint8_t *grid;             // top left pixel of the text grid
+static uint32_t palette[16];      // in framebuffer format
+static CachedCell *cache;         // direct mapped by hashing the key
+static uint16_t shown[CGA_ROWS][CGA_COLUMNS]; // keys on screen, NO_CELL if none
+static size_t cursor_x = CGA_COLUMNS, cursor_y = CGA_ROWS; // hidden
+
+void fbcon_set_info(struct multiboot_tag_framebuffer *tag)
+{
+    struct multiboot_tag_framebuffer_common *common = &tag->common;
+    printf("Framebuffer at 0x%lx, %ux%u, %u bpp, type %u\n",
+            (unsigned long)common->framebuffer_addr, common->framebuffer_width,
+            common->framebuffer_height, common->framebuffer_bpp, common->framebuffer_type);
+    if(common->framebuffer_type != MULTIBOOT_FRAMEBUFFER_TYPE_RGB || common->framebuffer_bpp != 32)
+        return;
+
+    fb.phys = common->framebuffer_addr;
+    fb.pitch = common->framebuffer_pitch;
+    fb.width = common->framebuffer_width;
+    fb.height = common->framebuffer_height;
+    fb.shift[0] = tag->framebuffer_red_field_position;
+    fb.size[0] = tag->framebuffer_red_mask_size;
+    fb.shift[1] = tag->framebuffer_green_field_position;
+    fb.size[1] = tag->framebuffer_green_mask_size;
+    fb.shift[2] = tag->framebuffer_blue_field_position;
+    fb.size[2] = tag->framebuffer_blue_mask_size;
+    found = true;
+}
+
+static uint32_t convert(const uint8_t rgb[3])
+{
+    uint32_t pixel = 0;
+    for(unsigned int c = 0; c < 3; c++)
+        if(fb.size[c] && fb.size[c] <= 8)
+            pixel |= (uint32_t)(rgb[c] >> (8 - fb.size[c])) << fb.shift[c];
+    return pixel;
+}
+
+// clears everything mapped, the borders around the grid included
+static void clear(size_t size)
+{
+    uint64_t pair = palette[0] | (uint64_t)palette[0] << 32;
+    volatile uint64_t *p = (volatile uint64_t *)FB_WINDOW;
+    for(size_t i = 0; i < size / sizeof(uint64_t); i++)
+        p[i] = pair;
+}
+
+bool fbcon_init()
+{
+    size_t grid_width = CGA_COLUMNS * FBCON_CELL_WIDTH, grid_height = CGA_ROWS * FBCON_CELL_HEIGHT;
+    if(!found || fb.width < grid_width || fb.height < grid_height)
+        return false;
+
+    uintptr_t base = fb.phys & ~(PAGE_SIZE - 1);
+    size_t size = (fb.phys - base + (size_t)fb.pitch * fb.height + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if(size > FB_WINDOW_SIZE)
+        return false;
+    cache = kmalloc(GLYPH_CACHE * sizeof(CachedCell));
+    if(!cache)
+        return false;
+
+    // page by page: pte_pat only selects the PAT entry in 4 KiB pages
+    uint64_t flags = pte_writable | (paging_write_combining() ? pte_pat : pte_cache_disable);
+    for(size_t offset = 0; offset < size; offset += PAGE_SIZE)
+        if(!paging_map(paging_kernel_root(), FB_WINDOW + offset, base + offset, PAGE_SIZE, flags))
+        {
+            paging_unmap(paging_kernel_root(), FB_WINDOW, offset);
+            kfree(cache);
+            return false;
+        }
+
+    for(unsigned int i = 0; i < 16; i++)
+        palette[i] = convert(cga_rgb[i]);
+    for(unsigned int i = 0; i < GLYPH_CACHE; i++)
+        cache[i].key = NO_CELL;
+    for(size_t y = 0; y < CGA_ROWS; y++)
+        for(size_t x = 0; x < CGA_COLUMNS; x++)
+            shown[y][x] = NO_CELL;
+
+    // an even column keeps the pixel pairs 8-byte aligned on common pitches
+    size_t left = ((fb.width - grid_width) / 2) & ~1UL;
+    size_t top = (fb.height - grid_height) / 2;
+    grid = (uint8_t *)FB_WINDOW + (fb.phys - base) + top * fb.pitch + left * sizeof(uint32_t);
+    clear(size);
+    fbcon_flush();
+    enabled = true;
+    return true;
+}
+
+bool fbcon_enabled()
+{
+    return enabled;
+}
+
+// looks a cell up in the cache, rasterizing it on a miss
+static const CachedCell *rasterize(uint16_t key)
+{
+    CachedCell *cell = &cache[((uint32_t)key * 2654435761u) >> 24 & (GLYPH_CACHE - 1)];
+    if(cell->key == key)
+        return cell;
+
+    uint32_t fg = palette[key >> 8 & 15], bg = palette[key >> 12 & 7];
+    const uint8_t *bits = font_glyph(key & 0xFF);
+    for(unsigned int y = 0; y < FBCON_CELL_HEIGHT; y++)
+    {
+        // the 8x8 font drawn with doubled rows
+        uint8_t line = bits[y * FONT_HEIGHT / FBCON_CELL_HEIGHT];
+        for(unsigned int p = 0; p < PAIRS; p++)
+        {
+            uint32_t left = line & (0x80 >> (2 * p)) ? fg : bg;
+            uint32_t right = line & (0x40 >> (2 * p)) ? fg : bg;
+            cell->rows[y][p] = left | (uint64_t)right << 32;
+        }
+    }
+    cell->key = key;
+    return cell;
+}
+
+static void blit(size_t row, size_t col)
+{
+    uint16_t key = shown[row][col];
+    if(key == NO_CELL)
+        return;
+    const CachedCell *cell = rasterize(key);
+    uint8_t *line = grid + row * FBCON_CELL_HEIGHT * fb.pitch + col * FBCON_CELL_WIDTH * sizeof(uint32_t);
+    bool cursor = row == cursor_y && col == cursor_x;
+    uint64_t underline = palette[key >> 8 & 15] * 0x100000001UL;
+
+    for(unsigned int y = 0; y < FBCON_CELL_HEIGHT; y++, line += fb.pitch)
+    {
+        volatile uint64_t *dst = (volatile uint64_t *)line;
+        bool under = cursor && y >= FBCON_CELL_HEIGHT - 2;
+        for(unsigned int p = 0; p < PAIRS; p++)
+            dst[p] = under ? underline : cell->rows[y][p];
+    }
+}
+
+void fbcon_draw(size_t row, size_t from, size_t to, const uint8_t *cells)
+{
+    if(row >= CGA_ROWS)
+        return;
+    for(size_t col = from; col < to && col < CGA_COLUMNS; col++)
+    {
+        uint16_t key = cells[2 * col] | cells[2 * col + 1] << 8;
+        if(shown[row][col] == key)
+            continue;
+        shown[row][col] = key;
+        blit(row, col);
+    }
+}
+
+void fbcon_cursor(size_t x, size_t y)
+{
+    if(x == cursor_x && y == cursor_y)
+        return;
+    size_t old_x = cursor_x, old_y = cursor_y;
+    cursor_x = x;
+    cursor_y = y;
+    if(old_x < CGA_COLUMNS && old_y < CGA_ROWS)
+        blit(old_y, old_x);
+    if(x < CGA_COLUMNS && y < CGA_ROWS)
+        blit(y, x);
+}
+
+void fbcon_flush()
+{
+    // write-combined stores are weakly ordered, sfence drains them
+    asm volatile("sfence" : : : "memory");
+}
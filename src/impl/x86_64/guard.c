@@ -1,119 +1,153 @@
 #include "guard.h"
 #include "cpu.h"
+#include "machine/percpu.h"
 #include "stdlib/assert.h"
+#include "machine/tsc.h"
+#include "intstat.h"
+#include "thread/rcu.h"
 #include <stddef.h>
 #include <stdbool.h>
 
-bool locked = false;
+// Every CPU has its own guard, the lock bit lives in its per-CPU block
 void guard_enter()
 {
-    assert(!locked, "Locker was already locked");
-    locked = true;
+    PerCPU *cpu = cpu_this();
+    assert(!cpu->guard_locked, "Locker was already locked");
+    cpu->guard_locked = true;
 }
 void retne()
 {
-    assert(locked, "Locker was already freed");
-    locked = false;
+    PerCPU *cpu = cpu_this();
+    assert(cpu->guard_locked, "Locker was already freed");
+    cpu->guard_locked = false;
 }
 
 // ---------------- QUEUE START ----------------
+// Prologues push onto `incoming` with a single atomic exchange (LIFO, any
+// CPU may push). The guard holder takes the whole batch at once into
+// `pending`, which only it ever touches, so draining needs no cli/sti.
 typedef struct
 {
-    interrupt_handler* head;
-    interrupt_handler** tail;
-} Queue;
+    interrupt_handler *incoming;
+    interrupt_handler *pending;
+} __attribute__((aligned(64))) Gate;
 
-Queue gates;
-__attribute__((constructor)) void guard_init()
+// pending epilogues of every CPU
+Gate gates[MAX_CPUS];
+
+void gate_push(Gate *g, interrupt_handler *item)
 {
-    gates.tail = &(gates.head);
+    interrupt_handler *head = __atomic_load_n(&g->incoming, __ATOMIC_RELAXED);
+    do
+        item->next = head;
+    while(!__atomic_compare_exchange_n(&g->incoming, &head, item, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-void enqueue(interrupt_handler *item)
+// moves everything pushed so far to `pending`, oldest first
+bool gate_drain(Gate *g)
 {
-    item->next = NULL;
-    *(gates.tail) = item;
-    gates.tail = &(item->next);
+    interrupt_handler *batch = __atomic_exchange_n(&g->incoming, NULL, __ATOMIC_ACQUIRE);
+    interrupt_handler *fifo = NULL;
+    while(batch)
+    {
+        interrupt_handler *next = batch->next;
+        batch->next = fifo;
+        fifo = batch;
+        batch = next;
+    }
+    g->pending = fifo;
+    return fifo != NULL;
 }
 
-interrupt_handler *dequeue()
+interrupt_handler *gate_pop(Gate *g)
 {
-    interrupt_handler *item;
-
-    item = gates.head;
+    interrupt_handler *item = g->pending;
     if(item)
     {
-        gates.head = item->next;
-        if(!gates.head)
-            gates.tail = &(gates.head);
-        else
-            item->next = NULL;
+        g->pending = item->next;
+        item->next = NULL;
     }
     return item;
 }
+// ----------------- QUEUE END -----------------
 
-void remove(interrupt_handler *item)
+static void run_epilogue(interrupt_handler *item, unsigned int count, uint64_t raised)
 {
-    interrupt_handler *cur;
-
-    if(gates.head)
-    {
-        cur = gates.head;
-        if(item == cur)
-            dequeue();
-        else
-        {
-            while(cur->next && item != cur->next)
-                cur = cur->next;
-
-            if(cur->next)
-            {
-                cur->next = item->next;
-                item->next = NULL;
-
-                if (!cur->next)
-                    gates.tail = &(cur->next);
-            }
-        }
-    }
+    // the epilogue may switch coroutines, a quiescent point after which
+    // the handler may be retired
+    unsigned int slot = item->slot;
+    uint64_t start = rdtsc();
+    intstat_record(slot, intstat_queued, start - raised);
+    if(count > 1)
+        intstat_coalesced(slot, count - 1);
+    item->epilogue(count);
+    intstat_record(slot, intstat_epilogue, rdtsc() - start);
 }
-// ----------------- QUEUE END -----------------
 
 void guard_leave()
 {
     interrupt_handler *item;
+    // the critical section is over, epilogues from here on are new readers
+    rcu_quiescent();
     for(;;)
     {
-        int_disable();
-        item = dequeue();
-        if (item == NULL)
+        // re-read after every epilogue, it may have switched CPUs
+        Gate *g = &gates[cpu_id()];
+        item = gate_pop(g);
+        if(item == NULL)
         {
+            // no prologue may slip in between the last check and unlocking
+            int_disable();
+            if(!__atomic_load_n(&g->incoming, __ATOMIC_ACQUIRE))
+                break;
             int_enable();
-            break;
+            gate_drain(g);
+            continue;
         }
-        item->queued = false;
-        int_enable();
-        item->epilogue();
+        // occurrences from now on queue the handler again and set `raised` anew
+        uint64_t raised = item->raised;
+        unsigned int count = __atomic_exchange_n(&item->pending, 0, __ATOMIC_ACQ_REL);
+        run_epilogue(item, count, raised);
     }
     retne();
+    int_enable();
 }
 
-void guard_relay(interrupt_handler *item)
+void guard_relay(interrupt_handler *item, uint64_t raised)
 {
-    if(!locked)
+    if(!cpu_this()->guard_locked)
     {
         guard_enter();
         int_enable();
-        item->epilogue();
+        run_epilogue(item, 1, raised);
         int_disable();
         guard_leave();
     }
     else
     {
-        if(!item->queued)
+        // only the first pending occurrence pushes, later ones are counted
+        if(!__atomic_fetch_add(&item->pending, 1, __ATOMIC_ACQ_REL))
         {
-            item->queued = true;
-            enqueue(item);
+            item->raised = raised;
+            gate_push(&gates[cpu_id()], item);
         }
     }
 }
+
+void guard_defer(interrupt_handler *item)
+{
+    if(!__atomic_fetch_add(&item->pending, 1, __ATOMIC_ACQ_REL))
+    {
+        item->raised = rdtsc();
+        gate_push(&gates[cpu_id()], item);
+    }
+}
+
+void guard_poll()
+{
+    if(cpu_this()->guard_locked || !__atomic_load_n(&gates[cpu_id()].incoming, __ATOMIC_ACQUIRE))
+        return;
+    // guard_leave drains the incoming epilogues
+    guard_enter();
+    guard_leave();
+}
@@ -0,0 +1,101 @@
+#include "intstat.h"
+#include "machine/tsc.h"
+#include "stdlib/stdio.h"
+#include "stdlib/algorithm.h"
+
+static IntStat stats[256];
+uint64_t intstat_fast[256];
+
+static inline unsigned int bucket_of(uint64_t cycles)
+{
+    unsigned int b = 63 - __builtin_clzll(cycles | 1);
+    return b < INTSTAT_BUCKETS ? b : INTSTAT_BUCKETS - 1;
+}
+
+void intstat_fired(unsigned int slot, uint64_t cycles, bool relayed)
+{
+    IntStat *s = &stats[slot];
+    __atomic_fetch_add(&s->fired, 1, __ATOMIC_RELAXED);
+    if(relayed)
+        __atomic_fetch_add(&s->relayed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->histogram[intstat_prologue][bucket_of(cycles)], 1, __ATOMIC_RELAXED);
+}
+
+void intstat_record(unsigned int slot, intstat_phase phase, uint64_t cycles)
+{
+    __atomic_fetch_add(&stats[slot].histogram[phase][bucket_of(cycles)], 1, __ATOMIC_RELAXED);
+}
+
+void intstat_coalesced(unsigned int slot, unsigned int count)
+{
+    __atomic_fetch_add(&stats[slot].coalesced, count, __ATOMIC_RELAXED);
+}
+
+void intstat_report(unsigned int slot, IntStat *out)
+{
+    *out = stats[slot & 0xFF];
+    out->fast = __atomic_load_n(&intstat_fast[slot & 0xFF], __ATOMIC_RELAXED);
+}
+
+void intstat_reset()
+{
+    memset(stats, 0, sizeof(stats));
+    memset(intstat_fast, 0, sizeof(intstat_fast));
+}
+
+// upper bound of bucket b in ns, in cycles while the TSC is not calibrated
+static uint64_t bucket_limit(unsigned int b)
+{
+    uint64_t cycles = 2ULL << b;
+    return tsc_hz ? cycles * 1000000000 / tsc_hz : cycles;
+}
+
+// bucket holding the given fraction (in percent) of the samples
+static unsigned int percentile(const uint32_t *histogram, unsigned int percent)
+{
+    uint64_t total = 0;
+    for(unsigned int b = 0; b < INTSTAT_BUCKETS; b++)
+        total += histogram[b];
+    uint64_t want = (total * percent + 99) / 100;
+    uint64_t seen = 0;
+    for(unsigned int b = 0; b < INTSTAT_BUCKETS; b++)
+    {
+        seen += histogram[b];
+        if(seen >= want && histogram[b])
+            return b;
+    }
+    return 0;
+}
+
+static unsigned int highest(const uint32_t *histogram)
+{
+    for(unsigned int b = INTSTAT_BUCKETS; b > 0; b--)
+        if(histogram[b - 1])
+            return b - 1;
+    return 0;
+}
+
+void intstat_dump()
+{
+    static const char *phases[INTSTAT_PHASES] = {"prologue", "queued", "epilogue"};
+    // printf has no field widths, one vector takes a line per phase
+    printf("interrupts, p50/p99/max below the given %s:\n", tsc_hz ? "ns" : "cycles");
+    for(unsigned int slot = 0; slot < 256; slot++)
+    {
+        const IntStat *s = &stats[slot];
+        uint64_t fast = __atomic_load_n(&intstat_fast[slot], __ATOMIC_RELAXED);
+        if(fast)
+            printf("vector %u: fast %lu\n", slot, fast);
+        if(!s->fired)
+            continue;
+        printf("vector %u: fired %lu, relayed %lu, coalesced %lu\n", slot, s->fired, s->relayed, s->coalesced);
+        for(unsigned int p = 0; p < INTSTAT_PHASES; p++)
+        {
+            const uint32_t *h = s->histogram[p];
+            if(p != intstat_prologue && !s->relayed)
+                break;
+            printf("  %s %lu/%lu/%lu\n", phases[p], bucket_limit(percentile(h, 50)),
+                    bucket_limit(percentile(h, 99)), bucket_limit(highest(h)));
+        }
+    }
+}
@@ -1,5 +1,8 @@
 #include "keyctrl.h"
-#include "pic.h"
+#include "machine/spinlock.h"
+#include "device/timer.h"
+#include "klog.h"
+#include <stdint.h>
 
 // clang-format off
 unsigned char normal_tab[] =
@@ -64,6 +67,123 @@ typedef enum
     resend = 0xfe,
 } kbd_reply;
 
+// ---------------- COMMANDS START ----------------
+// Commands go to the keyboard one byte at a time. The keyboard answers every
+// byte with ack or resend through the same interrupt that delivers the
+// scancodes, so nothing waits for it: submitting only queues a command, and
+// the prologue sends the next byte once the previous one was acked. A timer
+// stands in for replies that never come.
+#define COMMAND_QUEUE 8      // power of two
+#define COMMAND_RETRIES 3    // resends of a byte before its command is dropped
+#define COMMAND_TIMEOUT 20000 // us the keyboard may take to answer a byte
+#define COMMAND_BUSY 1000    // us until a write to a full input buffer is retried
+
+typedef struct
+{
+    uint8_t bytes[2];
+    uint8_t length;
+} Command;
+
+// all under command_lock, the head command is the one being sent
+static Command commands[COMMAND_QUEUE];
+static unsigned int command_head = 0, command_tail = 0;
+static unsigned int acked = 0;   // bytes of the head command the keyboard took
+static unsigned int retries = 0; // of the byte in flight
+static bool in_flight = false;   // a byte waits for its reply
+static Spinlock command_lock = SPINLOCK_INIT;
+static Timer command_timer;
+
+// sends the next byte if there is one and nothing is in flight
+static void command_kick()
+{
+    if(in_flight)
+        return;
+    if(command_head == command_tail)
+    {
+        timer_cancel(&command_timer);
+        return;
+    }
+    // the controller still holds an earlier byte, try again shortly
+    if(inb(0x64) & inpb)
+    {
+        timer_arm(&command_timer, timer_now() + COMMAND_BUSY);
+        return;
+    }
+    outb(0x60, commands[command_head % COMMAND_QUEUE].bytes[acked]);
+    in_flight = true;
+    timer_arm(&command_timer, timer_now() + COMMAND_TIMEOUT);
+}
+
+// handles the reply to the byte in flight, a timeout counts as resend
+static void command_answered(kbd_reply reply)
+{
+    in_flight = false;
+    if(reply == ack)
+    {
+        retries = 0;
+        if(++acked < commands[command_head % COMMAND_QUEUE].length)
+            return;
+    }
+    else if(++retries <= COMMAND_RETRIES)
+        return;
+    else
+    {
+        klog_at(KLOG_WARNING, "keyctrl: command 0x%x not acknowledged, dropped\n",
+                commands[command_head % COMMAND_QUEUE].bytes[0]);
+        retries = 0;
+    }
+    command_head++;
+    acked = 0;
+}
+
+static void command_timeout(Timer *timer)
+{
+    (void)timer;
+    unsigned long flags = spin_lock_irqsave(&command_lock);
+    if(in_flight)
+        command_answered(resend);
+    command_kick();
+    spin_unlock_irqrestore(&command_lock, flags);
+}
+
+// true if `byte` answered a command rather than being a scancode
+static bool command_reply(uint8_t byte)
+{
+    if(byte != ack && byte != resend)
+        return false;
+    unsigned long flags = spin_lock_irqsave(&command_lock);
+    bool expected = in_flight;
+    if(expected)
+    {
+        command_answered(byte);
+        command_kick();
+    }
+    spin_unlock_irqrestore(&command_lock, flags);
+    return expected;
+}
+
+// Queues `cmd` with its argument, caller holds command_lock. A queued command
+// that hasn't started yet just takes the newer argument, so a burst of LED
+// changes sends one update.
+static void command_submit(uint8_t cmd, uint8_t data)
+{
+    unsigned int last = command_tail - 1;
+    bool started = last == command_head && (acked || in_flight);
+    if(command_tail != command_head && !started && commands[last % COMMAND_QUEUE].bytes[0] == cmd)
+        commands[last % COMMAND_QUEUE].bytes[1] = data;
+    else if(command_tail - command_head < COMMAND_QUEUE)
+    {
+        Command *c = &commands[command_tail++ % COMMAND_QUEUE];
+        c->bytes[0] = cmd;
+        c->bytes[1] = data;
+        c->length = 2;
+    }
+    else
+        klog_at(KLOG_WARNING, "keyctrl: command queue full, 0x%x dropped\n", cmd);
+    command_kick();
+}
+// ----------------- COMMANDS END -----------------
+
 // keyboard code constants
 enum
 {
@@ -248,6 +368,9 @@ bool key_decoded()
 
 void keyctrl_init()
 {
+    lock_name(&command_lock, "keyctrl");
+    command_timer = new_timer(command_timeout);
+
     // alle LEDs ausschalten (bei vielen PCs ist NumLock nach dem Booten an)
     keyctrl_set_led(caps_lock_led, false);
     keyctrl_set_led(scroll_lock_led, false);
@@ -264,6 +387,8 @@ Key keyctrl_key_hit()
         return invalid;
 
     code = inb(0x60);
+    if (command_reply(code))
+        return invalid;
 
     if (key_decoded())
         return gather;
@@ -289,63 +414,19 @@ void keyctrl_reboot()
 
 void keyctrl_set_repeat_rate(int speed, int delay)
 {
-    bool was_forbidden = pic_ismasked(pic_keyboard);
-    if (!was_forbidden)
-        pic_forbid(pic_keyboard);
-
-    unsigned char data = (delay << 5 | speed) & 0b01111111;
-    kbd_reply reply = resend;
-
-    for (;;)
-    {
-        if (reply == resend)
-            outb(0x60, set_speed);
-
-        // Auf antwort von der Tastatur warten.
-        while (inb(0x64) & inpb)
-            ;
-        reply = inb(0x60);
-        if (reply == ack)
-            break;
-    }
-
-    outb(0x60, data);
-    while (inb(0x64) & inpb)
-        ;
-    
-    if (!was_forbidden)
-        pic_allow(pic_keyboard);
+    unsigned long flags = spin_lock_irqsave(&command_lock);
+    command_submit(set_speed, (delay << 5 | speed) & 0b01111111);
+    spin_unlock_irqrestore(&command_lock, flags);
 }
 
 void keyctrl_set_led(key_led led, bool on)
 {
-    bool was_forbidden = pic_ismasked(pic_keyboard);
-    if (!was_forbidden)
-        pic_forbid(pic_keyboard);
-
+    unsigned long flags = spin_lock_irqsave(&command_lock);
     if (on)
         leds |= led;
     else
         leds &= ~led;
     leds &= 0b0111;
-
-    kbd_reply reply = resend;
-    for (;;)
-    {
-        if (reply == resend)
-            outb(0x60, cmd_set_led);
-
-        while (inb(0x64) & inpb)
-            ;
-        reply = inb(0x60);
-        if (reply == ack)
-            break;
-    }
-
-    outb(0x60, leds);
-    while (inb(0x64) & inpb)
-        ;
-    
-    if (!was_forbidden)
-        pic_allow(pic_keyboard);
+    command_submit(cmd_set_led, leds);
+    spin_unlock_irqrestore(&command_lock, flags);
 }
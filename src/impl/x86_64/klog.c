@@ -0,0 +1,147 @@
+#include "klog.h"
+#include "machine/percpu.h"
+#include "machine/spinlock.h"
+#include "thread/scheduler.h"
+#include "thread/sleep.h"
+#include "guard.h"
+#include "panic.h"
+#include "boot/cmdline.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+
+#define KLOG_RECORDS 128 // per CPU
+#define KLOG_PERIOD 10000 // us between two flushes of klogd
+
+typedef struct
+{
+    uint64_t sequence; // position + 1 once the record is complete
+    uint16_t length;
+    char text[KLOG_TEXT];
+} __attribute__((aligned(64))) LogRecord;
+
+// ---------------- QUEUE START ----------------
+// Writers reserve a slot with a CAS on `head` and publish it through its
+// sequence number, so coroutines, prologues and the odd migrated coroutine
+// may write concurrently. klog_flush is the only consumer.
+typedef struct
+{
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    LogRecord records[KLOG_RECORDS];
+} __attribute__((aligned(64))) LogRing;
+
+bool ring_reserve(LogRing *r, uint64_t *pos)
+{
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    do
+    {
+        if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= KLOG_RECORDS)
+            return false;
+    }
+    while(!__atomic_compare_exchange_n(&r->head, &head, head + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    *pos = head;
+    return true;
+}
+
+// oldest complete record, NULL if there is none
+LogRecord *ring_peek(LogRing *r)
+{
+    LogRecord *record = &r->records[r->tail % KLOG_RECORDS];
+    if(__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != r->tail + 1)
+        return NULL;
+    return record;
+}
+
+void ring_release(LogRing *r)
+{
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+// ----------------- QUEUE END -----------------
+
+LogRing rings[MAX_CPUS];
+Spinlock flush_lock = SPINLOCK_INIT;
+
+static unsigned int threshold = KLOG_INFO;
+
+static void vklog(klog_level level, const char *fmt, va_list args)
+{
+    if(level > threshold)
+        return;
+
+    LogRing *r = &rings[cpu_id()];
+    uint64_t pos;
+    if(!ring_reserve(r, &pos))
+    {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord *record = &r->records[pos % KLOG_RECORDS];
+    int n = vsnprintf(record->text, KLOG_TEXT, fmt, args);
+    record->length = n < KLOG_TEXT ? n : KLOG_TEXT - 1;
+    __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+SYSV void klog_at(klog_level level, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vklog(level, fmt, args);
+    va_end(args);
+}
+
+SYSV void klog(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vklog(KLOG_INFO, fmt, args);
+    va_end(args);
+}
+
+unsigned int klog_flush()
+{
+    // one consumer at a time, a busy one will get to our messages as well
+    if(!spin_trylock(&flush_lock))
+        return 0;
+
+    unsigned int printed = 0;
+    for(unsigned int cpu = 0; cpu < MAX_CPUS; cpu++)
+    {
+        LogRing *r = &rings[cpu];
+        uint64_t dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+        if(dropped)
+            printf("klog: cpu %u dropped %u messages\n", cpu, (unsigned int)dropped);
+
+        LogRecord *record;
+        while((record = ring_peek(r)))
+        {
+            stdio_write(record->text, record->length);
+            ring_release(r);
+            printed++;
+        }
+    }
+
+    spin_unlock(&flush_lock);
+    return printed;
+}
+
+void klogd_action()
+{
+    guard_enter();
+    for(;;)
+    {
+        klog_flush();
+        sleep(KLOG_PERIOD);
+    }
+}
+
+void klog_init()
+{
+    threshold = cmdline_uint("loglevel", KLOG_INFO);
+    Coroutine *klogd = coroutine_create(klogd_action);
+    if(!klogd)
+        panic("klog_init: out of memory");
+    scheduler_ready(klogd);
+}
@@ -0,0 +1,76 @@
+#include "machine/acpi.h"
+#include "memory/frame.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct
+{
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    // ACPI 2.0+
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp;
+
+static uint64_t root_table = 0;
+static bool extended = false; // XSDT with 64-bit entries, else RSDT
+
+static bool checksum_ok(const void *data, uint32_t length)
+{
+    uint8_t sum = 0;
+    for(uint32_t i = 0; i < length; i++)
+        sum += ((const uint8_t *)data)[i];
+    return sum == 0;
+}
+
+// ACPI tables live in the direct map, anything above it is ignored
+static const acpi_header *table_at(uint64_t phys)
+{
+    if(!phys || phys + sizeof(acpi_header) > DIRECT_MAP_SIZE)
+        return NULL;
+    const acpi_header *h = phys_to_virt(phys);
+    if(phys + h->length > DIRECT_MAP_SIZE || !checksum_ok(h, h->length))
+        return NULL;
+    return h;
+}
+
+void acpi_set_rsdp(const void *rsdp)
+{
+    const acpi_rsdp *r = rsdp;
+    // both MBI tags may be present, prefer the XSDT
+    if(!checksum_ok(r, 20) || (extended && r->revision < 2))
+        return;
+    if(r->revision >= 2 && r->xsdt_address)
+    {
+        root_table = r->xsdt_address;
+        extended = true;
+    }
+    else
+        root_table = r->rsdt_address;
+}
+
+const acpi_header *acpi_find(const char signature[4])
+{
+    const acpi_header *root = table_at(root_table);
+    if(!root)
+        return NULL;
+
+    unsigned int size = extended ? 8 : 4;
+    unsigned int count = (root->length - sizeof(acpi_header)) / size;
+    const uint8_t *entries = (const uint8_t *)(root + 1);
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        uint64_t phys = extended ? *(const uint64_t *)(entries + i * 8) : *(const uint32_t *)(entries + i * 4);
+        const acpi_header *h = table_at(phys);
+        if(h && h->signature[0] == signature[0] && h->signature[1] == signature[1]
+            && h->signature[2] == signature[2] && h->signature[3] == signature[3])
+            return h;
+    }
+    return NULL;
+}
@@ -0,0 +1,74 @@
+#include "machine/clock.h"
+#include "machine/cpuid.h"
+#include "memory/frame.h"
+#include "memory/paging.h"
+#include "device/timer.h"
+#include "stdlib/algorithm.h"
+#include "panic.h"
+#include "klog.h"
+#include <stddef.h>
+
+static volatile ClockPage *page = NULL; // kernel alias of CLOCK_PAGE
+static bool tsc_clock = false;
+
+// Only an invariant TSC ticks at a constant rate in every P- and C-state.
+// The CPUs are assumed to have started their TSCs in sync, as firmware does.
+static bool tsc_invariant()
+{
+    if(cpuid(0x80000000, 0).eax < 0x80000007)
+        return false;
+    return cpuid(0x80000007, 0).edx & (1 << 8);
+}
+
+void clock_init()
+{
+    uintptr_t frame = frame_alloc();
+    if(!frame)
+        panic("clock_init: out of memory");
+    memset(phys_to_virt(frame), 0, FRAME_SIZE);
+    // mapped before any address space is created, they all share the tables
+    if(!paging_map(paging_kernel_root(), CLOCK_PAGE, frame, PAGE_SIZE, pte_user))
+        panic("clock_init: out of memory");
+    page = phys_to_virt(frame);
+
+    if(!tsc_invariant())
+    {
+        klog("clock: no invariant TSC, falling back to the PIT\n");
+        return;
+    }
+    if(!tsc_hz)
+        tsc_calibrate();
+
+    // both clocks start at timer_init()
+    page->sequence++;
+    page->tsc_base = rdtsc();
+    page->ns_base = timer_now() * 1000;
+    page->mult = ((uint64_t)1000000000 << 32) / tsc_hz;
+    page->source = clock_tsc;
+    __atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELEASE);
+    tsc_clock = true;
+    klog("clock: TSC at %lu kHz\n", tsc_hz / 1000);
+}
+
+uint64_t clock_now_ns()
+{
+    if(tsc_clock)
+        return clock_read(page);
+    // finer than the page, the PIT counter is read in between interrupts
+    return timer_now() * 1000;
+}
+
+bool clock_precise()
+{
+    return tsc_clock;
+}
+
+void clock_pit_update(uint64_t us)
+{
+    if(!page || tsc_clock)
+        return;
+    __atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    page->ns_base = us * 1000;
+    __atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELEASE);
+}
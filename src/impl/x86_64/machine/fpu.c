@@ -0,0 +1,121 @@
+#include "machine/fpu.h"
+#include "machine/percpu.h"
+#include "thread/coroutine.h"
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    cr0_mp = 1 << 1,
+    cr0_em = 1 << 2,
+    cr0_ts = 1 << 3,
+    cr0_ne = 1 << 5,
+    cr4_osfxsr = 1 << 9,
+    cr4_osxmmexcpt = 1 << 10,
+};
+
+static inline uint64_t read_cr0()
+{
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint64_t cr0)
+{
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+}
+
+static inline void clts()
+{
+    asm volatile("clts");
+}
+
+static inline void stts()
+{
+    write_cr0(read_cr0() | cr0_ts);
+}
+
+static inline void fxsave(char *area)
+{
+    asm volatile("fxsave64 %0" : "=m"(*(char (*)[512])area));
+}
+
+static inline void fxrstor(const char *area)
+{
+    asm volatile("fxrstor64 %0" : : "m"(*(const char (*)[512])area));
+}
+
+// called once on every CPU
+void fpu_init()
+{
+    uint64_t cr4;
+    write_cr0((read_cr0() & ~(cr0_em | cr0_ts)) | cr0_mp | cr0_ne);
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= cr4_osfxsr | cr4_osxmmexcpt;
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+    asm volatile("fninit");
+    cpu_this()->fpu_owner = NULL;
+}
+
+__attribute__((constructor)) void fpu_bsp_init()
+{
+    fpu_init();
+}
+
+void fpu_switch(Coroutine *current, Coroutine *next)
+{
+    PerCPU *cpu = cpu_this();
+
+    // A preempted owner stays on this CPU's run queue and keeps its state in
+    // the registers. Anything else may resume on another CPU: save it now.
+    if(current && cpu->fpu_owner == current && !current->queued)
+    {
+        clts();
+        fxsave(current->mtoc.fpu);
+        cpu->fpu_owner = NULL;
+    }
+
+    if(cpu->fpu_owner == next)
+        clts();
+    else
+        stts();
+}
+
+// #NM handler, returns false if the trap wasn't caused by a lazy switch
+bool fpu_restore()
+{
+    PerCPU *cpu = cpu_this();
+    Coroutine *c = cpu->active;
+
+    if(!(read_cr0() & cr0_ts))
+        return false;
+    clts();
+
+    if(!c || cpu->fpu_owner == c)
+        return true;
+
+    if(cpu->fpu_owner)
+        fxsave(cpu->fpu_owner->mtoc.fpu);
+
+    if(c->fpu_used)
+        fxrstor(c->mtoc.fpu);
+    else
+    {
+        // first use: start from a clean state, default MXCSR masks all exceptions
+        uint32_t mxcsr = 0x1f80;
+        asm volatile("fninit");
+        asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+        c->fpu_used = true;
+    }
+    cpu->fpu_owner = c;
+    return true;
+}
+
+// c won't run again (or not here), its register contents are garbage now
+void fpu_release(Coroutine *c)
+{
+    PerCPU *cpu = cpu_this();
+    if(cpu->fpu_owner == c)
+        cpu->fpu_owner = NULL;
+}
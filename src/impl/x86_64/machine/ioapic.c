@@ -0,0 +1,167 @@
+#include "machine/ioapic.h"
+#include "machine/acpi.h"
+#include "machine/lapic.h"
+#include "machine/percpu.h"
+#include "memory/paging.h"
+#include "panic.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define IOAPIC_DEFAULT_BASE 0xFEC00000UL
+#define ISA_IRQS 16
+#define IRQ_VECTOR_BASE 32 // same vectors the 8259 used, see plugbox.h
+
+enum
+{
+    ioapic_regsel = 0x00,
+    ioapic_window = 0x10,
+};
+
+enum
+{
+    ioapic_reg_version = 0x01,
+    ioapic_reg_redirection = 0x10,
+};
+
+// redirection entry bits
+enum
+{
+    redir_active_low = 1 << 13,
+    redir_level = 1 << 15,
+    redir_masked = 1 << 16,
+};
+
+// MADT entries
+enum
+{
+    madt_ioapic = 1,
+    madt_override = 2,
+};
+
+static volatile uint32_t *ioapic = NULL;
+static unsigned int gsi_base = 0;
+static unsigned int redirections = 0;
+
+// per ISA line: its GSI and the redirection entry last written (the shadow)
+static unsigned int isa_gsi[ISA_IRQS];
+static uint64_t isa_entry[ISA_IRQS];
+
+static inline uint32_t ioapic_read(uint8_t reg)
+{
+    ioapic[ioapic_regsel / 4] = reg;
+    return ioapic[ioapic_window / 4];
+}
+
+static inline void ioapic_write(uint8_t reg, uint32_t value)
+{
+    ioapic[ioapic_regsel / 4] = reg;
+    ioapic[ioapic_window / 4] = value;
+}
+
+// lines routed to another IOAPIC stay masked
+static inline bool covered(unsigned int irq)
+{
+    return irq < ISA_IRQS && isa_gsi[irq] >= gsi_base && isa_gsi[irq] - gsi_base < redirections;
+}
+
+static void write_entry(unsigned int irq)
+{
+    uint8_t reg = ioapic_reg_redirection + 2 * (isa_gsi[irq] - gsi_base);
+    ioapic_write(reg + 1, isa_entry[irq] >> 32);
+    ioapic_write(reg, isa_entry[irq] & 0xffffffff);
+}
+
+// first IOAPIC and the ISA overrides from the MADT, PC defaults without one
+static uintptr_t parse_madt()
+{
+    uintptr_t base = IOAPIC_DEFAULT_BASE;
+    const acpi_header *madt = acpi_find("APIC");
+    bool found = false;
+
+    for(unsigned int i = 0; i < ISA_IRQS; i++)
+    {
+        isa_gsi[i] = i;
+        isa_entry[i] = 0;
+    }
+    if(!madt)
+        return base;
+
+    // entries follow the header, the LAPIC address and the flags
+    const uint8_t *entry = (const uint8_t *)madt + sizeof(acpi_header) + 8;
+    const uint8_t *end = (const uint8_t *)madt + madt->length;
+    for(; entry + 2 <= end && entry[1]; entry += entry[1])
+    {
+        if(entry[0] == madt_ioapic && !found)
+        {
+            base = *(const uint32_t *)(entry + 4);
+            gsi_base = *(const uint32_t *)(entry + 8);
+            found = true;
+        }
+        else if(entry[0] == madt_override && entry[2] == 0 && entry[3] < ISA_IRQS)
+        {
+            uint8_t irq = entry[3];
+            uint16_t flags = *(const uint16_t *)(entry + 8);
+            isa_gsi[irq] = *(const uint32_t *)(entry + 4);
+            if((flags & 3) == 3)
+                isa_entry[irq] |= redir_active_low;
+            if(((flags >> 2) & 3) == 3)
+                isa_entry[irq] |= redir_level;
+        }
+    }
+    return base;
+}
+
+bool ioapic_init()
+{
+    if(!lapic_enabled())
+        return false;
+
+    uintptr_t base = parse_madt();
+    if(!paging_map(paging_kernel_root(), base, base, PAGE_SIZE, pte_writable | pte_write_through | pte_cache_disable))
+        panic("ioapic_init: out of memory");
+    ioapic = (volatile uint32_t *)base;
+
+    uint32_t version = ioapic_read(ioapic_reg_version);
+    // an absent chip reads as all ones
+    if(version == 0xffffffff)
+    {
+        ioapic = NULL;
+        return false;
+    }
+    redirections = ((version >> 16) & 0xff) + 1;
+
+    // everything masked, delivered to the BSP in physical destination mode
+    for(unsigned int i = 0; i < ISA_IRQS; i++)
+    {
+        if(!covered(i))
+            continue;
+        isa_entry[i] |= redir_masked | (IRQ_VECTOR_BASE + i) | ((uint64_t)percpu[0].lapic_id << 56);
+        write_entry(i);
+    }
+    return true;
+}
+
+void ioapic_mask(unsigned int irq, bool masked)
+{
+    if(!covered(irq))
+        return;
+    uint64_t entry = masked ? isa_entry[irq] | redir_masked : isa_entry[irq] & ~(uint64_t)redir_masked;
+    if(entry == isa_entry[irq])
+        return;
+    isa_entry[irq] = entry;
+    // the mask bit lives in the low half, one register write is enough
+    ioapic_write(ioapic_reg_redirection + 2 * (isa_gsi[irq] - gsi_base), entry & 0xffffffff);
+}
+
+bool ioapic_masked(unsigned int irq)
+{
+    return !covered(irq) || (isa_entry[irq] & redir_masked);
+}
+
+void ioapic_route(unsigned int irq, unsigned int apic_id)
+{
+    if(!covered(irq))
+        return;
+    isa_entry[irq] = (isa_entry[irq] & 0x00ffffffffffffffUL) | ((uint64_t)apic_id << 56);
+    write_entry(irq);
+}
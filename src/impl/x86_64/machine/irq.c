@@ -0,0 +1,54 @@
+#include "machine/irq.h"
+#include "machine/ioapic.h"
+#include "machine/percpu.h"
+#include "machine/spinlock.h"
+#include "cpu.h"
+
+static bool use_ioapic = false;
+// the IOAPIC index/data pair and the mask shadows are shared by all CPUs
+static Spinlock irq_lock = SPINLOCK_INIT;
+
+// after lapic_init on the BSP, before any driver allows its line
+void irq_init()
+{
+    lock_name(&irq_lock, "irq");
+    use_ioapic = ioapic_init();
+    if(use_ioapic)
+        pic_disable();
+}
+
+void irq_allow(pic_number line)
+{
+    unsigned long flags = spin_lock_irqsave(&irq_lock);
+    if(use_ioapic)
+        ioapic_mask(line, false);
+    else
+        pic_allow(line);
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+void irq_forbid(pic_number line)
+{
+    unsigned long flags = spin_lock_irqsave(&irq_lock);
+    if(use_ioapic)
+        ioapic_mask(line, true);
+    else
+        pic_forbid(line);
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+bool irq_masked(pic_number line)
+{
+    return use_ioapic ? ioapic_masked(line) : pic_ismasked(line);
+}
+
+// steers the line to `cpu`, only possible with the IOAPIC
+bool irq_route(pic_number line, unsigned int cpu)
+{
+    if(!use_ioapic)
+        return false;
+    unsigned long flags = spin_lock_irqsave(&irq_lock);
+    ioapic_route(line, percpu[cpu].lapic_id);
+    spin_unlock_irqrestore(&irq_lock, flags);
+    return true;
+}
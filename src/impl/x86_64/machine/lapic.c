@@ -0,0 +1,130 @@
+#include "machine/lapic.h"
+#include "machine/msr.h"
+#include "machine/cpuid.h"
+#include "memory/paging.h"
+#include "panic.h"
+#include "plugbox.h"
+#include "stdlib/assert.h"
+#include <stddef.h>
+
+// register offsets (in bytes) inside the MMIO window
+enum
+{
+    lapic_reg_id = 0x20,
+    lapic_reg_tpr = 0x80,
+    lapic_reg_eoi = 0xb0,
+    lapic_reg_svr = 0xf0,
+    lapic_reg_lvt_pmc = 0x340,
+    lapic_reg_icr_low = 0x300,
+    lapic_reg_icr_high = 0x310,
+};
+
+// interrupt command register bits
+enum
+{
+    icr_init = 0x500,
+    icr_startup = 0x600,
+    icr_pending = 1 << 12,
+    icr_assert = 1 << 14,
+    icr_all_but_self = 3 << 18,
+};
+
+volatile uint32_t *lapic = NULL;
+
+static inline uint32_t lapic_read(unsigned int reg)
+{
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(unsigned int reg, uint32_t value)
+{
+    lapic[reg / 4] = value;
+}
+
+bool spurious_prologue()
+{
+    // spurious interrupts must not be acknowledged
+    return false;
+}
+
+bool lapic_available()
+{
+    return cpuid(1, 0).edx & (1 << 9);
+}
+
+// Maps the register window 1:1 with a single uncached page
+void lapic_map(uintptr_t base)
+{
+    assert(base >= BOOT_MAPPED, "LAPIC inside the boot identity mapping");
+    if(!paging_map(paging_kernel_root(), base, base, PAGE_SIZE, pte_writable | pte_write_through | pte_cache_disable))
+        panic("lapic_map: out of memory");
+}
+
+// called on every CPU, the first call also maps the registers
+void lapic_init()
+{
+    if(!lapic)
+    {
+        uintptr_t base = rdmsr(MSR_APIC_BASE) & ~0xfffUL;
+        lapic_map(base);
+        lapic = (volatile uint32_t *)base;
+        static interrupt_handler spurious_handler = INTERRUPT_HANDLER(spurious_prologue, NULL);
+        plugbox_assign(int_spurious, &spurious_handler);
+    }
+
+    // globally enable, accept every priority, software enable with spurious vector
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | (1 << 11));
+    lapic_write(lapic_reg_tpr, 0);
+    lapic_write(lapic_reg_svr, 0x100 | int_spurious);
+}
+
+unsigned int lapic_id()
+{
+    return lapic_read(lapic_reg_id) >> 24;
+}
+
+bool lapic_enabled()
+{
+    return lapic != NULL;
+}
+
+void lapic_eoi()
+{
+    if(lapic)
+        lapic_write(lapic_reg_eoi, 0);
+}
+
+// delivers performance counter overflows as NMI, which also unmasks the
+// entry again: the CPU masks it with every delivery
+void lapic_pmu_nmi()
+{
+    lapic_write(lapic_reg_lvt_pmc, 0x400);
+}
+
+void lapic_wait_icr()
+{
+    while(lapic_read(lapic_reg_icr_low) & icr_pending)
+        asm volatile("pause");
+}
+
+void lapic_send_ipi(unsigned int apic_id, uint8_t vector)
+{
+    lapic_wait_icr();
+    lapic_write(lapic_reg_icr_high, apic_id << 24);
+    lapic_write(lapic_reg_icr_low, icr_assert | vector);
+}
+
+void lapic_send_init_all()
+{
+    lapic_wait_icr();
+    lapic_write(lapic_reg_icr_low, icr_all_but_self | icr_assert | icr_init);
+    lapic_wait_icr();
+}
+
+// APs start executing in real mode at physical address page * 4 KiB
+void lapic_send_startup_all(uint8_t page)
+{
+    lapic_wait_icr();
+    lapic_write(lapic_reg_icr_low, icr_all_but_self | icr_assert | icr_startup | page);
+    lapic_wait_icr();
+}
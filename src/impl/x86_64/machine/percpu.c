@@ -0,0 +1,46 @@
+#include "machine/percpu.h"
+#include "machine/msr.h"
+#include <stddef.h>
+
+// BSP's TSS, see boot/gdt64.asm
+extern task_state tss64;
+
+PerCPU percpu[MAX_CPUS];
+static uint8_t ist_stacks[MAX_CPUS][IST_STACKS][IST_STACK_SIZE] __attribute__((aligned(16)));
+
+void percpu_init(unsigned int id)
+{
+    PerCPU *cpu = &percpu[id];
+    cpu->self = cpu;
+    cpu->id = id;
+    cpu->active = NULL;
+    cpu->guard_locked = false;
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+void percpu_ist_init(unsigned int id, task_state *tss)
+{
+    // an exception's iretq would let the next NMI in early, at the top of
+    // the same stack: NMI handlers must not fault
+    for(unsigned int i = 0; i < IST_STACKS; i++)
+        tss->ist[i] = (uint64_t)ist_stacks[id][i] + IST_STACK_SIZE;
+}
+
+unsigned int cpu_count()
+{
+    unsigned int n = 0;
+    for(unsigned int i = 0; i < MAX_CPUS; i++)
+        if(__atomic_load_n(&percpu[i].online, __ATOMIC_ACQUIRE))
+            n++;
+    return n;
+}
+
+// runs before every other constructor, they may already rely on gs
+__attribute__((constructor(101))) void percpu_bsp_init()
+{
+    percpu_init(0);
+    percpu[0].tss = &tss64;
+    percpu_ist_init(0, &tss64);
+    percpu[0].online = true;
+}
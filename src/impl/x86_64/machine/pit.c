@@ -1,55 +1,37 @@
-#include "device/watch.h"
-#include "plugbox.h"
-#include "pic.h"
-#include "thread/scheduler.h"
+#include "machine/pit.h"
 #include "io_port.h"
-#include "stdlib/assert.h"
-#include <stddef.h>
 
-unsigned int us_interval = 0;
-unsigned int it = 0;
-unsigned int it_max = 0;
-
-bool pit_prologue()
+enum
 {
-    if(it >= it_max)
-    {
-        it = 0;
-        return true;
-    }
-    it++;
-    return false;
-}
+    pit_channel0 = 0x40,
+    pit_channel2 = 0x42,
+    pit_command = 0x43,
+    pit_gate = 0x61, // bit 0 gates counter 2, bit 1 the speaker, bit 5 reads its output
+};
 
-void watch_epilogue(){};
-
-void watch_plugin(void (*epilogue)())
+void pit_oneshot(uint16_t ticks)
 {
-    if(epilogue == NULL)
-    {
-        epilogue = watch_epilogue;
-    }
-    plugbox_assign(int_timer, new_interrupt_handler(pit_prologue, epilogue));
-    pic_allow(pic_timer);
+    outb(pit_command, 0x30); // 00 11 000 0 -> first low, then high byte into counter 0; interrupt on terminal count
+    outb(pit_channel0, ticks & 0xFF);
+    outb(pit_channel0, (ticks >> 8) & 0xFF);
 }
 
-void pit_interval(int us)
+// remaining count of the running one-shot
+uint16_t pit_count()
 {
-    assert(us >= 1000, "Timer cannot be faster than 1 ms");
-    assert(us <= 60000, "Timer cannot be slower than 60 ms");
-    unsigned char high = (us>>8) & 0xFF;
-    unsigned char low = us & 0xFF;
-    outb(0x43, 0x34); // 00 11 010 0 -> first low, then high byte into counter 0; periodic interrupts
-    outb(0x40, low);
-    outb(0x40, high);
-
-    us_interval = us;
+    outb(pit_command, 0x00); // latch counter 0
+    uint8_t low = inb(pit_channel0);
+    uint8_t high = inb(pit_channel0);
+    return (high << 8) | low;
 }
 
-void watch_set(unsigned int us, unsigned int iterations)
+void pit_delay(uint16_t ticks)
 {
-    if(us != us_interval)
-        pit_interval(us);
-    us_interval = us;
-    it_max = iterations;
+    outb(pit_gate, (inb(pit_gate) & ~0x02) | 0x01); // counter 2 running, speaker off
+    outb(pit_command, 0xB0); // 10 11 000 0 -> counter 2, low then high byte, interrupt on terminal count
+    outb(pit_channel2, ticks & 0xFF);
+    outb(pit_channel2, (ticks >> 8) & 0xFF);
+    // the output goes high at terminal count
+    while(!(inb(pit_gate) & 0x20))
+        asm volatile("pause");
 }
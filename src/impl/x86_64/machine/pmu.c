@@ -0,0 +1,157 @@
+#include "machine/pmu.h"
+#include "machine/msr.h"
+#include "machine/cpuid.h"
+#include "machine/lapic.h"
+#include "boot/cmdline.h"
+#include "machine/percpu.h"
+#include "profile.h"
+#include "klog.h"
+
+#define MSR_PMC0              0xc1
+#define MSR_PERFEVTSEL0       0x186
+#define MSR_FIXED_CTR_CTRL    0x38d
+#define MSR_PERF_GLOBAL_STATUS 0x38e
+#define MSR_PERF_GLOBAL_CTRL  0x38f
+#define MSR_PERF_GLOBAL_OVF_CTRL 0x390
+
+// IA32_PERFEVTSELx bits
+enum
+{
+    evtsel_usr = 1 << 16,
+    evtsel_os = 1 << 17,
+    evtsel_int = 1 << 20,
+    evtsel_enable = 1 << 22,
+};
+
+#define CR4_PCE (1UL << 8)
+#define SAMPLE_PMC 2
+
+// architectural events, `missing` is their bit in CPUID.0xA:EBX
+typedef struct
+{
+    uint8_t event;
+    uint8_t umask;
+    uint8_t missing;
+} PmuEvent;
+
+static const PmuEvent general_events[] = {
+    [pmu_pmc_cache_misses] = {0x2e, 0x41, 4},
+    [pmu_pmc_branch_misses] = {0xc5, 0x00, 6},
+};
+static const PmuEvent cycles_event = {0x3c, 0x00, 0};
+
+unsigned int pmu_fixed = 0;
+unsigned int pmu_general = 0;
+uint64_t pmu_fixed_mask = 0;
+uint64_t pmu_general_mask = 0;
+static unsigned int version = 0;
+static unsigned int general_total = 0; // including those not in use
+static uint32_t missing = 0;
+static uint64_t sample_period = 0;
+
+static inline uint64_t width_mask(unsigned int bits)
+{
+    return bits >= 64 ? UINT64_MAX : (1ULL << bits) - 1;
+}
+
+static void program(unsigned int pmc, const PmuEvent *e, uint32_t extra)
+{
+    wrmsr(MSR_PERFEVTSEL0 + pmc, 0);
+    wrmsr(MSR_PMC0 + pmc, 0);
+    if(!(missing & (1u << e->missing)))
+        wrmsr(MSR_PERFEVTSEL0 + pmc, e->event | e->umask << 8 | evtsel_usr | evtsel_os | evtsel_enable | extra);
+}
+
+static uint64_t enabled_counters()
+{
+    return ((1ULL << pmu_general) - 1) | ((1ULL << pmu_fixed) - 1) << 32;
+}
+
+// every CPU is assumed to have the same PMU as the BSP
+__attribute__((constructor)) void pmu_detect()
+{
+    if(cpuid(0, 0).eax < 0xa)
+        return;
+    cpuid_regs r = cpuid(0xa, 0);
+    version = r.eax & 0xff;
+    if(!version)
+        return;
+    general_total = (r.eax >> 8) & 0xff;
+    pmu_general = general_total < 2 ? general_total : 2;
+    pmu_general_mask = width_mask((r.eax >> 16) & 0xff);
+    missing = r.ebx;
+    // fixed counters were added with version 2
+    unsigned int fixed = version >= 2 ? r.edx & 0x1f : 0;
+    pmu_fixed = fixed < 2 ? fixed : 2;
+    pmu_fixed_mask = width_mask((r.edx >> 5) & 0xff);
+}
+
+void pmu_init()
+{
+    if(!version)
+        return;
+
+    for(unsigned int i = 0; i < pmu_general; i++)
+        program(i, &general_events[i], 0);
+    // ring 0 and 3 for each fixed counter in use
+    uint64_t fixed_ctrl = 0;
+    for(unsigned int i = 0; i < pmu_fixed; i++)
+        fixed_ctrl |= 3ULL << (4 * i);
+    wrmsr(MSR_FIXED_CTR_CTRL, fixed_ctrl);
+    if(version >= 2)
+        wrmsr(MSR_PERF_GLOBAL_CTRL, enabled_counters());
+
+    if(cmdline_flag("rdpmc", false))
+    {
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PCE));
+    }
+
+    uint64_t period = cmdline_uint("profile_cycles", 0);
+    if(period && !profile_buffers())
+        klog_at(KLOG_WARNING, "pmu: out of memory for the sample rings\n");
+    else if(period)
+    {
+        profiling = profile_pmu;
+        if(!pmu_sample(period))
+            klog_at(KLOG_WARNING, "pmu: no overflow sampling on CPU %u\n", cpu_id());
+    }
+}
+
+bool pmu_available()
+{
+    return version != 0;
+}
+
+static void arm_sample()
+{
+    // written values are sign extended from bit 31
+    wrmsr(MSR_PMC0 + SAMPLE_PMC, (uint32_t)-sample_period);
+    lapic_pmu_nmi();
+}
+
+bool pmu_sample(uint64_t period)
+{
+    if(version < 2 || general_total <= SAMPLE_PMC || !lapic_enabled() || !period || period >= 1UL << 31)
+        return false;
+    sample_period = period;
+    program(SAMPLE_PMC, &cycles_event, evtsel_int);
+    arm_sample();
+    wrmsr(MSR_PERF_GLOBAL_CTRL, enabled_counters() | 1ULL << SAMPLE_PMC);
+    return true;
+}
+
+bool pmu_nmi(const uint64_t *frame)
+{
+    if(version < 2 || !sample_period || !(rdmsr(MSR_PERF_GLOBAL_STATUS) & (1ULL << SAMPLE_PMC)))
+        return false;
+    // once the profiler stopped, the LVT entry stays masked
+    if(__atomic_load_n(&profiling, __ATOMIC_RELAXED) == profile_pmu)
+    {
+        profile_sample(frame);
+        arm_sample();
+    }
+    wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, 1ULL << SAMPLE_PMC);
+    return true;
+}
@@ -0,0 +1,244 @@
+#include "machine/smp.h"
+#include "machine/percpu.h"
+#include "machine/lapic.h"
+#include "machine/fpu.h"
+#include "machine/cpuid.h"
+#include "machine/pmu.h"
+#include "memory/address_space.h"
+#include "memory/paging.h"
+#include "syscall.h"
+#include "boot/page_table.h"
+#include "boot/cmdline.h"
+#include "thread/scheduler.h"
+#include "stdlib/algorithm.h"
+#include "stdlib/assert.h"
+#include "plugbox.h"
+#include "guard.h"
+#include "cpu.h"
+#include "io_port.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define AP_TRAMPOLINE_BASE 0x8000
+#define AP_STACK_SIZE 8192
+#define GDT_ENTRIES 7
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_TSS 0x28
+
+// see boot/ap_trampoline.asm
+extern char ap_trampoline_start[];
+extern char ap_trampoline_end[];
+extern uint64_t ap_trampoline_cr3;
+extern uint64_t ap_trampoline_stacks;
+extern uint64_t ap_trampoline_stack_size;
+extern uint32_t ap_trampoline_max;
+extern uint32_t ap_trampoline_count;
+
+// a trampoline variable inside the copy at AP_TRAMPOLINE_BASE
+#define trampoline_var(var) \
+    (*(__typeof__(&(var)))phys_to_kernel(AP_TRAMPOLINE_BASE + ((char *)&(var) - ap_trampoline_start)))
+
+typedef struct
+{
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) descriptor_pointer;
+
+descriptor_pointer bsp_gdtr;
+descriptor_pointer bsp_idtr;
+
+uint64_t ap_gdt[MAX_CPUS][GDT_ENTRIES];
+task_state ap_tss[MAX_CPUS];
+unsigned char ap_stacks[MAX_CPUS - 1][AP_STACK_SIZE] __attribute__((aligned(16)));
+
+// set once the BSP has torn down the identity mapping again
+bool ap_release = false;
+
+// ~1 us per write to the POST port
+void io_delay(unsigned int us)
+{
+    while(us--)
+        outb(0x80, 0);
+}
+
+bool wakeup_prologue()
+{
+    // the interrupt itself ended the idle CPU's hlt
+    return false;
+}
+
+// An idle CPU in MWAIT monitors its own line, storing to `kick` wakes it
+// up without an IPI. `polling` tells wakers whether the store suffices.
+typedef struct
+{
+    uint32_t polling;
+    uint32_t kick;
+} __attribute__((aligned(64))) IdleLine;
+
+static IdleLine idle_lines[MAX_CPUS];
+static bool mwait_enabled = false;
+
+void smp_wakeup(unsigned int cpu)
+{
+    if(mwait_enabled)
+    {
+        IdleLine *line = &idle_lines[cpu];
+        __atomic_store_n(&line->kick, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&line->polling, __ATOMIC_SEQ_CST))
+            return;
+    }
+    lapic_send_ipi(percpu[cpu].lapic_id, int_wakeup);
+}
+
+void smp_broadcast(uint8_t vector, uint64_t skip)
+{
+    unsigned int self = cpu_id();
+    for(unsigned int i = 0; i < MAX_CPUS; i++)
+        if(i != self && !(skip & (1ULL << i)) && __atomic_load_n(&percpu[i].online, __ATOMIC_ACQUIRE))
+            lapic_send_ipi(percpu[i].lapic_id, vector);
+}
+
+void smp_idle(bool (*has_work)())
+{
+    if(!mwait_enabled)
+    {
+        if(has_work())
+            int_enable();
+        else
+            cpu_idle();
+        return;
+    }
+
+    IdleLine *line = &idle_lines[cpu_id()];
+    __atomic_store_n(&line->polling, 1, __ATOMIC_SEQ_CST);
+    // armed before the last check, a kick from then on ends the MWAIT
+    asm volatile("monitor" : : "a"(line), "c"(0), "d"(0));
+    if(!__atomic_load_n(&line->kick, __ATOMIC_SEQ_CST) && !has_work())
+        // C1, interrupts are taken right after the STI shadow ends
+        asm volatile("sti\n\tmwait" : : "a"(0), "c"(0) : "memory");
+    else
+        int_enable();
+    // the loop around us checks for work before waiting again
+    __atomic_store_n(&line->polling, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&line->kick, 0, __ATOMIC_RELAXED);
+}
+
+// Private copy of the BSP's GDT with its own TSS, which can only be loaded once
+void load_descriptors(unsigned int id, void *stack_top)
+{
+    uint64_t *gdt = ap_gdt[id];
+    task_state *tss = &ap_tss[id];
+
+    assert(bsp_gdtr.limit + 1u <= sizeof(ap_gdt[id]), "GDT doesn't fit");
+    memcpy(gdt, (void *)bsp_gdtr.base, bsp_gdtr.limit + 1);
+
+    tss->iopb = sizeof(task_state);
+    tss->rsp[0] = (uint64_t)stack_top;
+    percpu_ist_init(id, tss);
+
+    uint64_t base = (uint64_t)tss;
+    uint64_t limit = sizeof(task_state) - 1;
+    gdt[GDT_TSS / 8] = (limit & 0xffff)
+                     | ((base & 0xffffff) << 16)
+                     | (0x89UL << 40) // present, available 64-bit TSS
+                     | (((limit >> 16) & 0xf) << 48)
+                     | (((base >> 24) & 0xff) << 56);
+    gdt[GDT_TSS / 8 + 1] = base >> 32;
+
+    descriptor_pointer gdtr = {bsp_gdtr.limit, (uint64_t)gdt};
+    asm volatile("lgdt %0" : : "m"(gdtr));
+    asm volatile("lidt %0" : : "m"(bsp_idtr));
+
+    // the trampoline's selectors are gone, reload cs and the data segments
+    asm volatile(
+        "pushq %0\n\t"
+        "leaq 1f(%%rip), %%rax\n\t"
+        "pushq %%rax\n\t"
+        "lretq\n"
+        "1:\n\t"
+        "mov %1, %%ss\n\t"
+        "mov %1, %%ds\n\t"
+        "mov %1, %%es\n\t"
+        : : "i"(GDT_KERNEL_CODE), "r"(GDT_KERNEL_DATA) : "rax", "memory");
+    asm volatile("ltr %w0" : : "r"(GDT_TSS));
+
+    percpu[id].tss = tss;
+}
+
+// C entry of the application processors, called by ap_long_mode_start
+void smp_ap_main(unsigned int index)
+{
+    unsigned int id = index + 1;
+
+    percpu_init(id);
+    load_descriptors(id, ap_stacks[index] + AP_STACK_SIZE);
+    fpu_init();
+    paging_cpu_init();
+    address_space_init();
+    syscall_init();
+    lapic_init();
+    pmu_init();
+    percpu[id].lapic_id = lapic_id();
+    __atomic_store_n(&percpu[id].online, true, __ATOMIC_RELEASE);
+
+    while(!__atomic_load_n(&ap_release, __ATOMIC_ACQUIRE))
+        asm volatile("pause");
+    // drop TLB entries of the identity mapping
+    write_cr3(read_cr3());
+
+    guard_enter();
+    scheduler_schedule();
+}
+
+// Starts every AP through INIT-SIPI-SIPI. They count themselves in, so no
+// ACPI tables are needed; CPUs beyond MAX_CPUS or the cpus= option stay
+// halted in the trampoline.
+void smp_init()
+{
+    if(!lapic_available())
+        return;
+
+    lapic_init();
+    percpu[0].lapic_id = lapic_id();
+    static interrupt_handler wakeup_handler = INTERRUPT_HANDLER(wakeup_prologue, NULL);
+    plugbox_assign(int_wakeup, &wakeup_handler);
+    mwait_enabled = (cpuid(1, 0).ecx & (1 << 3)) && cmdline_flag("mwait", true);
+
+    uint64_t cpus = cmdline_uint("cpus", MAX_CPUS);
+    unsigned int aps = cpus < 1 ? 0 : cpus > MAX_CPUS ? MAX_CPUS - 1 : cpus - 1;
+    if(!aps)
+        return;
+
+    asm volatile("sgdt %0" : "=m"(bsp_gdtr));
+    asm volatile("sidt %0" : "=m"(bsp_idtr));
+
+    memcpy(phys_to_kernel(AP_TRAMPOLINE_BASE), ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    trampoline_var(ap_trampoline_cr3) = read_cr3();
+    trampoline_var(ap_trampoline_stacks) = (uint64_t)ap_stacks;
+    trampoline_var(ap_trampoline_stack_size) = AP_STACK_SIZE;
+    trampoline_var(ap_trampoline_max) = aps;
+    trampoline_var(ap_trampoline_count) = 0;
+
+    // the trampoline runs identity mapped until it jumps to the higher half
+    uint64_t *identity = boot_l2();
+    *identity = (uint64_t)(page_table + 6 * 512) | pte_present | pte_writable;
+    write_cr3(read_cr3());
+
+    lapic_send_init_all();
+    io_delay(10000);
+    lapic_send_startup_all(AP_TRAMPOLINE_BASE >> 12);
+    io_delay(200);
+    lapic_send_startup_all(AP_TRAMPOLINE_BASE >> 12);
+    io_delay(10000);
+
+    // wait for every AP that made it into long mode
+    volatile uint32_t *started = &trampoline_var(ap_trampoline_count);
+    unsigned int expected = *started < aps ? *started : aps;
+    for(unsigned int waited = 0; cpu_count() < expected + 1 && waited < 100000; waited++)
+        io_delay(1);
+
+    *identity = 0;
+    write_cr3(read_cr3());
+    __atomic_store_n(&ap_release, true, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,205 @@
+#include "machine/spinlock.h"
+#include "machine/tsc.h"
+#include "stdlib/stdio.h"
+#include <stddef.h>
+
+#ifdef LOCK_STATS
+static LockStats *named = NULL;
+
+void lock_stats_register(LockStats *stats, const char *name)
+{
+    if(stats->name)
+        return;
+    stats->name = name;
+    LockStats *head = __atomic_load_n(&named, __ATOMIC_RELAXED);
+    do
+        stats->next = head;
+    while(!__atomic_compare_exchange_n(&named, &head, stats, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// the holder updates the counters of exclusive locks, no atomics needed
+static inline void acquired(LockStats *stats, uint64_t spins)
+{
+    stats->acquisitions++;
+    if(spins)
+        stats->contended++;
+    stats->spins += spins;
+    stats->acquired_at = rdtsc();
+}
+
+static inline void released(LockStats *stats)
+{
+    stats->hold_cycles += rdtsc() - stats->acquired_at;
+}
+
+// shared holders race each other
+static inline void acquired_shared(LockStats *stats, uint64_t spins)
+{
+    __atomic_fetch_add(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    if(spins)
+    {
+        __atomic_fetch_add(&stats->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->spins, spins, __ATOMIC_RELAXED);
+    }
+}
+
+void lock_stats_dump()
+{
+    for(LockStats *s = __atomic_load_n(&named, __ATOMIC_ACQUIRE); s; s = s->next)
+        printf("lock %s: %lu acquisitions, %lu contended, %lu spins, %lu cycles held\n",
+                s->name, s->acquisitions, s->contended, s->spins, s->hold_cycles);
+}
+#define ACQUIRED(lock, spins) acquired(&(lock)->stats, spins)
+#define RELEASED(lock) released(&(lock)->stats)
+#define ACQUIRED_SHARED(lock, spins) acquired_shared(&(lock)->stats, spins)
+#else
+void lock_stats_dump()
+{
+    printf("lock statistics need a LOCK_STATS build\n");
+}
+#define ACQUIRED(lock, spins) ((void)(spins))
+#define RELEASED(lock) ((void)0)
+#define ACQUIRED_SHARED(lock, spins) ((void)(spins))
+#endif
+
+bool spin_trylock(Spinlock *lock)
+{
+    if(__atomic_exchange_n(&lock->locked, true, __ATOMIC_ACQUIRE))
+        return false;
+    ACQUIRED(lock, 0);
+    return true;
+}
+
+void spin_lock(Spinlock *lock)
+{
+    uint64_t spins = 0;
+    while(__atomic_exchange_n(&lock->locked, true, __ATOMIC_ACQUIRE))
+    {
+        // wait on a shared copy of the cache line instead of bouncing it with xchg
+        while(__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+        {
+            asm volatile("pause");
+            spins++;
+        }
+    }
+    ACQUIRED(lock, spins);
+}
+
+void spin_unlock(Spinlock *lock)
+{
+    RELEASED(lock);
+    __atomic_store_n(&lock->locked, false, __ATOMIC_RELEASE);
+}
+
+void ticket_lock(TicketLock *lock)
+{
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint64_t spins = 0;
+    while(__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+    {
+        asm volatile("pause");
+        spins++;
+    }
+    ACQUIRED(lock, spins);
+}
+
+bool ticket_trylock(TicketLock *lock)
+{
+    uint32_t word = __atomic_load_n(&lock->word, __ATOMIC_RELAXED);
+    // free only if nobody holds or waits for a ticket
+    if((word & 0xFFFF) != word >> 16)
+        return false;
+    if(!__atomic_compare_exchange_n(&lock->word, &word, word + (1 << 16), false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+    ACQUIRED(lock, 0);
+    return true;
+}
+
+void ticket_unlock(TicketLock *lock)
+{
+    RELEASED(lock);
+    // only the holder writes `owner`
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+void mcs_lock(McsLock *lock, McsNode *node)
+{
+    node->next = NULL;
+    node->locked = true;
+    McsNode *prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    uint64_t spins = 0;
+    if(prev)
+    {
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while(__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+        {
+            asm volatile("pause");
+            spins++;
+        }
+    }
+    ACQUIRED(lock, spins);
+}
+
+void mcs_unlock(McsLock *lock, McsNode *node)
+{
+    RELEASED(lock);
+    McsNode *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if(!next)
+    {
+        McsNode *expected = node;
+        if(__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+        // a successor swapped itself in but hasn't linked yet
+        while(!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+            asm volatile("pause");
+    }
+    __atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+}
+
+#define RW_WRITER 1u
+#define RW_WAITING 2u
+#define RW_READER 4u
+
+void read_lock(RwLock *lock)
+{
+    uint64_t spins = 0;
+    for(;;)
+    {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if(!(state & (RW_WRITER | RW_WAITING))
+            && __atomic_compare_exchange_n(&lock->state, &state, state + RW_READER, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        asm volatile("pause");
+        spins++;
+    }
+    ACQUIRED_SHARED(lock, spins);
+}
+
+void read_unlock(RwLock *lock)
+{
+    __atomic_fetch_sub(&lock->state, RW_READER, __ATOMIC_RELEASE);
+}
+
+void write_lock(RwLock *lock)
+{
+    uint64_t spins = 0;
+    for(;;)
+    {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        // no holders left, other waiting writers set RW_WAITING again
+        if(!(state & ~RW_WAITING)
+            && __atomic_compare_exchange_n(&lock->state, &state, RW_WRITER, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        if(!(state & RW_WAITING))
+            __atomic_fetch_or(&lock->state, RW_WAITING, __ATOMIC_RELAXED);
+        asm volatile("pause");
+        spins++;
+    }
+    ACQUIRED(lock, spins);
+}
+
+void write_unlock(RwLock *lock)
+{
+    RELEASED(lock);
+    __atomic_fetch_and(&lock->state, ~RW_WRITER, __ATOMIC_RELEASE);
+}
@@ -2,12 +2,17 @@
 #include <stdint.h>
 #include <stddef.h>
 
+extern void toc_start();
+
+// The first switch returns into toc_start, which calls kickoff(coroutine)
+// from r12/r13 with the stack aligned as the ABI wants it.
 void toc_settle(/*OUT*/ toc* regs, void* tos, kickoff_func kickoff, void* coroutine)
 {
-    regs->rbp = (void*)((uintptr_t*)tos - 1);
-    regs->rsp = (void*)((uintptr_t*)tos - 3);
-    ((uintptr_t*)regs->rsp)[2] = (uintptr_t)coroutine;
-    ((kickoff_func*)regs->rsp)[0] = kickoff;
+    regs->r12 = coroutine;
+    regs->r13 = (void*)(uintptr_t)kickoff;
+    regs->rbp = NULL; // anchors stack backtraces
+    regs->rsp = (void*)((uintptr_t*)tos - 1);
+    ((uintptr_t*)regs->rsp)[0] = (uintptr_t)toc_start;
 }
 
 toc new_toc()
@@ -6,10 +6,12 @@ r14_offset: resq 1
 r15_offset: resq 1
 rbp_offset: resq 1
 rsp_offset: resq 1
-fpu_offset: resb 108
+alignb 16
+fpu_offset: resb 512
 
 global toc_switch
 global toc_go
+global toc_start
 
 section .text
 toc_go:
@@ -38,3 +40,9 @@ toc_switch:
     mov rbp, [rsi+rbp_offset]
     mov rsp, [rsi+rsp_offset]
     ret
+
+; entered through the ret of the first switch, see toc_settle
+toc_start:
+    mov rdi, r12
+    call r13
+    ud2 ; kickoff doesn't return
@@ -0,0 +1,26 @@
+#include "machine/tsc.h"
+#include "machine/pit.h"
+#include "cpu.h"
+
+#define CALIBRATION_TICKS (PIT_HZ / 100) // 10 ms
+
+uint64_t tsc_hz = 0;
+
+void tsc_calibrate()
+{
+    // an interrupt in between would be counted as well
+    unsigned long flags = int_save();
+    uint64_t start = rdtsc();
+    pit_delay(CALIBRATION_TICKS);
+    uint64_t end = rdtsc();
+    int_restore(flags);
+    tsc_hz = (end - start) * PIT_HZ / CALIBRATION_TICKS;
+}
+
+uint64_t tsc_to_us(uint64_t cycles)
+{
+    if(!tsc_hz)
+        return 0;
+    // split up, cycles * 1000000 overflows after a few hours
+    return cycles / tsc_hz * 1000000 + cycles % tsc_hz * 1000000 / tsc_hz;
+}
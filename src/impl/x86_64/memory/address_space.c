@@ -0,0 +1,264 @@
+#include "memory/address_space.h"
+#include "memory/frame.h"
+#include "memory/paging.h"
+#include "boot/page_table.h"
+#include "exception.h"
+#include "machine/cpuid.h"
+#include "thread/channel.h"
+#include "stdlib/algorithm.h"
+#include "stdlib/memory.h"
+#include "cpu.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PCID_MAX 4095
+#define CR3_NOFLUSH (1UL << 63)
+#define CR4_PCIDE (1UL << 17)
+// accesses this far below rsp still grow a stack: pushes and the red zone
+#define STACK_SLACK 256
+
+AddressSpace kernel_space;
+static bool pcid_enabled = false;
+
+// called on every CPU while it still runs with PCID 0
+void address_space_init()
+{
+    PerCPU *cpu = cpu_this();
+
+    if(cpu->id == 0)
+    {
+        kernel_space.root = boot_l4();
+        kernel_space.root_phys = kernel_to_phys(kernel_space.root);
+        pcid_enabled = cpuid(1, 0).ecx & (1 << 17);
+    }
+
+    if(pcid_enabled)
+    {
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PCIDE));
+    }
+
+    cpu->pcid_generation = 1;
+    cpu->pcid_next = 1;
+    kernel_space.pcid[cpu->id] = 0;
+    kernel_space.generation[cpu->id] = 1;
+    cpu->space = &kernel_space;
+}
+
+// a fresh space sharing all kernel mappings
+AddressSpace *address_space_create()
+{
+    AddressSpace *space = kmalloc(sizeof(AddressSpace));
+    if(!space)
+        return NULL;
+
+    uintptr_t frame = frame_alloc();
+    if(!frame)
+    {
+        kfree(space);
+        return NULL;
+    }
+
+    memset(space, 0, sizeof(AddressSpace));
+    space->root = phys_to_virt(frame);
+    space->root_phys = frame;
+    // kernel, direct map and the MMIO windows below 4 GiB are shared from the top level on
+    memcpy(space->root, kernel_space.root, FRAME_SIZE);
+    memset(&space->root[USER_BASE >> 39], 0, ((USER_END - USER_BASE) >> 39) * sizeof(uint64_t));
+    return space;
+}
+
+// the space must not be active on any CPU anymore
+void address_space_destroy(AddressSpace *space)
+{
+    paging_release(space->root, USER_BASE, USER_END - USER_BASE);
+    while(space->regions)
+    {
+        Region *next = space->regions->next;
+        // unmapped above, the last mapping takes a destroyed channel along
+        if(space->regions->channel)
+            channel_put(space->regions->channel);
+        kfree(space->regions);
+        space->regions = next;
+    }
+    frame_free(space->root_phys);
+    kfree(space);
+}
+
+void address_space_switch(AddressSpace *space)
+{
+    if(!space)
+        space = &kernel_space;
+
+    unsigned long flags = int_save();
+    PerCPU *cpu = cpu_this();
+
+    if(cpu->space != space)
+    {
+        uint64_t cr3 = space->root_phys;
+        if(pcid_enabled)
+        {
+            unsigned int id = cpu->id;
+            if(space->generation[id] == cpu->pcid_generation)
+                cr3 |= space->pcid[id] | CR3_NOFLUSH;
+            else
+            {
+                // all PCIDs handed out: start a new generation, every space gets a new one
+                if(cpu->pcid_next > PCID_MAX)
+                {
+                    cpu->pcid_generation++;
+                    cpu->pcid_next = 1;
+                }
+                space->pcid[id] = cpu->pcid_next++;
+                space->generation[id] = cpu->pcid_generation;
+                // without NOFLUSH, whatever the PCID cached for its last owner is dropped
+                cr3 |= space->pcid[id];
+            }
+        }
+        write_cr3(cr3);
+        cpu->space = space;
+    }
+
+    int_restore(flags);
+}
+
+// invlpg and CR3 reloads only reach the current PCID. Retiring the others
+// makes every other space take a fresh, flushed PCID when it runs next here.
+void address_space_flush_inactive()
+{
+    if(!pcid_enabled)
+        return;
+
+    unsigned long flags = int_save();
+    PerCPU *cpu = cpu_this();
+    AddressSpace *space = cpu->space;
+
+    cpu->pcid_generation++;
+    cpu->pcid_next = space->pcid[cpu->id] + 1;
+    space->generation[cpu->id] = cpu->pcid_generation;
+
+    int_restore(flags);
+}
+
+// region whose [floor, end) contains `addr`, caller holds space->lock
+static Region *find(AddressSpace *space, uintptr_t addr)
+{
+    for(Region *r = space->regions; r && r->floor <= addr; r = r->next)
+        if(addr < r->end)
+            return r;
+    return NULL;
+}
+
+// links `region` in unless it overlaps another one, caller holds space->lock
+static bool insert(AddressSpace *space, Region *region)
+{
+    Region **link = &space->regions;
+    while(*link && (*link)->end <= region->floor)
+        link = &(*link)->next;
+    if(*link && (*link)->floor < region->end)
+        return false;
+    region->next = *link;
+    *link = region;
+    return true;
+}
+
+static bool add_region(AddressSpace *space, uintptr_t floor, uintptr_t start, uintptr_t end, uint64_t flags, struct Channel *channel)
+{
+    if(((floor | end) & (PAGE_SIZE - 1)) || floor >= end || floor < USER_BASE || end > USER_END)
+        return false;
+    Region *region = kmalloc(sizeof(Region));
+    if(!region)
+        return false;
+    *region = (Region){floor, start, end, flags, channel, NULL};
+
+    unsigned long irq = spin_lock_irqsave(&space->lock);
+    bool ok = insert(space, region);
+    spin_unlock_irqrestore(&space->lock, irq);
+    if(!ok)
+        kfree(region);
+    return ok;
+}
+
+bool address_space_reserve(AddressSpace *space, uintptr_t start, size_t size, uint64_t flags)
+{
+    return add_region(space, start, start, start + size, flags, NULL);
+}
+
+bool address_space_reserve_channel(AddressSpace *space, uintptr_t start, size_t size, uint64_t flags, struct Channel *channel)
+{
+    return add_region(space, start, start, start + size, flags, channel);
+}
+
+bool address_space_stack(AddressSpace *space, uintptr_t top, size_t size, uint64_t flags)
+{
+    if(size < 2 * PAGE_SIZE || size > top)
+        return false;
+    return add_region(space, top - size, top, top, flags | pte_writable, NULL);
+}
+
+AddressSpace *address_space_fork(AddressSpace *space)
+{
+    AddressSpace *child = address_space_create();
+    if(!child)
+        return NULL;
+
+    bool ok = true;
+    unsigned long irq = spin_lock_irqsave(&space->lock);
+    Region **tail = &child->regions;
+    for(Region *r = space->regions; r && ok; r = r->next)
+    {
+        Region *copy = kmalloc(sizeof(Region));
+        if(!copy)
+        {
+            ok = false;
+            break;
+        }
+        *copy = *r;
+        copy->next = NULL;
+        if(copy->channel)
+            channel_ref(copy->channel);
+        *tail = copy;
+        tail = &copy->next;
+        if(r->start < r->end)
+            ok = paging_fork(child->root, space->root, r->start, r->end - r->start);
+    }
+    spin_unlock_irqrestore(&space->lock, irq);
+
+    if(!ok)
+    {
+        address_space_destroy(child);
+        return NULL;
+    }
+    return child;
+}
+
+bool address_space_fault(AddressSpace *space, uintptr_t addr, uint64_t error, uint64_t rsp)
+{
+    if(error & pf_reserved)
+        return false;
+    uintptr_t page = addr & ~(uintptr_t)(PAGE_SIZE - 1);
+
+    unsigned long irq = spin_lock_irqsave(&space->lock);
+    Region *region = find(space, addr);
+    uint64_t flags = region ? region->flags : 0;
+    bool allowed = region
+        && (!(error & pf_write) || (flags & pte_writable))
+        && (!(error & pf_user) || (flags & pte_user));
+    if(allowed && addr < region->start)
+    {
+        // stacks grow by pushes from user mode or accesses of the kernel,
+        // never into their guard page
+        allowed = addr >= region->floor + PAGE_SIZE && (!(error & pf_user) || addr + STACK_SLACK >= rsp);
+        if(allowed)
+            region->start = page;
+    }
+    spin_unlock_irqrestore(&space->lock, irq);
+
+    if(!allowed)
+        return false;
+    if(!(error & pf_present))
+        return paging_populate(space->root, page, flags);
+    // present and still faulting, only a write to a copy-on-write page is legal
+    return (error & pf_write) && paging_unshare(space->root, page);
+}
@@ -0,0 +1,295 @@
+#include "memory/frame.h"
+#include "boot/page_table.h"
+#include "machine/percpu.h"
+#include "machine/spinlock.h"
+#include "stdlib/algorithm.h"
+#include "panic.h"
+#include "cpu.h"
+#include <stdbool.h>
+
+// linker supplied, physical addresses
+extern char _kernel_start[];
+extern char _kernel_end[];
+
+#define MAX_RESERVED 16
+#define MAGAZINE_SIZE 32
+
+#define align_down(x) ((x) & ~(uintptr_t)(FRAME_SIZE - 1))
+#define align_up(x) align_down((x) + FRAME_SIZE - 1)
+
+typedef struct
+{
+    uintptr_t start;
+    uintptr_t end;
+} Range;
+
+// Per-CPU cache of single frames, only touched by its CPU with interrupts off
+typedef struct
+{
+    unsigned int count;
+    uintptr_t frames[MAGAZINE_SIZE];
+} __attribute__((aligned(64))) Magazine;
+
+static uint64_t direct_l3[512] __attribute__((aligned(PAGE_SIZE)));
+static uint64_t direct_l2[DIRECT_MAP_SIZE >> 30][512] __attribute__((aligned(PAGE_SIZE)));
+
+static Range reserved[MAX_RESERVED];
+static unsigned int reserved_count = 0;
+
+// bit n set <=> frame n is in use (or doesn't exist)
+static uint64_t *bitmap = NULL;
+static size_t bitmap_words = 0;
+static size_t frame_count = 0;
+static size_t free_count = 0;
+static size_t search_hint = 0; // no free frame in the words below
+// owners beyond the first, per frame, placed right behind the bitmap
+static uint8_t *shares = NULL;
+// every CPU refills its magazine here, in turn so none starves
+static TicketLock frame_lock = TICKETLOCK_INIT;
+
+static Magazine magazines[MAX_CPUS];
+
+#define for_each_mmap(e, tag)                                                       \
+    for(multiboot_memory_map_t *e = (tag)->entries;                                 \
+        (multiboot_uint8_t *)e < (multiboot_uint8_t *)(tag) + (tag)->size;          \
+        e = (multiboot_memory_map_t *)((multiboot_uint8_t *)e + (tag)->entry_size))
+
+// 2 MiB pages over the first DIRECT_MAP_SIZE bytes, shared by all CPUs via l4[256]
+static void direct_map_init()
+{
+    for(unsigned int i = 0; i < DIRECT_MAP_SIZE >> 30; i++)
+    {
+        for(unsigned int j = 0; j < 512; j++)
+            direct_l2[i][j] = (((uint64_t)i << 30) + ((uint64_t)j << 21))
+                | pte_present | pte_writable | pte_huge;
+        direct_l3[i] = kernel_to_phys(direct_l2[i]) | pte_present | pte_writable;
+    }
+    boot_l4()[(DIRECT_MAP_BASE >> 39) & 511] = kernel_to_phys(direct_l3) | pte_present | pte_writable;
+}
+
+void frame_add_reserved(uintptr_t start, uintptr_t end)
+{
+    if(reserved_count == MAX_RESERVED)
+        panic("frame_add_reserved: too many ranges");
+    reserved[reserved_count++] = (Range){align_down(start), align_up(end)};
+}
+
+static const Range *find_reserved(uintptr_t start, uintptr_t end)
+{
+    for(unsigned int i = 0; i < reserved_count; i++)
+        if(start < reserved[i].end && reserved[i].start < end)
+            return &reserved[i];
+    return NULL;
+}
+
+// lowest available spot for `size` bytes that doesn't collide with a reserved range
+static uintptr_t place_bitmap(struct multiboot_tag_mmap *mmap, size_t size)
+{
+    for_each_mmap(e, mmap)
+    {
+        if(e->type != MULTIBOOT_MEMORY_AVAILABLE)
+            continue;
+        uintptr_t start = align_up(e->addr);
+        uintptr_t end = e->addr + e->len < DIRECT_MAP_SIZE ? e->addr + e->len : DIRECT_MAP_SIZE;
+        const Range *r;
+        while(start + size <= end)
+        {
+            if(!(r = find_reserved(start, start + size)))
+                return start;
+            start = r->end;
+        }
+    }
+    panic("frame_init: no room for the frame bitmap");
+    return 0;
+}
+
+static void mark(size_t first, size_t count, bool used)
+{
+    for(size_t n = first; n < first + count && n < frame_count; n++)
+    {
+        uint64_t bit = 1ULL << (n % 64);
+        if(!(bitmap[n / 64] & bit) == !used)
+            continue;
+        bitmap[n / 64] ^= bit;
+        if(used)
+            free_count--;
+        else
+            free_count++;
+    }
+    if(!used && first / 64 < search_hint)
+        search_hint = first / 64;
+}
+
+static void mark_range(uintptr_t start, uintptr_t end, bool used)
+{
+    // only whole frames become available, partially reserved ones are used
+    uintptr_t first = used ? align_down(start) : align_up(start);
+    uintptr_t last = used ? align_up(end) : align_down(end);
+    if(last > first)
+        mark(first / FRAME_SIZE, (last - first) / FRAME_SIZE, used);
+}
+
+void frame_init(struct multiboot_tag_mmap *mmap)
+{
+    lock_name(&frame_lock, "frame");
+    direct_map_init();
+
+    uintptr_t top = 0;
+    for_each_mmap(e, mmap)
+        if(e->type == MULTIBOOT_MEMORY_AVAILABLE && e->addr + e->len > top)
+            top = e->addr + e->len;
+    if(top > DIRECT_MAP_SIZE)
+        top = DIRECT_MAP_SIZE;
+
+    frame_count = top / FRAME_SIZE;
+    bitmap_words = (frame_count + 63) / 64;
+
+    // the first MiB holds BIOS data and the AP trampoline
+    frame_add_reserved(0, 0x100000);
+    frame_add_reserved((uintptr_t)_kernel_start, (uintptr_t)_kernel_end);
+
+    size_t bitmap_size = bitmap_words * sizeof(uint64_t) + frame_count;
+    uintptr_t bitmap_phys = place_bitmap(mmap, bitmap_size);
+    bitmap = phys_to_virt(bitmap_phys);
+    memset(bitmap, 0xff, bitmap_words * sizeof(uint64_t));
+    shares = (uint8_t *)(bitmap + bitmap_words);
+    memset(shares, 0, frame_count);
+
+    for_each_mmap(e, mmap)
+        if(e->type == MULTIBOOT_MEMORY_AVAILABLE && e->addr < top)
+            mark_range(e->addr, e->addr + e->len < top ? e->addr + e->len : top, false);
+
+    for(unsigned int i = 0; i < reserved_count; i++)
+        mark_range(reserved[i].start, reserved[i].end, true);
+    mark_range(bitmap_phys, bitmap_phys + bitmap_size, true);
+}
+
+// takes up to `max` single frames from the bitmap, caller holds frame_lock
+static unsigned int bitmap_take(uintptr_t *frames, unsigned int max)
+{
+    unsigned int n = 0;
+    for(size_t w = search_hint; w < bitmap_words && n < max; w++)
+    {
+        while(~bitmap[w] && n < max)
+        {
+            unsigned int bit = __builtin_ctzll(~bitmap[w]);
+            bitmap[w] |= 1ULL << bit;
+            frames[n++] = (w * 64 + bit) * FRAME_SIZE;
+        }
+        if(!~bitmap[w])
+            search_hint = w + 1;
+    }
+    free_count -= n;
+    return n;
+}
+
+static void bitmap_give(const uintptr_t *frames, unsigned int count)
+{
+    for(unsigned int i = 0; i < count; i++)
+        mark(frames[i] / FRAME_SIZE, 1, false);
+}
+
+uintptr_t frame_alloc()
+{
+    unsigned long flags = int_save();
+    Magazine *m = &magazines[cpu_id()];
+
+    if(!m->count)
+    {
+        ticket_lock(&frame_lock);
+        m->count = bitmap_take(m->frames, MAGAZINE_SIZE / 2);
+        ticket_unlock(&frame_lock);
+    }
+
+    uintptr_t frame = m->count ? m->frames[--m->count] : 0;
+    int_restore(flags);
+    return frame;
+}
+
+void frame_free(uintptr_t frame)
+{
+    unsigned long flags = int_save();
+    Magazine *m = &magazines[cpu_id()];
+
+    if(m->count == MAGAZINE_SIZE)
+    {
+        // give back the older half, keep the recently freed (cache hot) ones
+        ticket_lock(&frame_lock);
+        bitmap_give(m->frames, MAGAZINE_SIZE / 2);
+        ticket_unlock(&frame_lock);
+        memmove(m->frames, m->frames + MAGAZINE_SIZE / 2, MAGAZINE_SIZE / 2 * sizeof(uintptr_t));
+        m->count -= MAGAZINE_SIZE / 2;
+    }
+    m->frames[m->count++] = frame;
+    int_restore(flags);
+}
+
+// first fit over the bitmap
+uintptr_t frame_alloc_contiguous(size_t count)
+{
+    uintptr_t base = 0;
+    unsigned long flags = ticket_lock_irqsave(&frame_lock);
+
+    size_t run = 0;
+    for(size_t n = search_hint * 64; n < frame_count; n++)
+    {
+        if(!(n % 64) && !~bitmap[n / 64])
+        {
+            run = 0;
+            n += 63;
+            continue;
+        }
+        if(bitmap[n / 64] & (1ULL << (n % 64)))
+            run = 0;
+        else if(++run == count)
+        {
+            mark(n + 1 - count, count, true);
+            base = (n + 1 - count) * FRAME_SIZE;
+            break;
+        }
+    }
+
+    ticket_unlock_irqrestore(&frame_lock, flags);
+    return base;
+}
+
+void frame_free_contiguous(uintptr_t base, size_t count)
+{
+    unsigned long flags = ticket_lock_irqsave(&frame_lock);
+    mark(base / FRAME_SIZE, count, false);
+    ticket_unlock_irqrestore(&frame_lock, flags);
+}
+
+bool frame_share(uintptr_t frame)
+{
+    uint8_t *count = &shares[frame / FRAME_SIZE];
+    uint8_t n = __atomic_load_n(count, __ATOMIC_RELAXED);
+    do
+        if(n == UINT8_MAX)
+            return false;
+    while(!__atomic_compare_exchange_n(count, &n, n + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+bool frame_shared(uintptr_t frame)
+{
+    return __atomic_load_n(&shares[frame / FRAME_SIZE], __ATOMIC_ACQUIRE);
+}
+
+void frame_release(uintptr_t frame)
+{
+    uint8_t *count = &shares[frame / FRAME_SIZE];
+    uint8_t n = __atomic_load_n(count, __ATOMIC_ACQUIRE);
+    do
+        if(!n)
+        {
+            frame_free(frame);
+            return;
+        }
+    while(!__atomic_compare_exchange_n(count, &n, n - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+size_t frame_available()
+{
+    return __atomic_load_n(&free_count, __ATOMIC_RELAXED);
+}
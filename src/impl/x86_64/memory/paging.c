@@ -0,0 +1,488 @@
+#include "memory/paging.h"
+#include "memory/frame.h"
+#include "memory/address_space.h"
+#include "machine/cpuid.h"
+#include "machine/lapic.h"
+#include "machine/msr.h"
+#include "machine/percpu.h"
+#include "machine/spinlock.h"
+#include "stdlib/algorithm.h"
+#include "plugbox.h"
+#include "cpu.h"
+
+// leaf flags that survive splitting a huge page
+#define PTE_FLAGS 0x8000000000000fffUL
+// Power-on PAT with entry 4 (PAT set, PCD and PWT clear) changed from
+// write-back to write-combining: WB, WT, UC-, UC, WC, WT, UC-, UC
+#define PAT_VALUE 0x0007040100070406UL
+// end of the canonical lower half, everything above is kernel-only
+#define USER_HALF_END (1UL << 47)
+// a range this large is cheaper to drop with a CR3 reload than page by page
+#define INVLPG_MAX 64
+
+enum walk
+{
+    walk_lookup, // stop at missing tables
+    walk_create, // allocate missing tables
+    walk_split,  // also break huge pages on the way
+};
+
+static bool gigantic_pages = false;
+static bool pat = false;
+// every page fault of every CPU comes through here, waiters queue instead
+// of bouncing the lock's cache line between them
+static McsLock paging_lock = MCSLOCK_INIT;
+
+// TLB shootdown: CPUs acknowledge a generation after flushing their TLB
+static uint64_t tlb_generation = 0;
+static struct
+{
+    uint64_t generation;
+} __attribute__((aligned(64))) tlb_acked[MAX_CPUS];
+
+static void tlb_flush_ack()
+{
+    uint64_t generation = __atomic_load_n(&tlb_generation, __ATOMIC_SEQ_CST);
+    write_cr3(read_cr3());
+    address_space_flush_inactive();
+    __atomic_store_n(&tlb_acked[cpu_id()].generation, generation, __ATOMIC_RELEASE);
+}
+
+bool tlb_prologue()
+{
+    tlb_flush_ack();
+    return false;
+}
+
+// invalidates [virt, virt + size) here, other CPUs flush everything
+static void tlb_invalidate(uintptr_t virt, size_t size, size_t step)
+{
+    if(size / step > INVLPG_MAX)
+        write_cr3(read_cr3());
+    else
+        for(uintptr_t a = virt; a < virt + size; a += step)
+            invlpg((void *)a);
+    address_space_flush_inactive();
+
+    if(cpu_count() < 2)
+        return;
+
+    unsigned int self = cpu_id();
+    uint64_t generation = __atomic_add_fetch(&tlb_generation, 1, __ATOMIC_SEQ_CST);
+    for(unsigned int i = 0; i < MAX_CPUS; i++)
+        if(i != self && __atomic_load_n(&percpu[i].online, __ATOMIC_ACQUIRE))
+            lapic_send_ipi(percpu[i].lapic_id, int_tlb);
+
+    for(unsigned int i = 0; i < MAX_CPUS; i++)
+    {
+        if(i == self || !__atomic_load_n(&percpu[i].online, __ATOMIC_ACQUIRE))
+            continue;
+        while(__atomic_load_n(&tlb_acked[i].generation, __ATOMIC_ACQUIRE) < generation)
+        {
+            // the other CPU may be waiting for us just the same
+            if(tlb_acked[self].generation < __atomic_load_n(&tlb_generation, __ATOMIC_SEQ_CST))
+                tlb_flush_ack();
+            asm volatile("pause");
+        }
+    }
+}
+
+void paging_init()
+{
+    lock_name(&paging_lock, "paging");
+    gigantic_pages = cpuid(0x80000001, 0).edx & (1 << 26);
+    static interrupt_handler tlb_handler = INTERRUPT_HANDLER(tlb_prologue, NULL);
+    plugbox_assign(int_tlb, &tlb_handler);
+}
+
+// nothing is mapped with pte_pat yet the first time, no caches to flush
+void paging_cpu_init()
+{
+    if(!(cpuid(1, 0).edx & (1 << 16)))
+        return;
+    wrmsr(MSR_PAT, PAT_VALUE);
+    pat = true;
+}
+
+bool paging_write_combining()
+{
+    return pat;
+}
+
+uint64_t *paging_kernel_root()
+{
+    return boot_l4();
+}
+
+static inline unsigned int index_of(uintptr_t virt, unsigned int level)
+{
+    return (virt >> (12 + 9 * (level - 1))) & 511;
+}
+
+static inline size_t level_size(unsigned int level)
+{
+    return 1UL << (12 + 9 * (level - 1));
+}
+
+// replaces a huge page at `level` by a table of the next smaller pages
+static bool split(uint64_t *entry, unsigned int level)
+{
+    uintptr_t frame = frame_alloc();
+    if(!frame)
+        return false;
+
+    uint64_t *table = phys_to_virt(frame);
+    uint64_t flags = *entry & PTE_FLAGS;
+    size_t step = level_size(level - 1);
+    // bit 7 means PAT in 4 KiB entries
+    if(level - 1 == 1)
+        flags &= ~(uint64_t)pte_huge;
+    for(unsigned int i = 0; i < 512; i++)
+        table[i] = ((*entry & PTE_ADDRESS) + i * step) | flags;
+
+    // keep the entry usable for everything below, the leaves decide
+    *entry = frame | pte_present | pte_writable | (flags & pte_user);
+    return true;
+}
+
+// entry of `virt` at `level`, descending from the root
+static uint64_t *walk(uint64_t *root, uintptr_t virt, unsigned int level, enum walk mode)
+{
+    uint64_t *table = root;
+    for(unsigned int l = 4; l > level; l--)
+    {
+        uint64_t *entry = &table[index_of(virt, l)];
+        if(!(*entry & pte_present))
+        {
+            if(mode == walk_lookup)
+                return NULL;
+            uintptr_t frame = frame_alloc();
+            if(!frame)
+                return NULL;
+            memset(phys_to_virt(frame), 0, FRAME_SIZE);
+            // the upper half is the kernel's in every space, user leaves only go below
+            *entry = frame | pte_present | pte_writable | (virt < USER_HALF_END ? pte_user : 0);
+        }
+        else if(*entry & pte_huge)
+        {
+            if(mode != walk_split)
+                return entry;
+            if(!split(entry, l))
+                return NULL;
+        }
+        table = phys_to_virt(*entry & PTE_ADDRESS);
+    }
+    return &table[index_of(virt, level)];
+}
+
+// largest page level usable at this point of a range
+static unsigned int leaf_level(uintptr_t virt, uintptr_t phys, size_t left)
+{
+    if(gigantic_pages && !((virt | phys) & (PAGE_SIZE_1G - 1)) && left >= PAGE_SIZE_1G)
+        return 3;
+    if(!((virt | phys) & (PAGE_SIZE_2M - 1)) && left >= PAGE_SIZE_2M)
+        return 2;
+    return 1;
+}
+
+bool paging_map(uint64_t *root, uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags)
+{
+    bool ok = true, replaced = false;
+    uintptr_t start = virt;
+
+    McsNode node;
+    unsigned long irq = mcs_lock_irqsave(&paging_lock, &node);
+    while(size)
+    {
+        unsigned int level = leaf_level(virt, phys, size);
+        uint64_t *entry = walk(root, virt, level, walk_split);
+
+        // a table is already in place there, map its pages one by one
+        while(level > 1 && entry && (*entry & pte_present) && !(*entry & pte_huge))
+            entry = walk(root, virt, --level, walk_split);
+        if(!entry)
+        {
+            ok = false;
+            break;
+        }
+
+        replaced |= *entry & pte_present;
+        *entry = phys | flags | pte_present | (level > 1 ? pte_huge : 0);
+        virt += level_size(level);
+        phys += level_size(level);
+        size -= level_size(level);
+    }
+    mcs_unlock_irqrestore(&paging_lock, &node, irq);
+
+    // only mappings that existed before can be cached
+    if(replaced)
+        tlb_invalidate(start, virt - start, FRAME_SIZE);
+    return ok;
+}
+
+// applies `flags` to present leaves, or clears them if `unmap`
+static bool update(uint64_t *root, uintptr_t virt, size_t size, uint64_t flags, bool unmap)
+{
+    bool ok = true;
+    uintptr_t start = virt, end = virt + size;
+    size_t step = 0; // size of the pages changed, FRAME_SIZE if mixed
+
+    McsNode node;
+    unsigned long irq = mcs_lock_irqsave(&paging_lock, &node);
+    while(virt < end)
+    {
+        unsigned int level = 4;
+        uint64_t *entry = NULL;
+        // find the leaf, splitting it only if the range covers part of it
+        for(unsigned int l = 3; l >= 1; l--)
+        {
+            entry = walk(root, virt, l, walk_lookup);
+            if(!entry || !(*entry & pte_present))
+            {
+                level = l;
+                break;
+            }
+            if(l == 1 || (*entry & pte_huge))
+            {
+                level = l;
+                if(l > 1 && ((virt & (level_size(l) - 1)) || end - virt < level_size(l)))
+                {
+                    if(!split(entry, l))
+                    {
+                        ok = false;
+                        goto out;
+                    }
+                    continue;
+                }
+                break;
+            }
+        }
+
+        size_t span = level_size(level);
+        if(entry && (*entry & pte_present))
+        {
+            if(unmap)
+                *entry = 0;
+            else
+                *entry = (*entry & PTE_ADDRESS) | flags | pte_present | (level > 1 ? pte_huge : 0);
+            step = !step || step == span ? span : FRAME_SIZE;
+        }
+        virt = (virt & ~(span - 1)) + span;
+    }
+out:
+    mcs_unlock_irqrestore(&paging_lock, &node, irq);
+
+    if(step)
+        tlb_invalidate(start & ~(step - 1), virt - (start & ~(step - 1)), step);
+    return ok;
+}
+
+void paging_unmap(uint64_t *root, uintptr_t virt, size_t size)
+{
+    update(root, virt, size, 0, true);
+}
+
+bool paging_protect(uint64_t *root, uintptr_t virt, size_t size, uint64_t flags)
+{
+    return update(root, virt, size, flags, false);
+}
+
+bool paging_translate(uint64_t *root, uintptr_t virt, uintptr_t *phys)
+{
+    for(unsigned int level = 3; level >= 1; level--)
+    {
+        uint64_t *entry = walk(root, virt, level, walk_lookup);
+        if(!entry || !(*entry & pte_present))
+            return false;
+        if(level == 1 || (*entry & pte_huge))
+        {
+            *phys = (*entry & PTE_ADDRESS & ~(level_size(level) - 1)) | (virt & (level_size(level) - 1));
+            return true;
+        }
+    }
+    return false;
+}
+
+bool paging_populate(uint64_t *root, uintptr_t virt, uint64_t flags)
+{
+    uintptr_t frame = frame_alloc();
+    if(!frame)
+        return false;
+    memset(phys_to_virt(frame), 0, FRAME_SIZE);
+
+    McsNode node;
+    unsigned long irq = mcs_lock_irqsave(&paging_lock, &node);
+    uint64_t *entry = walk(root, virt, 1, walk_create);
+    // another CPU may have been faster
+    bool mapped = entry && !(*entry & pte_present);
+    if(mapped)
+        *entry = frame | flags | pte_present;
+    mcs_unlock_irqrestore(&paging_lock, &node, irq);
+
+    if(!mapped)
+        frame_free(frame);
+    return entry != NULL;
+}
+
+// shares the leaves of `src` in [virt, end) with `dst`, caller holds paging_lock
+static bool fork_table(uint64_t *dst, uint64_t *src, unsigned int level, uintptr_t base,
+                       uintptr_t virt, uintptr_t end, bool *protected)
+{
+    size_t span = level_size(level);
+    for(unsigned int i = 0; i < 512; i++)
+    {
+        uintptr_t from = base + i * span;
+        if(from + span <= virt || from >= end || !(src[i] & pte_present))
+            continue;
+        if(src[i] & pte_huge)
+            return false;
+
+        if(level > 1)
+        {
+            if(!(dst[i] & pte_present))
+            {
+                uintptr_t frame = frame_alloc();
+                if(!frame)
+                    return false;
+                memset(phys_to_virt(frame), 0, FRAME_SIZE);
+                dst[i] = frame | (src[i] & PTE_FLAGS);
+            }
+            if(!fork_table(phys_to_virt(dst[i] & PTE_ADDRESS), phys_to_virt(src[i] & PTE_ADDRESS),
+                           level - 1, from, virt, end, protected))
+                return false;
+            continue;
+        }
+
+        uintptr_t frame = src[i] & PTE_ADDRESS;
+        if((src[i] & pte_borrowed) || frame_share(frame))
+        {
+            // borrowed and writable is shared memory, both keep writing to it
+            if((src[i] & pte_writable) && !(src[i] & pte_borrowed))
+            {
+                src[i] = (src[i] & ~(uint64_t)pte_writable) | pte_cow;
+                *protected = true;
+            }
+            dst[i] = src[i];
+            continue;
+        }
+
+        // too many owners already, this one gets a copy of its own
+        uintptr_t copy = frame_alloc();
+        if(!copy)
+            return false;
+        memcpy(phys_to_virt(copy), phys_to_virt(frame), FRAME_SIZE);
+        uint64_t flags = src[i] & PTE_FLAGS;
+        if(flags & pte_cow)
+            flags = (flags & ~(uint64_t)pte_cow) | pte_writable;
+        dst[i] = copy | flags;
+    }
+    return true;
+}
+
+bool paging_fork(uint64_t *dst, uint64_t *src, uintptr_t virt, size_t size)
+{
+    bool protected = false;
+    McsNode node;
+    unsigned long irq = mcs_lock_irqsave(&paging_lock, &node);
+    bool ok = fork_table(dst, src, 4, 0, virt, virt + size, &protected);
+    mcs_unlock_irqrestore(&paging_lock, &node, irq);
+
+    // the source may still write through cached writable entries
+    if(protected)
+        tlb_invalidate(virt, size, FRAME_SIZE);
+    return ok;
+}
+
+bool paging_unshare(uint64_t *root, uintptr_t virt)
+{
+    virt &= ~(uintptr_t)(FRAME_SIZE - 1);
+    bool ok = false, copied = false;
+
+    McsNode node;
+    unsigned long irq = mcs_lock_irqsave(&paging_lock, &node);
+    uint64_t *entry = walk(root, virt, 1, walk_lookup);
+    if(entry && (*entry & pte_present) && !(*entry & pte_huge))
+    {
+        uintptr_t frame = *entry & PTE_ADDRESS;
+        bool borrowed = *entry & pte_borrowed;
+        uint64_t flags = (*entry & PTE_FLAGS & ~(uint64_t)(pte_cow | pte_borrowed)) | pte_writable;
+        if(*entry & pte_writable)
+            ok = true; // resolved by another CPU in the meantime
+        else if(!(*entry & pte_cow))
+            ok = false;
+        else if(!borrowed && !frame_shared(frame))
+        {
+            // the other owners are gone, the frame is ours to write
+            *entry = frame | flags;
+            ok = true;
+        }
+        else
+        {
+            uintptr_t copy = frame_alloc();
+            if(copy)
+            {
+                memcpy(phys_to_virt(copy), phys_to_virt(frame), FRAME_SIZE);
+                *entry = copy | flags;
+                if(!borrowed)
+                    frame_release(frame);
+                ok = copied = true;
+            }
+        }
+    }
+    mcs_unlock_irqrestore(&paging_lock, &node, irq);
+
+    // other CPUs may still read the old frame, a stale read-only entry of
+    // the same frame only costs them another fault
+    if(copied)
+        tlb_invalidate(virt, FRAME_SIZE, FRAME_SIZE);
+    else if(ok)
+        invlpg((void *)virt);
+    return ok;
+}
+
+// drops the leaves of `table` in [virt, end) and the tables covered completely,
+// caller holds paging_lock
+static bool release_table(uint64_t *table, unsigned int level, uintptr_t base, uintptr_t virt, uintptr_t end)
+{
+    bool present = false;
+    size_t span = level_size(level);
+    for(unsigned int i = 0; i < 512; i++)
+    {
+        uintptr_t from = base + i * span;
+        if(from + span <= virt || from >= end || !(table[i] & pte_present))
+            continue;
+        present = true;
+        uintptr_t frame = table[i] & PTE_ADDRESS;
+        if(level == 1)
+        {
+            if(!(table[i] & pte_borrowed))
+                frame_release(frame);
+        }
+        else if(table[i] & pte_huge)
+        {
+            // only mapped by paging_map, the frames aren't ours to drop
+            if(from < virt || from + span > end)
+                continue;
+        }
+        else
+        {
+            release_table(phys_to_virt(frame), level - 1, from, virt, end);
+            if(from < virt || from + span > end)
+                continue;
+            frame_free(frame);
+        }
+        table[i] = 0;
+    }
+    return present;
+}
+
+void paging_release(uint64_t *root, uintptr_t virt, size_t size)
+{
+    McsNode node;
+    unsigned long irq = mcs_lock_irqsave(&paging_lock, &node);
+    bool present = release_table(root, 4, 0, virt, virt + size);
+    mcs_unlock_irqrestore(&paging_lock, &node, irq);
+
+    if(present)
+        tlb_invalidate(virt, size, FRAME_SIZE);
+}
@@ -0,0 +1,130 @@
+#include "memory/slab.h"
+#include "stdlib/assert.h"
+#include "cpu.h"
+#include <stdint.h>
+
+// ---------------- SLAB LIST START ----------------
+static void slab_link(SlabCache *cache, Slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if(cache->partial)
+        cache->partial->prev = slab;
+    cache->partial = slab;
+}
+
+static void slab_unlink(SlabCache *cache, Slab *slab)
+{
+    if(slab->prev)
+        slab->prev->next = slab->next;
+    else
+        cache->partial = slab->next;
+    if(slab->next)
+        slab->next->prev = slab->prev;
+}
+// ----------------- SLAB LIST END -----------------
+
+static Slab *slab_grow(SlabCache *cache)
+{
+    uintptr_t frame = frame_alloc();
+    if(!frame)
+        return NULL;
+
+    Slab *slab = phys_to_virt(frame);
+    slab->cache = cache;
+    slab->free = NULL;
+    slab->inuse = 0;
+    slab->pages = 1;
+
+    char *object = (char *)slab + SLAB_HEADER;
+    for(unsigned int i = 0; i < cache->per_slab; i++, object += cache->size)
+    {
+        *(void **)object = slab->free;
+        slab->free = object;
+    }
+    slab_link(cache, slab);
+    cache->empty++;
+    return slab;
+}
+
+// moves up to `max` objects into `objects`, caller holds the cache lock
+static unsigned int slab_take(SlabCache *cache, void **objects, unsigned int max)
+{
+    unsigned int n = 0;
+    while(n < max && (cache->partial || slab_grow(cache)))
+    {
+        Slab *slab = cache->partial;
+        if(!slab->inuse)
+            cache->empty--;
+        while(n < max && slab->free)
+        {
+            objects[n++] = slab->free;
+            slab->free = *(void **)slab->free;
+            slab->inuse++;
+        }
+        if(!slab->free)
+            slab_unlink(cache, slab);
+    }
+    return n;
+}
+
+static void slab_give(SlabCache *cache, void **objects, unsigned int count)
+{
+    for(unsigned int i = 0; i < count; i++)
+    {
+        Slab *slab = slab_of(objects[i]);
+        assert(slab->cache == cache, "slab_free: object from another cache");
+
+        if(!slab->free)
+            slab_link(cache, slab);
+        *(void **)objects[i] = slab->free;
+        slab->free = objects[i];
+
+        if(!--slab->inuse)
+        {
+            // keep one empty slab around, return the others to the frame allocator
+            if(cache->empty)
+            {
+                slab_unlink(cache, slab);
+                frame_free(virt_to_phys(slab));
+            }
+            else
+                cache->empty++;
+        }
+    }
+}
+
+void *slab_alloc(SlabCache *cache)
+{
+    unsigned long flags = int_save();
+    SlabCpu *cpu = &cache->cpu[cpu_id()];
+
+    if(!cpu->count)
+    {
+        spin_lock(&cache->lock);
+        cpu->count = slab_take(cache, cpu->objects, SLAB_MAGAZINE / 2);
+        spin_unlock(&cache->lock);
+    }
+
+    void *object = cpu->count ? cpu->objects[--cpu->count] : NULL;
+    int_restore(flags);
+    return object;
+}
+
+void slab_free(SlabCache *cache, void *object)
+{
+    unsigned long flags = int_save();
+    SlabCpu *cpu = &cache->cpu[cpu_id()];
+
+    if(cpu->count == SLAB_MAGAZINE)
+    {
+        spin_lock(&cache->lock);
+        slab_give(cache, cpu->objects, SLAB_MAGAZINE / 2);
+        spin_unlock(&cache->lock);
+        for(unsigned int i = 0; i < SLAB_MAGAZINE / 2; i++)
+            cpu->objects[i] = cpu->objects[i + SLAB_MAGAZINE / 2];
+        cpu->count -= SLAB_MAGAZINE / 2;
+    }
+    cpu->objects[cpu->count++] = object;
+    int_restore(flags);
+}
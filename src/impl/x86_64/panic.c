@@ -1,5 +1,6 @@
 #include "panic.h"
 #include "cgascr.h"
+#include "device/serial.h"
 #include "cpu.h"
 #include "stdlib/string.h"
 #include "stdlib/stdio.h"
@@ -9,11 +10,14 @@
 
 void panicf(const char *fmt, ...)
 {
+    CGA_force_unlock();
+    serial_panic();
     CGA_clear();
     CGA_setpos(0, 0);
 
     CGA_set_color(CGA_F_LIGHT_RED);
     CGA_puts("Kernel panic\n");
+    serial_puts("Kernel panic\n");
     CGA_set_color(CGA_DEFAULT_COLOR);
     if (fmt)
     {
@@ -21,9 +25,9 @@ void panicf(const char *fmt, ...)
 	    va_start(args, fmt);
         vprintf(fmt, args);
         va_end(args);
-        CGA_putchar('\n');
+        printf("\n");
     }
-    CGA_puts("Stacktrace:\n");
+    printf("Stacktrace:\n");
 
     // Print Stacktrace
     struct stack_frame
@@ -40,6 +44,7 @@ void panicf(const char *fmt, ...)
     {
         printf("\t%p\n", (uintptr_t)fp->return_addr);
     }
+    CGA_flush();
 
     cpu_halt();
 }
\ No newline at end of file
@@ -2,41 +2,36 @@
 #include "io_port.h"
 #include "stdint.h"
 
-uint16_t read_imr()
-{
-    uint8_t high = inb(0xA1);
-    uint8_t low = inb(0x21);
-
-    return (high << 8) | low;
-}
+// Shadow of both IMRs, as left by remap_pics in boot/main64.asm: everything
+// but the cascade masked. Masking only writes the half that changed.
+static uint16_t imr = 0xfffb;
 
-void write_imr(uint16_t imr)
+void write_imr(uint16_t value)
 {
-    uint8_t high = (imr >> 8) & 0xFF;
-    uint8_t low = imr & 0xFF;
-
-    outb(0xA1, high);
-    outb(0x21, low);
+    if((value ^ imr) & 0xFF00)
+        outb(0xA1, (value >> 8) & 0xFF);
+    if((value ^ imr) & 0x00FF)
+        outb(0x21, value & 0xFF);
+    imr = value;
 }
 
 void pic_allow(pic_number device)
 {
-    uint16_t imr = read_imr();
-    uint16_t mask = 1 << device;
-    imr &= ~mask;
-    write_imr(imr);
+    write_imr(imr & ~(1 << device));
 }
 
 void pic_forbid(pic_number device)
 {
-    uint16_t imr = read_imr();
-    uint16_t mask = 1 << device;
-    imr |= mask;
-    write_imr(imr);
+    write_imr(imr | (1 << device));
 }
 
 bool pic_ismasked(pic_number device)
 {
-    uint16_t imr = read_imr();
     return imr & (1 << device);
 }
+
+// hands all lines over to the IOAPIC
+void pic_disable()
+{
+    write_imr(0xFFFF);
+}
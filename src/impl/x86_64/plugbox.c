@@ -1,37 +1,89 @@
 #include "plugbox.h"
 #include "panic.h"
 #include "exception.h"
+#include "machine/spinlock.h"
+#include "stdlib/assert.h"
+#include "cpu.h"
 #include <stddef.h>
 
-interrupt_handler table[256];
+// Hot: prologues the interrupt stubs call directly, see boot/main64.asm. Only
+// a lone IRQ or IPI handler without an epilogue gets one, everything else
+// goes through guardian().
+bool (*plugbox_fast[256])() __attribute__((aligned(64)));
+// Cold: the handlers of every vector, linked through `shared`. guardian()
+// walks them with acquire loads and no lock; writers only append to a chain
+// or swap it as a whole, and never touch the links of one they replaced.
+static interrupt_handler *chains[256];
+// Serializes changes. Interrupts read the chains without it, a replaced
+// chain is only retired once a grace period passed, see rcu.h.
+static Spinlock plugbox_lock = SPINLOCK_INIT;
 
-bool basic_prologue()
+interrupt_handler new_interrupt_handler(bool (*prologue)(), void (*epilogue)(unsigned int count))
 {
-    panic("Interrupt received but no matching routine registered");
-    return false;
-}
-
-interrupt_handler new_interrupt_handler(bool (*prologue)(), void (*epilogue)())
-{
-    interrupt_handler h = {prologue, epilogue, false, NULL};
+    interrupt_handler h = INTERRUPT_HANDLER(prologue, epilogue);
     return h;
 }
 
 __attribute__((constructor)) void plugbox_init()
 {
+    lock_name(&plugbox_lock, "plugbox");
     exception_defaults();
-    for(int i = 32; i < 256; i++)
-    {
-        table[i] = new_interrupt_handler(basic_prologue, NULL);;
-    }
 }
 
-void plugbox_assign(unsigned int slot, interrupt_handler handler)
+// caller holds plugbox_lock
+static void publish_fast(unsigned int slot)
+{
+    interrupt_handler *head = chains[slot];
+    bool fast = slot >= 32 && head && !head->shared && !head->epilogue;
+    __atomic_store_n(&plugbox_fast[slot], fast ? head->prologue : NULL, __ATOMIC_RELEASE);
+}
+
+static void retired(RcuHead *head)
 {
-    table[slot] = handler;
+    interrupt_handler *handler = (interrupt_handler *)head;
+    // a prologue of the grace period may have queued its epilogue
+    if(__atomic_load_n(&handler->pending, __ATOMIC_ACQUIRE))
+        rcu_call(&handler->rcu, retired);
+    else if(handler->retire)
+        handler->retire(handler);
+}
+
+void plugbox_assign(interrupt_number slot, interrupt_handler *handler)
+{
+    handler->slot = slot;
+    handler->shared = NULL;
+
+    unsigned long flags = spin_lock_irqsave(&plugbox_lock);
+    interrupt_handler *old = chains[slot];
+    // off the fast path first, in between guardian() already finds the new handler
+    __atomic_store_n(&plugbox_fast[slot], NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&chains[slot], handler, __ATOMIC_RELEASE);
+    publish_fast(slot);
+    spin_unlock_irqrestore(&plugbox_lock, flags);
+
+    // readers may still walk the old chain, its links stay as they are
+    for(interrupt_handler *h = old; h; h = h->shared)
+        if(h != handler)
+            rcu_call(&h->rcu, retired);
+}
+
+void plugbox_share(interrupt_number slot, interrupt_handler *handler)
+{
+    handler->slot = slot;
+    handler->shared = NULL;
+
+    unsigned long flags = spin_lock_irqsave(&plugbox_lock);
+    interrupt_handler **link = &chains[slot];
+    unsigned int n = 0;
+    for(; *link; link = &(*link)->shared)
+        n++;
+    assert(n < PLUGBOX_SHARED, "Too many handlers on one vector");
+    __atomic_store_n(link, handler, __ATOMIC_RELEASE);
+    publish_fast(slot);
+    spin_unlock_irqrestore(&plugbox_lock, flags);
 }
 
 interrupt_handler *plugbox_report(unsigned int slot)
 {
-    return &table[slot];
+    return __atomic_load_n(&chains[slot], __ATOMIC_ACQUIRE);
 }
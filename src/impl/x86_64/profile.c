@@ -0,0 +1,216 @@
+#include "profile.h"
+#include "machine/percpu.h"
+#include "machine/spinlock.h"
+#include "boot/page_table.h"
+#include "memory/frame.h"
+#include "stdlib/algorithm.h"
+#include "device/timer.h"
+#include "device/serial.h"
+#include "machine/smp.h"
+#include "plugbox.h"
+#include "thread/coroutine.h"
+#include "thread/stack.h"
+#include "stdlib/stdio.h"
+#include "klog.h"
+#include <stddef.h>
+
+extern char _kernel_start[];
+extern char _kernel_end[];
+
+// ---------------- QUEUE START ----------------
+typedef struct
+{
+    uint64_t head; // next position, only written by the owning CPU
+    ProfileSample samples[PROFILE_SAMPLES];
+} __attribute__((aligned(64))) SampleRing;
+
+// Written in interrupts of the owning CPU only. Readers compare a slot's
+// sequence before and after copying, like a seqlock.
+static ProfileSample *ring_begin(SampleRing *r)
+{
+    ProfileSample *slot = &r->samples[r->head % PROFILE_SAMPLES];
+    __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return slot;
+}
+
+static void ring_commit(SampleRing *r, ProfileSample *slot)
+{
+    uint64_t pos = r->head;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, pos + 1, __ATOMIC_RELEASE);
+}
+
+static bool ring_read(SampleRing *r, uint64_t pos, ProfileSample *out)
+{
+    ProfileSample *slot = &r->samples[pos % PROFILE_SAMPLES];
+    if(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1)
+        return false;
+    *out = *slot;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == pos + 1;
+}
+// ----------------- QUEUE END -----------------
+
+// From frames once profiling is first asked for, too big for the image.
+// CPUs coming online later get theirs the next time, until then they
+// take no samples.
+static SampleRing *rings[MAX_CPUS];
+static ProfileSample *export_samples; // a ring's worth
+static Spinlock buffers_lock = SPINLOCK_INIT;
+profile_source profiling = profile_off;
+static Timer sample_timer;
+static uint64_t period = 0;
+
+// Stack frames the walk may read: those of the interrupted coroutine's pooled
+// stack, or just the page its RSP is on, the pool has guard pages in between.
+static void stack_bounds(uintptr_t rsp, uintptr_t *low, uintptr_t *high)
+{
+    Coroutine *c = cpu_this()->active;
+    *low = rsp;
+    if(c && c->stack && rsp >= (uintptr_t)c->stack - STACK_SIZE && rsp < (uintptr_t)c->stack)
+        *high = (uintptr_t)c->stack;
+    else
+        *high = (rsp | (PAGE_SIZE - 1)) + 1;
+}
+
+void profile_sample(const uint64_t *frame)
+{
+    // [-1] rbp, [0] error code, [1] rip, [2] cs, [3] rflags, [4] rsp
+    SampleRing *r = rings[cpu_id()];
+    if(!r)
+        return;
+    ProfileSample *s = ring_begin(r);
+    s->rip = frame[1];
+    s->user = frame[2] & 3;
+    s->depth = 0;
+
+    if(!s->user)
+    {
+        uintptr_t low, high;
+        stack_bounds(frame[4], &low, &high);
+        // every frame is {previous rbp, return address} and lies above the last one
+        uintptr_t fp = frame[-1];
+        while(s->depth < PROFILE_DEPTH && fp >= low && fp + 16 <= high && !(fp & 7))
+        {
+            const uint64_t *f = (const uint64_t *)fp;
+            s->stack[s->depth++] = f[1];
+            low = fp + 16;
+            fp = f[0];
+        }
+    }
+    ring_commit(r, s);
+}
+
+// The PIT interrupts one CPU, guardian() samples it there. The others are
+// sampled on the IPI sent from here.
+static void profile_tick(Timer *timer)
+{
+    if(__atomic_load_n(&profiling, __ATOMIC_RELAXED) != profile_timer)
+        return;
+    smp_broadcast(int_sample, 0);
+    timer_arm(timer, timer->deadline + period);
+}
+
+static bool sample_prologue()
+{
+    return false;
+}
+
+// never relayed, it only keeps the vector off the fast path that bypasses guardian()
+static void sample_epilogue(unsigned int count)
+{
+    (void)count;
+}
+
+static void *alloc_zeroed(size_t size)
+{
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uintptr_t frames = frame_alloc_contiguous(pages);
+    if(!frames)
+        return NULL;
+    memset(phys_to_virt(frames), 0, pages * PAGE_SIZE);
+    return phys_to_virt(frames);
+}
+
+bool profile_buffers()
+{
+    unsigned long flags = spin_lock_irqsave(&buffers_lock);
+    if(!export_samples)
+        export_samples = alloc_zeroed(PROFILE_SAMPLES * sizeof(ProfileSample));
+    bool ok = export_samples != NULL;
+    for(unsigned int i = 0; i < MAX_CPUS; i++)
+        if(!rings[i] && __atomic_load_n(&percpu[i].online, __ATOMIC_ACQUIRE))
+        {
+            // published whole, the owner samples into it right away
+            SampleRing *r = alloc_zeroed(sizeof(SampleRing));
+            __atomic_store_n(&rings[i], r, __ATOMIC_RELEASE);
+            ok = ok && r;
+        }
+    spin_unlock_irqrestore(&buffers_lock, flags);
+    return ok;
+}
+
+void profile_start(uint64_t period_us)
+{
+    if(!profile_buffers())
+    {
+        klog_at(KLOG_WARNING, "profile: out of memory for the sample rings\n");
+        return;
+    }
+    static interrupt_handler sample_handler = INTERRUPT_HANDLER(sample_prologue, sample_epilogue);
+    if(!plugbox_report(int_sample))
+        plugbox_assign(int_sample, &sample_handler);
+    period = period_us ? period_us : 1;
+    sample_timer = new_timer(profile_tick);
+    __atomic_store_n(&profiling, profile_timer, __ATOMIC_RELEASE);
+    timer_arm(&sample_timer, timer_now() + period);
+}
+
+void profile_stop()
+{
+    __atomic_store_n(&profiling, profile_off, __ATOMIC_RELEASE);
+    timer_cancel(&sample_timer);
+}
+
+unsigned int profile_read(unsigned int cpu, ProfileSample *out, unsigned int max)
+{
+    SampleRing *r = cpu < MAX_CPUS ? __atomic_load_n(&rings[cpu], __ATOMIC_ACQUIRE) : NULL;
+    if(!r)
+        return 0;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t pos = head > PROFILE_SAMPLES ? head - PROFILE_SAMPLES : 0;
+    unsigned int n = 0;
+    for(; pos < head && n < max; pos++)
+        if(ring_read(r, pos, &out[n]))
+            n++;
+    return n;
+}
+
+void profile_export()
+{
+    // too big for the stack, the lock keeps CPUs from sharing it
+    static Spinlock export_lock = SPINLOCK_INIT;
+    ProfileSample *samples = __atomic_load_n(&export_samples, __ATOMIC_ACQUIRE);
+    char line[32 + 17 * (PROFILE_DEPTH + 1)];
+    spin_lock(&export_lock);
+    int n = snprintf(line, sizeof(line), "K %lx %lx\n",
+            (unsigned long)phys_to_kernel(_kernel_start), (unsigned long)phys_to_kernel(_kernel_end));
+    serial_write_all(line, n);
+    for(unsigned int cpu = 0; samples && cpu < MAX_CPUS; cpu++)
+    {
+        unsigned int count = profile_read(cpu, samples, PROFILE_SAMPLES);
+        for(unsigned int i = 0; i < count; i++)
+        {
+            ProfileSample *s = &samples[i];
+            n = snprintf(line, sizeof(line), "P %x %x %lx", cpu, s->user, s->rip);
+            for(unsigned int d = 0; d < s->depth; d++)
+                n += snprintf(line + n, sizeof(line) - n, " %lx", s->stack[d]);
+            line[n++] = '\n';
+            serial_write_all(line, n);
+        }
+    }
+    n = snprintf(line, sizeof(line), "D %x\n", serial_dropped());
+    serial_write_all(line, n);
+    spin_unlock(&export_lock);
+}
@@ -1,5 +1,23 @@
 #include "stdlib/algorithm.h"
+#include "machine/cpuid.h"
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Below this the setup of the word loops and rep strings doesn't pay off
+#define SMALL_COPY 16
+
+// x86 allows unaligned word accesses, these tell the compiler about it
+typedef uint64_t __attribute__((may_alias, aligned(1))) word;
+
+// "enhanced rep movsb/stosb", microcode then moves whole cache lines
+static bool erms = false;
+
+__attribute__((constructor)) void algorithm_init()
+{
+    if(cpuid(0, 0).eax >= 7)
+        erms = cpuid(7, 0).ebx & (1 << 9);
+}
 
 void swap(void *a, void *b, size_t len)
 {
@@ -14,30 +32,81 @@ void swap(void *a, void *b, size_t len)
 
 void *memset(void *s, int c, size_t n)
 {
-    unsigned char* p = s;
+    unsigned char *p = s;
+    if(n >= SMALL_COPY)
+    {
+        if(erms)
+        {
+            asm volatile("rep stosb" : "+D"(p), "+c"(n) : "a"(c) : "memory");
+            return s;
+        }
+
+        uint64_t pattern = (unsigned char)c * 0x0101010101010101ULL;
+        // one unaligned word covers the head, then continue aligned
+        *(word *)p = pattern;
+        size_t head = 8 - ((uintptr_t)p & 7);
+        p += head;
+        n -= head;
+        for(; n >= 8; p += 8, n -= 8)
+            *(uint64_t *)p = pattern;
+    }
     while(n--)
         *p++ = (unsigned char)c;
     return s;
 }
 
-void *memcpy(void *dest, const void *src, size_t n)
+// word-wise forward copy, also right for overlapping areas with dest < src
+static void copy_forward(unsigned char *dp, const unsigned char *sp, size_t n)
 {
-    char *dp = dest;
-    const char *sp = src;
-    while (n--)
+    if(n >= SMALL_COPY)
+    {
+        size_t head = -(uintptr_t)dp & 7;
+        for(; head; head--, n--)
+            *dp++ = *sp++;
+        for(; n >= 8; dp += 8, sp += 8, n -= 8)
+            *(uint64_t *)dp = *(const word *)sp;
+    }
+    while(n--)
         *dp++ = *sp++;
+}
+
+static void copy_backward(unsigned char *dp, const unsigned char *sp, size_t n)
+{
+    dp += n;
+    sp += n;
+    if(n >= SMALL_COPY)
+    {
+        size_t tail = (uintptr_t)dp & 7;
+        for(; tail; tail--, n--)
+            *--dp = *--sp;
+        for(; n >= 8; n -= 8)
+        {
+            dp -= 8;
+            sp -= 8;
+            *(uint64_t *)dp = *(const word *)sp;
+        }
+    }
+    while(n--)
+        *--dp = *--sp;
+}
+
+void *memcpy(void *dest, const void *src, size_t n)
+{
+    if(erms && n >= SMALL_COPY)
+    {
+        void *d = dest;
+        asm volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
+        return dest;
+    }
+    copy_forward(dest, src, n);
     return dest;
 }
 
 void *memmove(void *dest, const void *src, size_t n)
 {
-    unsigned char *pd = dest;
-    const unsigned char *ps = src;
-    if (ps < pd)
-        for (pd += n, ps += n; n--;)
-            *--pd = *--ps;
-    else
-        while(n--)
-            *pd++ = *ps++;
+    // a forward copy only goes wrong if dest starts inside the source
+    if((uintptr_t)dest - (uintptr_t)src >= n)
+        return memcpy(dest, src, n);
+    copy_backward(dest, src, n);
     return dest;
 }
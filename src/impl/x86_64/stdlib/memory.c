@@ -0,0 +1,50 @@
+#include "stdlib/memory.h"
+#include "memory/slab.h"
+#include "memory/frame.h"
+
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 10
+
+static SlabCache kmalloc_caches[] = {
+    SLAB_CACHE("kmalloc-16", 16),
+    SLAB_CACHE("kmalloc-32", 32),
+    SLAB_CACHE("kmalloc-64", 64),
+    SLAB_CACHE("kmalloc-128", 128),
+    SLAB_CACHE("kmalloc-256", 256),
+    SLAB_CACHE("kmalloc-512", 512),
+    SLAB_CACHE("kmalloc-1024", 1024),
+};
+
+void *kmalloc(size_t size)
+{
+    if(size <= (1 << KMALLOC_MAX_SHIFT))
+    {
+        unsigned int class = size <= (1 << KMALLOC_MIN_SHIFT) ? 0
+            : 64 - __builtin_clzll(size - 1) - KMALLOC_MIN_SHIFT;
+        return slab_alloc(&kmalloc_caches[class]);
+    }
+
+    size_t pages = (size + SLAB_HEADER + FRAME_SIZE - 1) / FRAME_SIZE;
+    uintptr_t base = pages == 1 ? frame_alloc() : frame_alloc_contiguous(pages);
+    if(!base)
+        return NULL;
+
+    Slab *block = phys_to_virt(base);
+    block->cache = NULL;
+    block->pages = pages;
+    return (char *)block + SLAB_HEADER;
+}
+
+void kfree(void *ptr)
+{
+    if(!ptr)
+        return;
+
+    Slab *slab = slab_of(ptr);
+    if(slab->cache)
+        slab_free(slab->cache, ptr);
+    else if(slab->pages == 1)
+        frame_free(virt_to_phys(slab));
+    else
+        frame_free_contiguous(virt_to_phys(slab), slab->pages);
+}
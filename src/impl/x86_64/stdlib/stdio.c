@@ -4,6 +4,11 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include "cgascr.h"
+#include "device/serial.h"
+#include "boot/cmdline.h"
+#include <stdbool.h>
+
+#define PRINTF_BUFFER 128 // printf hands its output to the sinks in chunks of this size
 
 enum Printf_State
 {
@@ -23,149 +28,66 @@ enum Printf_Length
     PRINTF_LENGTH_LONG_LONG = 4,
 };
 
-SYSV int printf(const char *fmt, ...)
+// Where the formatter puts its output. A full buffer is passed to `flush`
+// if there is one, without the rest is only counted.
+typedef struct
 {
-    va_list args;
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
+    char *buffer;
+    size_t size;
+    size_t used;
+    size_t total; // characters produced, including those cut off
+    void (*flush)(const char *s, size_t n);
+} Writer;
+
+static void emit(Writer *w, char c)
+{
+    w->total++;
+    if(w->used == w->size)
+    {
+        if(!w->flush)
+            return;
+        w->flush(w->buffer, w->used);
+        w->used = 0;
+    }
+    w->buffer[w->used++] = c;
 }
 
-SYSV int vprintf(const char *fmt, va_list args)
+static void emit_string(Writer *w, const char *s)
 {
-    enum Printf_State state = PRINTF_STATE_NORMAL;
-    enum Printf_Length length = PRINTF_LENGTH_DEFAULT;
+    while(*s)
+        emit(w, *s++);
+}
 
-    while(*fmt)
+static int64_t signed_arg(va_list *args, enum Printf_Length length)
+{
+    switch(length)
     {
-        switch(state)
-        {
-            case PRINTF_STATE_NORMAL:
-                switch(*fmt)
-                {
-                    case '%':
-                        state = PRINTF_STATE_LENGTH;
-                        break;
-                    default:
-                        CGA_putchar(*fmt);
-                        break;  
-                }
-                break;
-            
-            case PRINTF_STATE_LENGTH:
-                switch(*fmt)
-                {
-                    case 'h':
-                        length = PRINTF_LENGTH_SHORT;
-                        state = PRINTF_STATE_LENGTH_SHORT;
-                        break;
-                    case 'l':
-                        length = PRINTF_LENGTH_LONG;
-                        state = PRINTF_STATE_LENGTH_LONG;
-                        break;
-                    default:
-                        goto PRINTF_STATE_SPEC_;
-                }
-                break;
-            
-            case PRINTF_STATE_LENGTH_SHORT:
-                if(*fmt == 'h')
-                {
-                    length = PRINTF_LENGTH_SHORT_SHORT;
-                    state = PRINTF_STATE_SPEC;
-                }
-                else goto PRINTF_STATE_SPEC_;
-                break;
-            
-            case PRINTF_STATE_LENGTH_LONG:
-                if(*fmt == 'l')
-                {
-                    length = PRINTF_LENGTH_LONG_LONG;
-                    state = PRINTF_STATE_SPEC;
-                }
-                else goto PRINTF_STATE_SPEC_;
-                break;
-            
-            case PRINTF_STATE_SPEC:
-            PRINTF_STATE_SPEC_:
-                switch(*fmt)
-                {
-                    char buf[23];
-                    case 'c':
-                        CGA_putchar((char) va_arg(args, int));
-                        break;
-                    case 's':
-                        CGA_puts(va_arg(args, const char*));
-                        break;
-                    case '%':
-                        CGA_putchar('%');
-                        break;
-                    case 'd':
-                    case 'i':
-                        CGA_puts(itoa(va_arg(args, int64_t), buf, 10));
-                        break;
-                    case 'u':
-                        CGA_puts(uitoa(va_arg(args, uint64_t), buf, 10));
-                        break;
-                    case 'p':
-                        CGA_puts("0x");
-                    case 'X':
-                        // TODO: uppercase hex
-                    case 'x':
-                        CGA_puts(itoa(va_arg(args, int64_t), buf, 16));
-                        break;
-                    case 'o':
-                        CGA_puts(itoa(va_arg(args, int64_t), buf, 8));
-                        break;
-                    case 'f':
-                    case 'F':
-                        // TODO:
-                        break;
-                    case 'e':
-                    case 'E':
-                        // TODO:
-                        break;
-                    case 'a':
-                    case 'A':
-                        // TODO:
-                        break;
-                    case 'g':
-                    case 'G':
-                        // TODO:
-                        break;
-                    case 'n':
-                        // TODO: keep track of length
-                        //*argp++ = ;
-                        break;
-                    default:
-                        break;
-                }
-
-                state = PRINTF_STATE_NORMAL;
-                length = PRINTF_LENGTH_DEFAULT;
-                break;
-        }
-        fmt++;
+        case PRINTF_LENGTH_SHORT_SHORT: return (signed char) va_arg(*args, int);
+        case PRINTF_LENGTH_SHORT: return (short) va_arg(*args, int);
+        case PRINTF_LENGTH_LONG: return va_arg(*args, long);
+        case PRINTF_LENGTH_LONG_LONG: return va_arg(*args, long long);
+        default: return va_arg(*args, int);
     }
-
-    // TODO: keep track of length
-    return 0;
 }
-/*
-SYSV int sprintf(char *buffer, const char *fmt, ...)
+
+static uint64_t unsigned_arg(va_list *args, enum Printf_Length length)
 {
-    va_list args;
-    va_start(args, fmt);
-    vsprintf(buffer, fmt, args);
-    va_end(args);
+    switch(length)
+    {
+        case PRINTF_LENGTH_SHORT_SHORT: return (unsigned char) va_arg(*args, unsigned int);
+        case PRINTF_LENGTH_SHORT: return (unsigned short) va_arg(*args, unsigned int);
+        case PRINTF_LENGTH_LONG: return va_arg(*args, unsigned long);
+        case PRINTF_LENGTH_LONG_LONG: return va_arg(*args, unsigned long long);
+        default: return va_arg(*args, unsigned int);
+    }
 }
 
-SYSV int vsprintf(char *buffer, const char *fmt, va_list args)
+static void format(Writer *w, const char *fmt, va_list list)
 {
-    char *start = buffer;
-    
     enum Printf_State state = PRINTF_STATE_NORMAL;
     enum Printf_Length length = PRINTF_LENGTH_DEFAULT;
+    va_list args;
+    va_copy(args, list);
 
     while(*fmt)
     {
@@ -178,11 +100,11 @@ SYSV int vsprintf(char *buffer, const char *fmt, va_list args)
                         state = PRINTF_STATE_LENGTH;
                         break;
                     default:
-                        *buffer++ = *fmt;
-                        break;  
+                        emit(w, *fmt);
+                        break;
                 }
                 break;
-            
+
             case PRINTF_STATE_LENGTH:
                 switch(*fmt)
                 {
@@ -198,7 +120,7 @@ SYSV int vsprintf(char *buffer, const char *fmt, va_list args)
                         goto PRINTF_STATE_SPEC_;
                 }
                 break;
-            
+
             case PRINTF_STATE_LENGTH_SHORT:
                 if(*fmt == 'h')
                 {
@@ -207,7 +129,7 @@ SYSV int vsprintf(char *buffer, const char *fmt, va_list args)
                 }
                 else goto PRINTF_STATE_SPEC_;
                 break;
-            
+
             case PRINTF_STATE_LENGTH_LONG:
                 if(*fmt == 'l')
                 {
@@ -216,47 +138,42 @@ SYSV int vsprintf(char *buffer, const char *fmt, va_list args)
                 }
                 else goto PRINTF_STATE_SPEC_;
                 break;
-            
+
             case PRINTF_STATE_SPEC:
             PRINTF_STATE_SPEC_:
                 switch(*fmt)
                 {
+                    char buf[23]; // 22 octal digits of a 64-bit value
+                    const char *s;
                     case 'c':
-                        *buffer++ = (char) va_arg(args, int);
+                        emit(w, (char) va_arg(args, int));
                         break;
                     case 's':
-                        *buffer = '\0';
-                        strcat(buffer, va_arg(args, const char*));
-                        buffer += strlen(buffer);
+                        s = va_arg(args, const char*);
+                        emit_string(w, s ? s : "(null)");
                         break;
                     case '%':
-                        *buffer++ = '%';
+                        emit(w, '%');
                         break;
                     case 'd':
                     case 'i':
-                        itoa(va_arg(args, int64_t), buffer, 10);
-                        buffer += n_digits(*argp, 10) + (*argp < 0 ? 1 : 0);
-                        argp++;
+                        emit_string(w, itoa(signed_arg(&args, length), buf, 10));
                         break;
                     case 'u':
-                        uitoa(*(uint64_t *)argp, buffer, 10);
-                        buffer += n_digits(*argp, 10);
-                        argp++;
+                        emit_string(w, uitoa(unsigned_arg(&args, length), buf, 10));
                         break;
                     case 'p':
-                        *buffer++ = '0';
-                        *buffer++ = 'x';
+                        emit_string(w, "0x");
+                        emit_string(w, uitoa((uintptr_t) va_arg(args, void*), buf, 16));
+                        break;
                     case 'X':
-                        // TODO: uppercase hex
+                        emit_string(w, uitoa_upper(unsigned_arg(&args, length), buf, 16));
+                        break;
                     case 'x':
-                        itoa(*argp, buffer, 16);
-                        buffer += n_digits(*argp, 16);
-                        argp++;
+                        emit_string(w, uitoa(unsigned_arg(&args, length), buf, 16));
                         break;
                     case 'o':
-                        itoa(*argp, buffer, 8);
-                        buffer += n_digits(*argp, 8);
-                        argp++;
+                        emit_string(w, uitoa(unsigned_arg(&args, length), buf, 8));
                         break;
                     case 'f':
                     case 'F':
@@ -275,8 +192,7 @@ SYSV int vsprintf(char *buffer, const char *fmt, va_list args)
                         // TODO:
                         break;
                     case 'n':
-                        // TODO: keep track of length
-                        *argp++ = buffer - start;
+                        *va_arg(args, int*) = w->total;
                         break;
                     default:
                         break;
@@ -288,205 +204,76 @@ SYSV int vsprintf(char *buffer, const char *fmt, va_list args)
         }
         fmt++;
     }
+    va_end(args);
+}
+
+static bool to_cga = true;
+static bool to_serial = true;
 
-    *buffer = '\0';
-    return buffer - start;
+void stdio_init()
+{
+    if(!cmdline_find("console", NULL, NULL))
+        return;
+    to_cga = cmdline_has("console", "cga");
+    to_serial = cmdline_has("console", "serial");
 }
 
-SYSV int snprintf(char *buffer, size_t bufsz, const char *fmt, ...)
+// every enabled sink gets the same output
+void stdio_write(const char *s, size_t n)
+{
+    if(to_cga)
+    {
+        CGA_write(s, n);
+        CGA_flush();
+    }
+    if(to_serial)
+        serial_write(s, n);
+}
+
+SYSV int printf(const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    vsnprintf(buffer, bufsz, fmt, args);
+    int n = vprintf(fmt, args);
     va_end(args);
+    return n;
 }
 
-SYSV int vsnprintf(char *buffer, size_t bufsz, const char *fmt, va_list args)
+SYSV int vprintf(const char *fmt, va_list args)
 {
-    char *start = buffer;
-    
-    enum Printf_State state = PRINTF_STATE_NORMAL;
-    enum Printf_Length length = PRINTF_LENGTH_DEFAULT;
-
-    int64_t args[3];
-    asm volatile("mov %%rcx, %0" : "=m" (args[0]));
-    asm volatile("mov %%r8, %0" : "=m" (args[1]));
-    asm volatile("mov %%r9, %0" : "=m" (args[2]));
-    int64_t *argp = args;
-    int on_stack = 0;
+    char buffer[PRINTF_BUFFER];
+    Writer w = {buffer, sizeof(buffer), 0, 0, stdio_write};
+    format(&w, fmt, args);
+    if(w.used)
+        stdio_write(buffer, w.used);
+    return w.total;
+}
 
-    while(*fmt)
-    {
-        if(buffer - start == bufsz)
-        {
-            *buffer = '\0';
-            return bufsz;
-        }
-        if(argp - args == 3 && !on_stack)
-        {
-            asm("mov %%rbp, %0" : "=r" (argp));
-            argp += 2;
-            on_stack = 1;
-        }
-        switch(state)
-        {
-            case PRINTF_STATE_NORMAL:
-                switch(*fmt)
-                {
-                    case '%':
-                        state = PRINTF_STATE_LENGTH;
-                        break;
-                    default:
-                        *buffer++ = *fmt;
-                        break;  
-                }
-                break;
-            
-            case PRINTF_STATE_LENGTH:
-                switch(*fmt)
-                {
-                    case 'h':
-                        length = PRINTF_LENGTH_SHORT;
-                        state = PRINTF_STATE_LENGTH_SHORT;
-                        break;
-                    case 'l':
-                        length = PRINTF_LENGTH_LONG;
-                        state = PRINTF_STATE_LENGTH_LONG;
-                        break;
-                    default:
-                        goto PRINTF_STATE_SPEC_;
-                }
-                break;
-            
-            case PRINTF_STATE_LENGTH_SHORT:
-                if(*fmt == 'h')
-                {
-                    length = PRINTF_LENGTH_SHORT_SHORT;
-                    state = PRINTF_STATE_SPEC;
-                }
-                else goto PRINTF_STATE_SPEC_;
-                break;
-            
-            case PRINTF_STATE_LENGTH_LONG:
-                if(*fmt == 'l')
-                {
-                    length = PRINTF_LENGTH_LONG_LONG;
-                    state = PRINTF_STATE_SPEC;
-                }
-                else goto PRINTF_STATE_SPEC_;
-                break;
-            
-            case PRINTF_STATE_SPEC:
-            PRINTF_STATE_SPEC_:
-                switch(*fmt)
-                {
-                    char buf[23];
-                    size_t len;
-                    size_t space_left;
-                    char *s;
-                    case 'c':
-                        *buffer++ = *(char *)argp;
-                        argp++;
-                        break;
-                    case 's':
-                        s = *(char **)argp;
-                        len = strlen(s);
-                        space_left = bufsz - (buffer - start);
-                        if(len >= space_left)
-                            len = space_left - 1;
-                        memmove(buffer, s, len);
-                        buffer += len;
-                        argp++;
-                        break;
-                    case '%':
-                        *buffer++ = '%';
-                        break;
-                    case 'd':
-                    case 'i':
-                        itoa(*argp, buf, 10);
-                        len = strlen(buf);
-                        space_left = bufsz - (buffer - start);
-                        if(len >= space_left)
-                            len = space_left - 1;
-                        memmove(buffer, buf, len);
-                        buffer += len;
-                        argp++;
-                        break;
-                    case 'u':
-                        uitoa(*(uint64_t *)argp, buf, 10);
-                        len = strlen(buf);
-                        space_left = bufsz - (buffer - start);
-                        if(len >= space_left)
-                            len = space_left - 1;
-                        memmove(buffer, buf, len);
-                        buffer += len;
-                        argp++;
-                    case 'p':
-                        *buffer++ = '0';
-                        if(buffer - start == bufsz)
-                        {
-                            *buffer = '\0';
-                            return bufsz;
-                        }
-                        *buffer++ = 'x';
-                        if(buffer - start == bufsz)
-                        {
-                            *buffer = '\0';
-                            return bufsz;
-                        }
-                    case 'X':
-                        // TODO: uppercase hex
-                    case 'x':
-                        itoa(*argp, buf, 16);
-                        len = strlen(buf);
-                        space_left = bufsz - (buffer - start);
-                        if(len >= space_left)
-                            len = space_left - 1;
-                        memmove(buffer, buf, len);
-                        buffer += len;
-                        argp++;
-                        break;
-                    case 'o':
-                        itoa(*argp, buf, 8);
-                        len = strlen(buf);
-                        space_left = bufsz - (buffer - start);
-                        if(len >= space_left)
-                            len = space_left - 1;
-                        memmove(buffer, buf, len);
-                        buffer += len;
-                        argp++;
-                        break;
-                    case 'f':
-                    case 'F':
-                        // TODO:
-                        break;
-                    case 'e':
-                    case 'E':
-                        // TODO:
-                        break;
-                    case 'a':
-                    case 'A':
-                        // TODO:
-                        break;
-                    case 'g':
-                    case 'G':
-                        // TODO:
-                        break;
-                    case 'n':
-                        *argp++ = buffer - start;
-                        break;
-                    default:
-                        break;
-                }
+SYSV int sprintf(char *buffer, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buffer, SIZE_MAX, fmt, args);
+    va_end(args);
+    return n;
+}
 
-                state = PRINTF_STATE_NORMAL;
-                length = PRINTF_LENGTH_DEFAULT;
-                break;
-        }
-        fmt++;
-    }
+SYSV int snprintf(char *buffer, size_t bufsz, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buffer, bufsz, fmt, args);
+    va_end(args);
+    return n;
+}
 
-    *buffer = '\0';
-    return buffer - start;
+// Returns the length the whole output would have, at most bufsz - 1
+// characters and the terminating 0 are stored.
+SYSV int vsnprintf(char *buffer, size_t bufsz, const char *fmt, va_list args)
+{
+    Writer w = {buffer, bufsz ? bufsz - 1 : 0, 0, 0, NULL};
+    format(&w, fmt, args);
+    if(bufsz)
+        buffer[w.used] = '\0';
+    return w.total;
 }
-*/
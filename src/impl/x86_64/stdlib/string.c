@@ -4,99 +4,246 @@
 
 void reverse_str(char *str, int length)
 {
-    int start = 0;
-    int end = length-1;
-    while(start < end)
+    for(int start = 0, end = length - 1; start < end; start++, end--)
     {
-        swap(&str[start], &str[end], sizeof(char));
-        start++;
-        end--;
+        char c = str[start];
+        str[start] = str[end];
+        str[end] = c;
     }
 }
 
-int n_digits(int64_t n, int base)
+static const char lower_digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+static const char upper_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+// "00" to "99", two decimal digits per division by 100
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const uint64_t powers_of_10[20] =
+{
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+    1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+    1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+static inline int bit_length(uint64_t n)
 {
-    if(n == 0)
-        return 1;
-    int count = 0;
-    while (n != 0) {
-        count++;
-        n /= base;
+    return 64 - __builtin_clzll(n | 1);
+}
+
+static int digit_count(uint64_t n, int base)
+{
+    if(base == 10)
+    {
+        // bit length * log10(2) is the count or one short of it
+        int digits = (bit_length(n) * 1233) >> 12;
+        digits += n >= powers_of_10[digits];
+        return digits ? digits : 1;
     }
-    return count;
+    if(!(base & (base - 1)))
+    {
+        int shift = __builtin_ctz(base);
+        return (bit_length(n) + shift - 1) / shift;
+    }
+    int digits = 1;
+    for(uint64_t rest = n; rest >= (uint64_t)base; rest /= base)
+        digits++;
+    return digits;
 }
 
-char *itoa(int64_t n, char str[], int base)
+// The length is known up front, so digits are written from the right and
+// need no reversing. Bases 2, 4, 8, 16 and 32 take a shift and a mask.
+static char *convert(uint64_t n, char str[], int base, const char *digits)
 {
-    int i = 0;
-    int neg = 0;
+    char *p = str + digit_count(n, base);
+    *p = '\0';
 
-    if (n == 0)
+    if(base == 10)
     {
-        str[i++] = '0';
-        str[i] = '\0';
-        return str;
+        while(n >= 100)
+        {
+            unsigned int pair = (n % 100) * 2;
+            n /= 100;
+            *--p = digit_pairs[pair + 1];
+            *--p = digit_pairs[pair];
+        }
+        if(n >= 10)
+        {
+            *--p = digit_pairs[n * 2 + 1];
+            *--p = digit_pairs[n * 2];
+        }
+        else
+            *--p = '0' + n;
     }
-
-    if (n < 0 && base == 10)
+    else if(!(base & (base - 1)))
     {
-        neg = 1;
-        n = -n;
+        int shift = __builtin_ctz(base);
+        do
+        {
+            *--p = digits[n & (base - 1)];
+            n >>= shift;
+        }
+        while(n);
     }
-
-    while (n != 0)
+    else
     {
-        int rem = n % base;
-        str[i++] = (rem > 9) ? (rem-10) + 'a' : rem + '0';
-        n = n / base;
+        do
+        {
+            *--p = digits[n % base];
+            n /= base;
+        }
+        while(n);
     }
-
-    if (neg)
-        str[i++] = '-';
-
-    str[i] = '\0';
-
-    reverse_str(str, i);
     return str;
 }
 
-char *uitoa(uint64_t n, char str[], int base)
+int n_digits(int64_t n, int base)
 {
-    int i = 0;
+    return digit_count(n < 0 ? -(uint64_t)n : (uint64_t)n, base);
+}
 
-    if (n == 0)
+// Only base 10 gets a sign, other bases show the two's complement
+char *itoa(int64_t n, char str[], int base)
+{
+    if(n < 0 && base == 10)
     {
-        str[i++] = '0';
-        str[i] = '\0';
+        str[0] = '-';
+        convert(-(uint64_t)n, str + 1, 10, lower_digits);
         return str;
     }
+    return convert(n, str, base, lower_digits);
+}
 
-    while (n != 0)
-    {
-        int rem = n % base;
-        str[i++] = (rem > 9) ? (rem-10) + 'a' : rem + '0';
-        n = n / base;
-    }
+char *uitoa(uint64_t n, char str[], int base)
+{
+    return convert(n, str, base, lower_digits);
+}
+
+char *uitoa_upper(uint64_t n, char str[], int base)
+{
+    return convert(n, str, base, upper_digits);
+}
 
-    str[i] = '\0';
+// Word-at-a-time scanning. Loads that may run past the end of a string are
+// aligned, so they never touch a page the string doesn't reach into.
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
 
-    reverse_str(str, i);
-    return str;
+typedef uint64_t __attribute__((may_alias)) word;
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_word;
+
+// high bit set in every byte of `v` that is zero, exact up to the first one
+static inline uint64_t zero_bytes(uint64_t v)
+{
+    return (v - ONES) & ~v & HIGHS;
+}
+
+// index of the byte marked first in memory order
+static inline size_t first_byte(uint64_t mask)
+{
+    return __builtin_ctzll(mask) / 8;
+}
+
+size_t strlen(const char *s)
+{
+    uintptr_t offset = (uintptr_t)s & 7;
+    const word *w = (const word *)(s - offset);
+    // bytes before `s` count as non-zero
+    uint64_t z = zero_bytes(*w | ((1ULL << (offset * 8)) - 1));
+    while(!z)
+        z = zero_bytes(*++w);
+    return (const char *)w + first_byte(z) - s;
 }
 
 char *strcat(char *dest, const char *src)
 {
-    char *ret = dest;
-    while (*dest)
-        dest++;
-    while (*dest++ = *src++)
+    memcpy(dest + strlen(dest), src, strlen(src) + 1);
+    return dest;
+}
+
+char *strncpy(char *dest, const char *src, size_t n)
+{
+    char *d = dest;
+    for(; n && ((uintptr_t)src & 7); n--)
+        if(!(*d++ = *src++))
+            goto pad;
+
+    // stop at the word holding the terminator, it is copied bytewise
+    for(; n >= 8 && !zero_bytes(*(const word *)src); n -= 8, d += 8, src += 8)
+        *(unaligned_word *)d = *(const word *)src;
+
+    for(; n; n--)
+        if(!(*d++ = *src++))
+            goto pad;
+    return dest;
+
+pad:
+    memset(d, 0, n - 1);
+    return dest;
+}
+
+int strcmp(const char *s1, const char *s2)
+{
+    // words only if both reach alignment together
+    if((((uintptr_t)s1 ^ (uintptr_t)s2) & 7) == 0)
+    {
+        for(; (uintptr_t)s1 & 7; s1++, s2++)
+            if(*s1 != *s2 || !*s1)
+                return (unsigned char)*s1 - (unsigned char)*s2;
+        for(; *(const word *)s1 == *(const word *)s2 && !zero_bytes(*(const word *)s1); s1 += 8, s2 += 8)
+            ;
+    }
+    for(; *s1 == *s2 && *s1; s1++, s2++)
         ;
-    return ret;
+    return (unsigned char)*s1 - (unsigned char)*s2;
 }
 
-size_t strlen(const char *s)
+void *memchr(const void *s, int c, size_t n)
+{
+    const unsigned char *p = s;
+    unsigned char ch = c;
+    for(; n && ((uintptr_t)p & 7); n--, p++)
+        if(*p == ch)
+            return (void *)p;
+
+    uint64_t pattern = ch * ONES;
+    for(; n >= 8; n -= 8, p += 8)
+    {
+        uint64_t z = zero_bytes(*(const word *)p ^ pattern);
+        if(z)
+            return (void *)(p + first_byte(z));
+    }
+
+    for(; n; n--, p++)
+        if(*p == ch)
+            return (void *)p;
+    return NULL;
+}
+
+int memcmp(const void *s1, const void *s2, size_t n)
 {
-    const char *p = s;
-    while (*s) ++s;
-    return s - p;
+    const unsigned char *p = s1, *q = s2;
+    // both areas are n bytes long, unaligned loads are fine here
+    for(; n >= 8; n -= 8, p += 8, q += 8)
+    {
+        uint64_t a = *(const unaligned_word *)p;
+        uint64_t b = *(const unaligned_word *)q;
+        if(a != b)
+        {
+            // big endian order compares like the bytes in memory
+            a = __builtin_bswap64(a);
+            b = __builtin_bswap64(b);
+            return a < b ? -1 : 1;
+        }
+    }
+    for(; n; n--, p++, q++)
+        if(*p != *q)
+            return *p - *q;
+    return 0;
 }
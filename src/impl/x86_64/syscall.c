@@ -0,0 +1,141 @@
+#include "syscall.h"
+#include "machine/msr.h"
+#include "cgascr.h"
+#include "panic.h"
+#include "guard.h"
+#include "cpu.h"
+#include "thread/channel.h"
+#include "machine/percpu.h"
+#include <stddef.h>
+
+// boot/syscall.asm
+extern void syscall_entry();
+
+// GDT selectors, see boot/gdt64.asm
+#define GDT_KERNEL_CODE 0x08
+#define GDT_SYSRET_BASE 0x10 // sysret loads SS = base + 8, CS = base + 16
+
+enum
+{
+    efer_sce = 1 << 0,
+    rflags_tf = 1 << 8,
+    rflags_if = 1 << 9,
+    rflags_df = 1 << 10,
+    rflags_ac = 1 << 18,
+};
+
+syscall_handler syscall_table[SYSCALL_COUNT];
+
+int64_t syscall_invalid()
+{
+    return -1;
+}
+
+int64_t syscall_null()
+{
+    return 0;
+}
+
+int64_t syscall_show(uint64_t x, uint64_t y, uint64_t c)
+{
+    if(x >= CGA_COLUMNS || y >= CGA_ROWS)
+        return -1;
+    CGA_show(x, y, c);
+    CGA_flush();
+    return 0;
+}
+
+// Blocks at guard level like any coroutine. Only a process has a kernel
+// stack of its own to sleep on, the shared RSP0 stack must not be left.
+int64_t syscall_channel_wait(uint64_t id, uint64_t end, uint64_t seen)
+{
+    if(end > channel_writer || !cpu_this()->active || !cpu_this()->active->space)
+        return -1;
+    // held while asleep, sleeping is a quiescent point
+    Channel *channel = channel_acquire(id);
+    if(!channel)
+        return -1;
+    guard_enter();
+    int_enable();
+    channel_wait(channel, end, seen);
+    channel_put(channel);
+    guard_leave();
+    // sysret must not be interrupted once the user GS base is back
+    int_disable();
+    return 0;
+}
+
+int64_t syscall_channel_wake(uint64_t id, uint64_t end)
+{
+    // no reference needed, nothing passes a quiescent point before guard_leave
+    Channel *channel = channel_get(id);
+    if(!channel || end > channel_writer)
+        return -1;
+    guard_enter();
+    channel_wake(channel, end);
+    guard_leave();
+    int_disable();
+    return 0;
+}
+
+// Creates a channel and maps its ring into the caller at `addr`. Forks keep
+// it, other processes map it by the id returned. It lives as long as some
+// process maps it.
+int64_t syscall_channel_create(uint64_t size, uint64_t addr)
+{
+    Coroutine *active = cpu_this()->active;
+    if(!active || !active->space || size > CHANNEL_USER_MAX)
+        return -1;
+    Channel *channel = channel_create(size);
+    if(!channel)
+        return -1;
+    bool ok = channel_map(channel, active->space, addr);
+    int64_t id = channel->id;
+    // left to the mapping, or gone at once
+    channel_destroy(channel);
+    return ok ? id : -1;
+}
+
+// Maps a channel another process created, returns the size of its records
+int64_t syscall_channel_map(uint64_t id, uint64_t addr)
+{
+    Coroutine *active = cpu_this()->active;
+    if(!active || !active->space)
+        return -1;
+    Channel *channel = channel_acquire(id);
+    if(!channel)
+        return -1;
+    bool ok = channel_map(channel, active->space, addr);
+    int64_t size = channel->size;
+    channel_put(channel);
+    return ok ? size : -1;
+}
+
+__attribute__((constructor)) void syscall_table_init()
+{
+    for(unsigned int i = 0; i < SYSCALL_COUNT; i++)
+        syscall_table[i] = syscall_invalid;
+    syscall_register(sys_null, syscall_null);
+    syscall_register(sys_show, syscall_show);
+    syscall_register(sys_channel_wait, syscall_channel_wait);
+    syscall_register(sys_channel_wake, syscall_channel_wake);
+    syscall_register(sys_channel_create, syscall_channel_create);
+    syscall_register(sys_channel_map, syscall_channel_map);
+}
+
+void syscall_register(syscall_number nr, syscall_handler handler)
+{
+    if(nr >= SYSCALL_COUNT)
+        panic("syscall_register: number out of range");
+    syscall_table[nr] = handler;
+}
+
+// called on every CPU
+void syscall_init()
+{
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | efer_sce);
+    wrmsr(MSR_STAR, ((uint64_t)GDT_SYSRET_BASE << 48) | ((uint64_t)GDT_KERNEL_CODE << 32));
+    wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
+    // handlers start with interrupts off on RSP0, a process's own kernel stack
+    wrmsr(MSR_FMASK, rflags_tf | rflags_if | rflags_df | rflags_ac);
+}
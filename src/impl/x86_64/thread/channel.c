@@ -0,0 +1,197 @@
+#include "thread/channel.h"
+#include "memory/frame.h"
+#include "memory/paging.h"
+#include "machine/spinlock.h"
+#include "stdlib/algorithm.h"
+#include "stdlib/memory.h"
+#include "panic.h"
+#include "klog.h"
+
+static Channel *table[CHANNEL_MAX];
+static Spinlock table_lock = SPINLOCK_INIT;
+
+Channel *channel_create(size_t size)
+{
+    if(size < PAGE_SIZE || (size & (size - 1)) || size > (1UL << 30))
+        return NULL;
+    Channel *channel = kmalloc(sizeof(Channel));
+    if(!channel)
+        return NULL;
+
+    size_t pages = 1 + size / PAGE_SIZE;
+    uintptr_t frames = frame_alloc_contiguous(pages);
+    if(!frames)
+    {
+        kfree(channel);
+        return NULL;
+    }
+    ChannelRing *ring = phys_to_virt(frames);
+    memset(ring, 0, PAGE_SIZE);
+    *channel = (Channel){{NULL, NULL}, ring, frames, pages, size, CHANNEL_MAX, 0, false, {WAITQUEUE_INIT, WAITQUEUE_INIT}};
+
+    unsigned long flags = spin_lock_irqsave(&table_lock);
+    for(unsigned int i = 0; i < CHANNEL_MAX && channel->id == CHANNEL_MAX; i++)
+        if(!table[i])
+        {
+            table[i] = channel;
+            channel->id = i;
+        }
+    spin_unlock_irqrestore(&table_lock, flags);
+
+    if(channel->id == CHANNEL_MAX)
+    {
+        frame_free_contiguous(frames, pages);
+        kfree(channel);
+        return NULL;
+    }
+    return channel;
+}
+
+static void release(RcuHead *head)
+{
+    Channel *channel = (Channel *)head;
+    frame_free_contiguous(channel->frames, channel->pages);
+    kfree(channel);
+}
+
+// Called under table_lock. Unpublishes a destroyed channel nobody uses
+// anymore, true if the caller has to retire it.
+static bool unused(Channel *channel)
+{
+    if(channel->users || !channel->destroyed || table[channel->id] != channel)
+        return false;
+    __atomic_store_n(&table[channel->id], NULL, __ATOMIC_RELEASE);
+    return true;
+}
+
+void channel_destroy(Channel *channel)
+{
+    unsigned long flags = spin_lock_irqsave(&table_lock);
+    channel->destroyed = true;
+    bool gone = unused(channel);
+    spin_unlock_irqrestore(&table_lock, flags);
+    // a syscall on another CPU may have looked it up a moment ago
+    if(gone)
+        rcu_call(&channel->rcu, release);
+}
+
+Channel *channel_get(unsigned int id)
+{
+    return id < CHANNEL_MAX ? __atomic_load_n(&table[id], __ATOMIC_ACQUIRE) : NULL;
+}
+
+Channel *channel_acquire(unsigned int id)
+{
+    if(id >= CHANNEL_MAX)
+        return NULL;
+    unsigned long flags = spin_lock_irqsave(&table_lock);
+    Channel *channel = table[id];
+    if(channel)
+        channel->users++;
+    spin_unlock_irqrestore(&table_lock, flags);
+    return channel;
+}
+
+void channel_ref(Channel *channel)
+{
+    unsigned long flags = spin_lock_irqsave(&table_lock);
+    channel->users++;
+    spin_unlock_irqrestore(&table_lock, flags);
+}
+
+void channel_put(Channel *channel)
+{
+    unsigned long flags = spin_lock_irqsave(&table_lock);
+    channel->users--;
+    bool gone = unused(channel);
+    spin_unlock_irqrestore(&table_lock, flags);
+    if(gone)
+        rcu_call(&channel->rcu, release);
+}
+
+bool channel_map(Channel *channel, AddressSpace *space, uintptr_t addr)
+{
+    size_t size = channel->pages * PAGE_SIZE;
+    uint64_t flags = pte_user | pte_writable;
+    channel_ref(channel);
+    if(!address_space_reserve_channel(space, addr, size, flags, channel))
+    {
+        channel_put(channel);
+        return false;
+    }
+    // 4 KiB pages like everything forks share, borrowed: the frames stay the channel's
+    for(size_t offset = 0; offset < size; offset += PAGE_SIZE)
+        if(!paging_map(space->root, addr + offset, channel->frames + offset, PAGE_SIZE, flags | pte_borrowed))
+        {
+            // left reserved with its reference, dropped along with the space
+            paging_unmap(space->root, addr, offset);
+            return false;
+        }
+    return true;
+}
+
+static inline uint32_t *waiting(ChannelRing *ring, channel_end end)
+{
+    return end == channel_reader ? &ring->waiting_reader : &ring->waiting_writer;
+}
+
+void channel_wait(Channel *channel, channel_end end, uint32_t seen)
+{
+    ChannelRing *ring = channel->ring;
+    WaitQueue *wq = &channel->waiters[end];
+    const uint32_t *index = end == channel_reader ? &ring->tail : &ring->head;
+
+    spin_lock(&wq->lock);
+    // announce first, then check: the other end publishes first, then looks
+    __atomic_store_n(waiting(ring, end), 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(index, __ATOMIC_SEQ_CST) != seen)
+    {
+        spin_unlock(&wq->lock);
+        return;
+    }
+    waitqueue_sleep(wq);
+}
+
+void channel_wake(Channel *channel, channel_end end)
+{
+    WaitQueue *wq = &channel->waiters[end];
+    spin_lock(&wq->lock);
+    __atomic_store_n(waiting(channel->ring, end), 0, __ATOMIC_RELAXED);
+    waitqueue_wake_all(wq);
+    spin_unlock(&wq->lock);
+}
+
+void channel_send(Channel *channel, const void *message, uint32_t length)
+{
+    ChannelRing *ring = channel->ring;
+    if(length > channel->size / 4)
+        panic("channel_send: message larger than a quarter of the ring");
+    // the index is read before trying, a later one would miss the wakeup
+    uint32_t seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    void *slot;
+    while(!(slot = channel_reserve(ring, channel->size, length)))
+    {
+        channel_wait(channel, channel_writer, seen);
+        seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+    memcpy(slot, message, length);
+    if(channel_commit(ring, channel->size, length))
+        channel_wake(channel, channel_reader);
+}
+
+uint32_t channel_receive(Channel *channel, void *buffer, uint32_t max)
+{
+    ChannelRing *ring = channel->ring;
+    const void *message;
+    uint32_t length;
+    uint32_t seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while(!(message = channel_peek(ring, channel->size, &length)))
+    {
+        channel_wait(channel, channel_reader, seen);
+        seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    }
+    memcpy(buffer, message, length < max ? length : max);
+    if(channel_consume(ring, length))
+        channel_wake(channel, channel_writer);
+    return length;
+}
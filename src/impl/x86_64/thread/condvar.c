@@ -0,0 +1,30 @@
+#include "thread/condvar.h"
+
+Condvar new_condvar()
+{
+    Condvar cv = CONDVAR_INIT;
+    return cv;
+}
+
+void condvar_wait(Condvar *cv, Mutex *m)
+{
+    // queued before `m` is released, a signal in between can't get lost
+    spin_lock(&cv->waiters.lock);
+    mutex_unlock(m);
+    waitqueue_sleep(&cv->waiters);
+    mutex_lock(m);
+}
+
+void condvar_signal(Condvar *cv)
+{
+    spin_lock(&cv->waiters.lock);
+    waitqueue_wake_one(&cv->waiters);
+    spin_unlock(&cv->waiters.lock);
+}
+
+void condvar_broadcast(Condvar *cv)
+{
+    spin_lock(&cv->waiters.lock);
+    waitqueue_wake_all(&cv->waiters);
+    spin_unlock(&cv->waiters.lock);
+}
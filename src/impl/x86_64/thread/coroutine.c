@@ -1,20 +1,139 @@
 #include "thread/coroutine.h"
+#include "thread/stack.h"
+#include "thread/scheduler.h"
+#include "memory/slab.h"
+#include "memory/address_space.h"
+#include "machine/percpu.h"
+#include "stdlib/assert.h"
+#include "guard.h"
 #include <stddef.h>
 
 extern void toc_settle(/*OUT*/ toc* regs, void* tos, kickoff_func kickoff, void* coroutine);
 extern void toc_go(/*IN*/ toc* regs);
 extern void toc_switch(/*OUT*/ toc* regs_now, /*IN*/ toc* reg_then);
 
-void kickoff(void*, void*, void*, void*, void*, void*, Coroutine* coroutine);
+void kickoff(Coroutine *coroutine);
+
+static SlabCache coroutine_cache = SLAB_CACHE("coroutine", sizeof(Coroutine));
+
+static unsigned int next_id = 0;
 
 Coroutine new_coroutine(void (*action)())
 {
-    Coroutine c = {action, new_toc(), NULL};
+    Coroutine c = {.action = action, .mtoc = new_toc(), .priority = COROUTINE_PRIORITY_DEFAULT,
+                   .weight = COROUTINE_WEIGHT_DEFAULT,
+                   .refs = 1, .join_lock = SPINLOCK_INIT,
+                   .id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED)};
     return c;
 }
 void coroutine_init(Coroutine *c, void* tos)
 {
-    toc_settle(&(c->mtoc), tos, (kickoff_func)(&kickoff), c);
+    toc_settle(&(c->mtoc), tos, (kickoff_func)kickoff, c);
+}
+// takes a stack from the pool, it's given back once the coroutine exits
+bool coroutine_init_pooled(Coroutine *c)
+{
+    void *tos = stack_alloc();
+    if(!tos)
+        return false;
+    c->stack = tos;
+    coroutine_init(c, tos);
+    return true;
+}
+// a coroutine with its own pooled stack, NULL if out of memory
+Coroutine *coroutine_create(void (*action)())
+{
+    Coroutine *c = slab_alloc(&coroutine_cache);
+    if(!c)
+        return NULL;
+    *c = new_coroutine(action);
+    c->allocated = true;
+    if(!coroutine_init_pooled(c))
+    {
+        slab_free(&coroutine_cache, c);
+        return NULL;
+    }
+    return c;
+}
+static void coroutine_put(Coroutine *c)
+{
+    if(!__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) && c->allocated)
+        slab_free(&coroutine_cache, c);
+}
+
+Coroutine *coroutine_spawn(void (*fn)(void *arg), void *arg, void *stack)
+{
+    Coroutine *c = slab_alloc(&coroutine_cache);
+    if(!c)
+        return NULL;
+    *c = new_coroutine(fn);
+    c->arg = arg;
+    c->allocated = true;
+    c->refs = 2;
+    if(stack)
+        coroutine_init(c, stack);
+    else if(!coroutine_init_pooled(c))
+    {
+        slab_free(&coroutine_cache, c);
+        return NULL;
+    }
+    scheduler_ready(c);
+    return c;
+}
+
+void coroutine_join(Coroutine *c)
+{
+    spin_lock(&c->join_lock);
+    while(!c->finished)
+    {
+        assert(!c->joiner, "Coroutine joined twice");
+        c->joiner = cpu_this()->active;
+        // coroutine_finish may ready us right away, scheduler_block copes with that
+        spin_unlock(&c->join_lock);
+        scheduler_block();
+        spin_lock(&c->join_lock);
+    }
+    spin_unlock(&c->join_lock);
+    coroutine_put(c);
+}
+
+void coroutine_detach(Coroutine *c)
+{
+    coroutine_put(c);
+}
+
+void coroutine_finish(Coroutine *c)
+{
+    spin_lock(&c->join_lock);
+    c->finished = true;
+    Coroutine *joiner = c->joiner;
+    c->joiner = NULL;
+    spin_unlock(&c->join_lock);
+    if(joiner)
+        scheduler_ready(joiner);
+}
+
+void coroutine_exit()
+{
+    // actions usually return with the guard free, those at guard level keep it
+    if(!cpu_this()->guard_locked)
+        guard_enter();
+    coroutine_finish(cpu_this()->active);
+    // the next coroutine releases us once we are off this stack
+    scheduler_exit();
+    __builtin_unreachable();
+}
+
+void coroutine_release(Coroutine *c)
+{
+    if(c->stack)
+        stack_free(c->stack);
+    c->stack = NULL;
+    // a process's space goes with it, it is off every CPU by now
+    if(c->space)
+        address_space_destroy(c->space);
+    c->space = NULL;
+    coroutine_put(c);
 }
 void coroutine_go(Coroutine *c)
 {
@@ -1,10 +1,11 @@
 #include "thread/coroutine.h"
+#include "thread/scheduler.h"
 #include "guard.h"
-#include "panic.h"
 
-void kickoff(void *a, void *b, void *c, void *d, void *e, void *f, Coroutine* coroutine)
+void kickoff(Coroutine *coroutine)
 {
+    scheduler_finish_switch();
     guard_leave();
-    coroutine->action();
-    panic("kickoff terminated");
+    coroutine->action(coroutine->arg);
+    coroutine_exit();
 }
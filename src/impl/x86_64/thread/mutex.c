@@ -0,0 +1,43 @@
+#include "thread/mutex.h"
+#include "machine/percpu.h"
+#include "stdlib/assert.h"
+#include <stddef.h>
+
+Mutex new_mutex()
+{
+    Mutex m = MUTEX_INIT;
+    return m;
+}
+
+void mutex_lock(Mutex *m)
+{
+    Coroutine *self = cpu_this()->active;
+    spin_lock(&m->waiters.lock);
+    assert(m->owner != self, "Mutex is already held by the caller");
+    while(m->owner)
+    {
+        waitqueue_sleep(&m->waiters);
+        spin_lock(&m->waiters.lock);
+    }
+    m->owner = self;
+    spin_unlock(&m->waiters.lock);
+}
+
+bool mutex_trylock(Mutex *m)
+{
+    spin_lock(&m->waiters.lock);
+    bool taken = m->owner == NULL;
+    if(taken)
+        m->owner = cpu_this()->active;
+    spin_unlock(&m->waiters.lock);
+    return taken;
+}
+
+void mutex_unlock(Mutex *m)
+{
+    spin_lock(&m->waiters.lock);
+    assert(m->owner == cpu_this()->active, "Mutex is not held by the caller");
+    m->owner = NULL;
+    waitqueue_wake_one(&m->waiters);
+    spin_unlock(&m->waiters.lock);
+}
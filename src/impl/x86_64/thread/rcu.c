@@ -0,0 +1,115 @@
+#include "thread/rcu.h"
+#include "thread/scheduler.h"
+#include "machine/percpu.h"
+#include "machine/smp.h"
+#include "cpu.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// The global epoch only moves on once every CPU has observed it. Callbacks
+// queued while it read E are safe at E + 2: every CPU passed a quiescent
+// state after they were queued.
+static uint64_t global_epoch = 0;
+
+typedef struct
+{
+    uint64_t epoch;    // global epoch seen at the last quiescent state
+    RcuHead *next;     // collecting, queued at `next_epoch` at the latest
+    RcuHead **next_tail;
+    uint64_t next_epoch;
+    RcuHead *wait;     // waiting for its grace period
+    uint64_t wait_epoch;
+    uint64_t poked;    // epoch this CPU was last woken up for
+} __attribute__((aligned(64))) RcuCpu;
+
+static RcuCpu cpus[MAX_CPUS];
+
+extern uint64_t idle_cpus; // see scheduler.c
+
+// Moves the epoch on if every CPU saw the current one. An idle CPU can't be
+// skipped, the interrupt waking it runs before it leaves `idle_cpus`. It is
+// woken up instead and passes the guard once on its way back to sleep.
+static void try_advance(uint64_t epoch)
+{
+    uint64_t idle = __atomic_load_n(&idle_cpus, __ATOMIC_SEQ_CST);
+    bool behind = false;
+    for(unsigned int i = 0; i < MAX_CPUS; i++)
+    {
+        if(!__atomic_load_n(&percpu[i].online, __ATOMIC_ACQUIRE))
+            continue;
+        if(__atomic_load_n(&cpus[i].epoch, __ATOMIC_ACQUIRE) == epoch)
+            continue;
+        behind = true;
+        if((idle & (1ULL << i)) && __atomic_exchange_n(&cpus[i].poked, epoch, __ATOMIC_RELAXED) != epoch)
+            smp_wakeup(i);
+    }
+    if(!behind)
+        __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+void rcu_quiescent()
+{
+    RcuCpu *c = &cpus[cpu_id()];
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&c->epoch, epoch, __ATOMIC_RELEASE);
+    if(!c->next && !c->wait)
+        return;
+
+    try_advance(epoch);
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    unsigned long flags = int_save();
+    RcuHead *ready = NULL;
+    if(c->wait && epoch >= c->wait_epoch + 2)
+    {
+        ready = c->wait;
+        c->wait = NULL;
+    }
+    if(!c->wait && c->next)
+    {
+        c->wait = c->next;
+        c->wait_epoch = c->next_epoch;
+        c->next = NULL;
+    }
+    int_restore(flags);
+
+    while(ready)
+    {
+        RcuHead *head = ready;
+        ready = ready->next;
+        head->fn(head);
+    }
+}
+
+void rcu_call(RcuHead *head, void (*fn)(RcuHead *head))
+{
+    head->fn = fn;
+    head->next = NULL;
+    unsigned long flags = int_save();
+    RcuCpu *c = &cpus[cpu_id()];
+    if(!c->next)
+        c->next_tail = &c->next;
+    *c->next_tail = head;
+    c->next_tail = &head->next;
+    c->next_epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    int_restore(flags);
+}
+
+typedef struct
+{
+    RcuHead head; // has to come first
+    Coroutine *waiter;
+} RcuWait;
+
+static void rcu_wakeup(RcuHead *head)
+{
+    scheduler_ready(((RcuWait *)head)->waiter);
+}
+
+void rcu_synchronize()
+{
+    RcuWait w = {{NULL, NULL}, cpu_this()->active};
+    rcu_call(&w.head, rcu_wakeup);
+    // a fresh callback waits for a quiescent state after the switch at least
+    scheduler_block();
+}
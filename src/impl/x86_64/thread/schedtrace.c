@@ -0,0 +1,97 @@
+#include "thread/schedtrace.h"
+#include "machine/percpu.h"
+#include "machine/tsc.h"
+#include "device/serial.h"
+#include "machine/spinlock.h"
+#include "stdlib/stdio.h"
+
+// ---------------- QUEUE START ----------------
+typedef struct
+{
+    uint64_t head; // next position, only written by the owning CPU
+    SwitchEvent events[SCHEDTRACE_EVENTS];
+} __attribute__((aligned(64))) TraceRing;
+
+// A slot is invalidated before it is rewritten, readers compare its
+// sequence before and after copying, like a seqlock.
+static void ring_write(TraceRing *r, const SwitchEvent *event)
+{
+    uint64_t pos = r->head;
+    SwitchEvent *slot = &r->events[pos % SCHEDTRACE_EVENTS];
+    __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->tsc = event->tsc;
+    slot->from = event->from;
+    slot->to = event->to;
+    slot->reason = event->reason;
+    slot->priority = event->priority;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, pos + 1, __ATOMIC_RELEASE);
+}
+
+static bool ring_read(TraceRing *r, uint64_t pos, SwitchEvent *out)
+{
+    SwitchEvent *slot = &r->events[pos % SCHEDTRACE_EVENTS];
+    if(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1)
+        return false;
+    *out = *slot;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == pos + 1;
+}
+// ----------------- QUEUE END -----------------
+
+static TraceRing rings[MAX_CPUS];
+
+void schedtrace_switch(Coroutine *from, Coroutine *to, switch_reason reason, uint64_t now)
+{
+    SwitchEvent event = {0, now, from ? from->id : 0, to->id, reason, to->priority};
+    ring_write(&rings[cpu_id()], &event);
+}
+
+unsigned int schedtrace_read(unsigned int cpu, SwitchEvent *out, unsigned int max)
+{
+    TraceRing *r = &rings[cpu];
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t pos = head > SCHEDTRACE_EVENTS ? head - SCHEDTRACE_EVENTS : 0;
+    if(head - pos > max)
+        pos = head - max;
+
+    unsigned int n = 0;
+    for(; pos < head; pos++)
+        if(ring_read(r, pos, &out[n]))
+            n++;
+    return n;
+}
+
+static void export_line(const char *fmt, ...)
+{
+    char line[96];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    serial_write_all(line, n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+void schedtrace_export()
+{
+    // too big for the stack, the lock keeps CPUs from sharing it
+    static Spinlock export_lock = SPINLOCK_INIT;
+    static SwitchEvent events[SCHEDTRACE_EVENTS];
+    spin_lock(&export_lock);
+    export_line("H %lx\n", tsc_hz);
+    for(unsigned int cpu = 0; cpu < cpu_count(); cpu++)
+    {
+        unsigned int n = schedtrace_read(cpu, events, SCHEDTRACE_EVENTS);
+        for(unsigned int i = 0; i < n; i++)
+            export_line("S %x %lx %x %x %x %x\n", cpu, events[i].tsc, events[i].from,
+                    events[i].to, events[i].reason, events[i].priority);
+    }
+    export_line("D %x\n", serial_dropped());
+    spin_unlock(&export_lock);
+}
+
+void schedtrace_export_coroutine(const Coroutine *c)
+{
+    export_line("C %x %lx %lx %lx %lx\n", c->id, c->runtime, c->waited, c->switches, c->instructions);
+}
@@ -1,115 +1,479 @@
 #include "thread/scheduler.h"
+#include "thread/deque.h"
+#include "thread/schedtrace.h"
+#include "thread/rcu.h"
+#include "machine/percpu.h"
+#include "machine/smp.h"
+#include "machine/fpu.h"
+#include "memory/address_space.h"
+#include "machine/tsc.h"
+#include "machine/pmu.h"
 #include "panic.h"
+#include "plugbox.h"
+#include "cpu.h"
 #include <stddef.h>
-#include "panic.h"
+#include <stdint.h>
 #include "guard.h"
+#include "stdlib/assert.h"
 
-Coroutine *active = NULL;
+// ---------------- QUEUE START ----------------
+// One FIFO per priority level, a bit in `mask` marks every non-empty level.
+// Latency-critical coroutines come before all of them, in level 0.
+#define LEVELS (COROUTINE_PRIORITIES + 1)
+typedef struct
+{
+    Coroutine* head;
+    Coroutine* tail;
+} Queue;
 
-void go(Coroutine *first)
+// Run queue of one CPU. Only the owner touches `levels`, always under its
+// guard. Coroutines put on `stealable` may be picked up by idle CPUs.
+typedef struct
 {
-    active = first;
-    coroutine_go(active);
-}
-void dispatch(Coroutine *next)
+    Queue levels[LEVELS];
+    uint64_t mask;
+    Deque stealable;
+    Coroutine idle;
+} __attribute__((aligned(64))) RunQueue;
+
+RunQueue run_queues[MAX_CPUS];
+
+// bit n set <=> CPU n is waiting in its idle coroutine
+uint64_t idle_cpus = 0;
+
+unsigned char idle_stacks[MAX_CPUS][4096] __attribute__((aligned(16)));
+
+static uint64_t quantum = 0; // TSC cycles of a default weight slice
+// per CPU, queued by waking a latency-critical coroutine
+static interrupt_handler preempt_handlers[MAX_CPUS];
+// per CPU, queued by the tick IPI once the active coroutine's slice is used up
+static interrupt_handler tick_handlers[MAX_CPUS];
+
+static inline RunQueue *local()
 {
-    Coroutine *current = active;
-    active = next;
-    coroutine_resume(current, next);
+    return &run_queues[cpu_id()];
 }
 
-// ---------------- QUEUE START ----------------
-typedef struct
+static inline unsigned int level_of(Coroutine *item)
 {
-    Coroutine* head;
-    Coroutine** tail;
-} Queue;
+    return item->latency ? 0 : item->priority + 1;
+}
 
-Queue ready_list = {NULL, NULL};
-__attribute__((constructor)) void scheduler_init()
+void scheduler_enqueue(RunQueue *rq, Coroutine *item)
 {
-    ready_list.tail = &(ready_list.head);
+    unsigned int index = level_of(item);
+    Queue *level = &rq->levels[index];
+
+    item->next = NULL;
+    item->prev = level->tail;
+    if(level->tail)
+        level->tail->next = item;
+    else
+    {
+        level->head = item;
+        rq->mask |= 1ULL << index;
+    }
+    level->tail = item;
+    item->queued = true;
+    item->cpu = rq - run_queues;
 }
 
-void scheduler_enqueue(Coroutine *item)
+void scheduler_remove(RunQueue *rq, Coroutine *item)
 {
+    if(!item->queued)
+        return;
+
+    unsigned int index = level_of(item);
+    Queue *level = &rq->levels[index];
+
+    if(item->prev)
+        item->prev->next = item->next;
+    else
+        level->head = item->next;
+
+    if(item->next)
+        item->next->prev = item->prev;
+    else
+        level->tail = item->prev;
+
+    if(!level->head)
+        rq->mask &= ~(1ULL << index);
+
+    item->prev = NULL;
     item->next = NULL;
-    *(ready_list.tail) = item;
-    ready_list.tail = &(item->next);
+    item->queued = false;
 }
 
-Coroutine *scheduler_dequeue()
+Coroutine *scheduler_dequeue(RunQueue *rq)
 {
+    if(!rq->mask)
+        return NULL;
+
+    // lowest set bit is the most urgent non-empty level
+    Coroutine *item = rq->levels[__builtin_ctzll(rq->mask)].head;
+    scheduler_remove(rq, item);
+    return item;
+}
+// ----------------- QUEUE END -----------------
+
+// `that` won't run again, give back what it holds
+void scheduler_retire(Coroutine *that)
+{
+    fpu_release(that);
+    // it may still be leaving another CPU
+    while(__atomic_load_n(&that->on_cpu, __ATOMIC_ACQUIRE))
+        asm volatile("pause");
+    coroutine_finish(that);
+    coroutine_release(that);
+}
+
+// Retires `that` if it was killed, true if so. The active coroutine can't be
+// retired from its own stack, scheduler_resume and scheduler_block end it.
+static bool drop_killed(Coroutine *that)
+{
+    if(that == cpu_this()->active || !__atomic_exchange_n(&that->killed, false, __ATOMIC_ACQ_REL))
+        return false;
+    scheduler_retire(that);
+    return true;
+}
+
+Coroutine *scheduler_steal()
+{
+    unsigned int self = cpu_id();
+    for(unsigned int i = 1; i < MAX_CPUS; i++)
+    {
+        Coroutine *item = deque_steal(&run_queues[(self + i) % MAX_CPUS].stealable);
+        if(item)
+            return item;
+    }
+    return NULL;
+}
+
+// Next coroutine for this CPU: own levels first, then what was offered for
+// stealing, then other CPUs' offers. Coroutines killed meanwhile are dropped.
+Coroutine *scheduler_next()
+{
+    RunQueue *rq = local();
     Coroutine *item;
 
-    item = ready_list.head;
-    if(item)
+    while((item = scheduler_dequeue(rq))
+        || (item = deque_pop(&rq->stealable))
+        || (item = scheduler_steal()))
     {
-        ready_list.head = item->next;
-        if(!ready_list.head)
-            ready_list.tail = &(ready_list.head);
-        else
-            item->next = NULL;
+        if(!drop_killed(item))
+            return item;
     }
-    return item;
+    return NULL;
 }
 
-void scheduler_remove(Coroutine *item)
+bool scheduler_has_work()
 {
-    Coroutine *cur;
+    if(local()->mask)
+        return true;
+    for(unsigned int i = 0; i < MAX_CPUS; i++)
+        if(!deque_empty(&run_queues[i].stealable))
+            return true;
+    return false;
+}
 
-    if(ready_list.head)
+// Another CPU may have just stolen `next` while its context is still being
+// saved by the CPU it was preempted on.
+void scheduler_claim(Coroutine *next)
+{
+    while(__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+        asm volatile("pause");
+    next->on_cpu = true;
+}
+
+// charges the switch from `current` (NULL for the first one) to `next`
+static void account(Coroutine *current, Coroutine *next, switch_reason reason)
+{
+    uint64_t now = rdtsc();
+    uint64_t retired = pmu_fixed > pmu_fixed_instructions ? pmu_rdpmc(PMU_FIXED(pmu_fixed_instructions)) : 0;
+    if(current)
     {
-        cur = ready_list.head;
-        if(item == cur)
-            scheduler_dequeue();
-        else
-        {
-            while(cur->next && item != cur->next)
-                cur = cur->next;
-
-            if(cur->next)
-            {
-                cur->next = item->next;
-                item->next = NULL;
-
-                if (!cur->next)
-                    ready_list.tail = &(cur->next);
-            }
-        }
+        current->runtime += now - current->ran_at;
+        current->instructions += (retired - current->retired_at) & pmu_fixed_mask;
     }
+    // the idle coroutines are never readied, they don't wait
+    if(next->ready_at)
+        next->waited += now - next->ready_at;
+    next->ready_at = 0;
+    next->ran_at = now;
+    next->retired_at = retired;
+    // a fresh slice on every switch, however long the last one lasted
+    next->budget = quantum * next->weight / COROUTINE_WEIGHT_DEFAULT;
+    next->switches++;
+    schedtrace_switch(current, next, reason, now);
+}
+
+// marks the start of the time `that` spends queued
+static inline void account_ready(Coroutine *that)
+{
+    that->ready_at = rdtsc();
+}
+
+// Interrupts and syscalls from user mode enter on RSP0. A process brings its
+// own kernel stack along, everything else shares the one the CPU booted with.
+static void switch_kernel_stack(PerCPU *cpu, Coroutine *next)
+{
+    if(!cpu->rsp0)
+        cpu->rsp0 = cpu->tss->rsp[0];
+    cpu->tss->rsp[0] = next->space && next->stack ? (uint64_t)next->stack : cpu->rsp0;
+}
+
+void go(Coroutine *first)
+{
+    scheduler_claim(first);
+    account(NULL, first, switch_start);
+    fpu_switch(NULL, first);
+    address_space_switch(first->space);
+    switch_kernel_stack(cpu_this(), first);
+    cpu_this()->active = first;
+    coroutine_go(first);
+}
+void dispatch(Coroutine *next, switch_reason reason)
+{
+    PerCPU *cpu = cpu_this();
+    Coroutine *current = cpu->active;
+    scheduler_claim(next);
+    account(current, next, reason);
+    fpu_switch(current, next);
+    address_space_switch(next->space);
+    switch_kernel_stack(cpu, next);
+    cpu->active = next;
+    cpu->previous = current;
+    coroutine_resume(current, next);
+    scheduler_finish_switch();
+}
+
+// called by every coroutine that was switched to, once the one it replaced is saved
+void scheduler_finish_switch()
+{
+    PerCPU *cpu = cpu_this();
+    if(cpu->previous)
+    {
+        __atomic_store_n(&cpu->previous->on_cpu, false, __ATOMIC_RELEASE);
+        cpu->previous = NULL;
+    }
+    // whatever the previous coroutine referenced, it does no longer
+    rcu_quiescent();
+    if(cpu->exited)
+    {
+        // nothing runs on its stack anymore
+        coroutine_release(cpu->exited);
+        cpu->exited = NULL;
+    }
+}
+
+// runs once the guard is free, scheduler_ready may be called under spinlocks
+static void preempt_epilogue(unsigned int count)
+{
+    (void)count;
+    Coroutine *current = cpu_this()->active;
+    if(current != &local()->idle && !current->latency)
+        scheduler_resume();
+}
+
+// true once the active coroutine has used up its slice
+static bool slice_over()
+{
+    Coroutine *current = cpu_this()->active;
+    return current != &local()->idle && rdtsc() - current->ran_at >= current->budget;
+}
+
+static void tick_epilogue(unsigned int count)
+{
+    (void)count;
+    if(slice_over())
+        scheduler_resume();
+}
+
+static bool tick_prologue()
+{
+    if(slice_over())
+        guard_defer(&tick_handlers[cpu_id()]);
+    return false;
+}
+
+void idle_action()
+{
+    uint64_t self = 1ULL << cpu_id(); // the idle coroutine never migrates
+    for(;;)
+    {
+        guard_enter();
+        Coroutine *next = scheduler_next();
+        if(next)
+            dispatch(next, switch_idle);
+        guard_leave();
+
+        // Announce before checking, so whoever offers work afterwards sees us
+        int_disable();
+        __atomic_or_fetch(&idle_cpus, self, __ATOMIC_SEQ_CST);
+        smp_idle(scheduler_has_work);
+        __atomic_and_fetch(&idle_cpus, ~self, __ATOMIC_SEQ_CST);
+    }
+}
+
+__attribute__((constructor)) void scheduler_init()
+{
+    for(unsigned int i = 0; i < MAX_CPUS; i++)
+    {
+        run_queues[i].idle = new_coroutine(idle_action);
+        coroutine_init(&run_queues[i].idle, idle_stacks[i] + sizeof(idle_stacks[i]));
+        preempt_handlers[i] = new_interrupt_handler(NULL, preempt_epilogue);
+        tick_handlers[i] = new_interrupt_handler(NULL, tick_epilogue);
+    }
+    // the epilogue keeps the vector off the fast path: guardian() runs what
+    // the prologue deferred before returning to the interrupted coroutine
+    static interrupt_handler tick_handler = INTERRUPT_HANDLER(tick_prologue, tick_epilogue);
+    plugbox_assign(int_tick, &tick_handler);
 }
-// ----------------- QUEUE END -----------------
 
 void scheduler_ready(Coroutine *that)
 {
-    scheduler_enqueue(that);
+    RunQueue *rq = local();
+    uint64_t self = 1ULL << cpu_id();
+
+    // killed while it was blocked, it is dropped instead of woken
+    if(drop_killed(that))
+        return;
+    account_ready(that);
+
+    // offer the coroutine to an idle CPU, unless this one is idle itself
+    uint64_t idle = __atomic_load_n(&idle_cpus, __ATOMIC_SEQ_CST);
+    if(!(idle & self) && (idle & ~self) && deque_push(&rq->stealable, that))
+    {
+        smp_wakeup(__builtin_ctzll(idle & ~self));
+        return;
+    }
+    scheduler_enqueue(rq, that);
+
+    Coroutine *current = cpu_this()->active;
+    if(that->latency && !current->latency && current != &rq->idle)
+        guard_defer(&preempt_handlers[cpu_id()]);
 }
 
 void scheduler_schedule()
 {
-    Coroutine *process = scheduler_dequeue();
-    if(process)
-        go(process);
+    Coroutine *process = scheduler_next();
+    go(process ? process : &local()->idle);
 }
 
 void scheduler_exit()
 {
-    Coroutine *process = scheduler_dequeue();
-    if(process)
-        dispatch(process);
-    else
-        panic("Last coroutine exited");
+    PerCPU *cpu = cpu_this();
+    fpu_release(cpu->active);
+    cpu->exited = cpu->active;
+    Coroutine *process = scheduler_next();
+    dispatch(process ? process : &local()->idle, switch_exit);
+}
+
+// the active coroutine was killed, it leaves as if it had exited
+__attribute__((noreturn)) static void end_killed(Coroutine *current)
+{
+    __atomic_store_n(&current->killed, false, __ATOMIC_RELAXED);
+    coroutine_finish(current);
+    scheduler_exit();
+    __builtin_unreachable();
+}
+
+void scheduler_block()
+{
+    Coroutine *current = cpu_this()->active;
+    // unless it was woken up already, nothing refers to it from the queues
+    if(!current->queued && __atomic_load_n(&current->killed, __ATOMIC_ACQUIRE))
+        end_killed(current);
+    Coroutine *process = scheduler_next();
+    // it may have been woken up and put back already
+    if(process != current)
+        dispatch(process ? process : &local()->idle, switch_block);
 }
 
 void scheduler_kill(Coroutine *that)
 {
-    scheduler_remove(that);
+    if(that->queued && that->cpu == cpu_id())
+    {
+        scheduler_remove(local(), that);
+        scheduler_retire(that);
+        return;
+    }
+    // Blocked, sleeping, active or queued elsewhere: it is dropped wherever it
+    // would run next. Its joiner doesn't wait for that, the reference of the
+    // running coroutine keeps it valid until then.
+    __atomic_store_n(&that->killed, true, __ATOMIC_RELEASE);
+    coroutine_finish(that);
 }
 
 void scheduler_resume()
 {
-    scheduler_enqueue(active);
-    Coroutine *process = scheduler_dequeue();
-    dispatch(process);
+    RunQueue *rq = local();
+    Coroutine *current = cpu_this()->active;
+
+    // keep the preempted coroutine local, its context isn't saved yet
+    if(current != &rq->idle)
+    {
+        if(__atomic_load_n(&current->killed, __ATOMIC_ACQUIRE))
+            end_killed(current);
+        account_ready(current);
+        scheduler_enqueue(rq, current);
+    }
+
+    Coroutine *process = scheduler_next();
+    if(process && process != current)
+        dispatch(process, switch_preempt);
+    else if(process)
+    {
+        // kept running, on a fresh slice
+        current->ready_at = 0;
+        current->budget = rdtsc() - current->ran_at + quantum * current->weight / COROUTINE_WEIGHT_DEFAULT;
+    }
+}
+
+// The watch runs on the CPU the PIT interrupts, every other busy CPU checks
+// its own slice on the IPI
+void scheduler_tick()
+{
+    smp_broadcast(int_tick, __atomic_load_n(&idle_cpus, __ATOMIC_SEQ_CST));
+    if(slice_over())
+        scheduler_resume();
+}
+
+void scheduler_set_quantum(uint64_t us)
+{
+    quantum = us * tsc_hz / 1000000;
+}
+
+void scheduler_set_priority(Coroutine *that, unsigned int priority)
+{
+    assert(priority < COROUTINE_PRIORITIES, "Coroutine priority out of range");
+    assert(!that->queued || that->cpu == cpu_id(), "Coroutine is queued on another CPU");
+    if(that->queued)
+    {
+        scheduler_remove(local(), that);
+        that->priority = priority;
+        scheduler_enqueue(local(), that);
+    }
+    else
+        that->priority = priority;
+}
+
+void scheduler_set_weight(Coroutine *that, unsigned int weight)
+{
+    assert(weight > 0, "Coroutine weight must not be 0");
+    // takes effect with its next slice
+    that->weight = weight;
+}
+
+void scheduler_set_latency(Coroutine *that, bool latency)
+{
+    assert(!that->queued || that->cpu == cpu_id(), "Coroutine is queued on another CPU");
+    if(that->queued)
+    {
+        scheduler_remove(local(), that);
+        that->latency = latency;
+        scheduler_enqueue(local(), that);
+    }
+    else
+        that->latency = latency;
 }
@@ -0,0 +1,37 @@
+#include "thread/semaphore.h"
+
+Semaphore new_semaphore(unsigned int count)
+{
+    Semaphore s = SEMAPHORE_INIT(count);
+    return s;
+}
+
+void semaphore_wait(Semaphore *s)
+{
+    spin_lock(&s->waiters.lock);
+    while(!s->count)
+    {
+        waitqueue_sleep(&s->waiters);
+        spin_lock(&s->waiters.lock);
+    }
+    s->count--;
+    spin_unlock(&s->waiters.lock);
+}
+
+bool semaphore_trywait(Semaphore *s)
+{
+    spin_lock(&s->waiters.lock);
+    bool taken = s->count > 0;
+    if(taken)
+        s->count--;
+    spin_unlock(&s->waiters.lock);
+    return taken;
+}
+
+void semaphore_signal(Semaphore *s)
+{
+    spin_lock(&s->waiters.lock);
+    s->count++;
+    waitqueue_wake_one(&s->waiters);
+    spin_unlock(&s->waiters.lock);
+}
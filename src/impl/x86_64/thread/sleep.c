@@ -0,0 +1,30 @@
+#include "thread/sleep.h"
+#include "thread/scheduler.h"
+#include "device/timer.h"
+#include "machine/percpu.h"
+
+// lives on the sleeper's stack, `timer` has to come first
+typedef struct
+{
+    Timer timer;
+    Coroutine *sleeper;
+} Sleep;
+
+void sleep_wakeup(Timer *timer)
+{
+    // nothing may touch the Sleep afterwards, its stack runs again
+    scheduler_ready(((Sleep *)timer)->sleeper);
+}
+
+void sleep_until(uint64_t deadline)
+{
+    Sleep s = {new_timer(sleep_wakeup), cpu_this()->active};
+    // the timer may fire right away, scheduler_block copes with that
+    timer_arm(&s.timer, deadline);
+    scheduler_block();
+}
+
+void sleep(uint64_t us)
+{
+    sleep_until(timer_now() + us);
+}
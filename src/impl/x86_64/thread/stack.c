@@ -0,0 +1,93 @@
+#include "thread/stack.h"
+#include "memory/paging.h"
+#include "memory/frame.h"
+#include "machine/spinlock.h"
+#include "stdlib/assert.h"
+#include "klog.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLOT_SIZE (PAGE_SIZE + STACK_SIZE)
+// 512 MiB above the kernel image and below the framebuffer window
+#define STACK_WINDOW 0xFFFFFFFFA0000000UL
+
+// free stacks are linked through their lowest word
+typedef struct FreeStack
+{
+    struct FreeStack *next;
+} FreeStack;
+
+static FreeStack *free_stacks = NULL;
+static unsigned int slots_used = 0; // slots below this one were mapped once
+static Spinlock stack_lock = SPINLOCK_INIT;
+
+__attribute__((constructor)) void stack_init()
+{
+    lock_name(&stack_lock, "stack");
+}
+
+// maps frames behind the stack of `slot`, its guard page stays unmapped
+static bool map_slot(unsigned int slot)
+{
+    uintptr_t base = STACK_WINDOW + (uintptr_t)slot * SLOT_SIZE + PAGE_SIZE;
+    for(size_t offset = 0; offset < STACK_SIZE; offset += PAGE_SIZE)
+    {
+        uintptr_t frame = frame_alloc();
+        if(!frame || !paging_map(paging_kernel_root(), base + offset, frame, PAGE_SIZE, pte_writable))
+        {
+            if(frame)
+                frame_free(frame);
+            for(size_t undo = 0; undo < offset; undo += PAGE_SIZE)
+            {
+                uintptr_t phys;
+                if(paging_translate(paging_kernel_root(), base + undo, &phys))
+                    frame_free(phys);
+            }
+            paging_unmap(paging_kernel_root(), base, offset);
+            return false;
+        }
+    }
+    return true;
+}
+
+void *stack_alloc()
+{
+    unsigned long flags = spin_lock_irqsave(&stack_lock);
+    FreeStack *s = free_stacks;
+    if(s)
+        free_stacks = s->next;
+    unsigned int slot = s || slots_used == STACK_MAX ? STACK_MAX : slots_used++;
+    spin_unlock_irqrestore(&stack_lock, flags);
+
+    if(s)
+        return (unsigned char *)s + STACK_SIZE;
+    if(slot == STACK_MAX)
+    {
+        klog_at(KLOG_WARNING, "stack_alloc: all %u stacks in use\n", STACK_MAX);
+        return NULL;
+    }
+    if(!map_slot(slot))
+    {
+        // give the slot back unless later ones went out meanwhile, a hole only costs address space
+        klog_at(KLOG_WARNING, "stack_alloc: out of frames\n");
+        flags = spin_lock_irqsave(&stack_lock);
+        if(slot + 1 == slots_used)
+            slots_used--;
+        spin_unlock_irqrestore(&stack_lock, flags);
+        return NULL;
+    }
+    return (unsigned char *)(STACK_WINDOW + (uintptr_t)slot * SLOT_SIZE + SLOT_SIZE);
+}
+
+void stack_free(void *tos)
+{
+    assert((uintptr_t)tos > STACK_WINDOW && ((uintptr_t)tos - STACK_WINDOW) % SLOT_SIZE == 0
+        && ((uintptr_t)tos - STACK_WINDOW) / SLOT_SIZE <= __atomic_load_n(&slots_used, __ATOMIC_RELAXED),
+        "stack_free: not a pooled stack");
+
+    FreeStack *s = (FreeStack *)((unsigned char *)tos - STACK_SIZE);
+    unsigned long flags = spin_lock_irqsave(&stack_lock);
+    s->next = free_stacks;
+    free_stacks = s;
+    spin_unlock_irqrestore(&stack_lock, flags);
+}
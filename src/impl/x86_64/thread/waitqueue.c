@@ -0,0 +1,41 @@
+#include "thread/waitqueue.h"
+#include "thread/scheduler.h"
+#include "machine/percpu.h"
+#include <stddef.h>
+
+void waitqueue_sleep(WaitQueue *wq)
+{
+    Coroutine *self = cpu_this()->active;
+    self->next = NULL;
+    if(wq->tail)
+        wq->tail->next = self;
+    else
+        wq->head = self;
+    wq->tail = self;
+
+    // a waker may ready us right away, scheduler_block copes with that
+    spin_unlock(&wq->lock);
+    scheduler_block();
+}
+
+bool waitqueue_wake_one(WaitQueue *wq)
+{
+    Coroutine *item = wq->head;
+    if(!item)
+        return false;
+
+    wq->head = item->next;
+    if(!wq->head)
+        wq->tail = NULL;
+    item->next = NULL;
+    scheduler_ready(item);
+    return true;
+}
+
+bool waitqueue_wake_all(WaitQueue *wq)
+{
+    bool woken = false;
+    while(waitqueue_wake_one(wq))
+        woken = true;
+    return woken;
+}
@@ -0,0 +1,186 @@
+#include "thread/workqueue.h"
+#include "thread/waitqueue.h"
+#include "thread/coroutine.h"
+#include "machine/percpu.h"
+#include "plugbox.h"
+#include "guard.h"
+#include "panic.h"
+#include "cpu.h"
+#include <stddef.h>
+
+#define WORKQUEUE_BATCH 16 // items run before the worker looks at its own queue again
+
+typedef struct
+{
+    Work *incoming;       // LIFO, pushed with a CAS from any context
+    WaitQueue idle;       // the worker, while there is nothing to do
+    interrupt_handler kick; // wakes the worker for queueing prologues
+} __attribute__((aligned(64))) WorkQueue;
+
+static WorkQueue queues[MAX_CPUS];
+static unsigned int workers = 0;
+
+// ---------------- QUEUE START ----------------
+static void queue_push(WorkQueue *q, Work *work)
+{
+    Work *head = __atomic_load_n(&q->incoming, __ATOMIC_RELAXED);
+    do
+        work->next = head;
+    while(!__atomic_compare_exchange_n(&q->incoming, &head, work, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// everything queued so far, oldest first
+static Work *queue_take(WorkQueue *q)
+{
+    Work *batch = __atomic_exchange_n(&q->incoming, NULL, __ATOMIC_ACQUIRE);
+    Work *fifo = NULL;
+    while(batch)
+    {
+        Work *next = batch->next;
+        batch->next = fifo;
+        fifo = batch;
+        batch = next;
+    }
+    return fifo;
+}
+// ----------------- QUEUE END -----------------
+
+// caller holds the guard
+static void wake(WorkQueue *q)
+{
+    spin_lock(&q->idle.lock);
+    waitqueue_wake_one(&q->idle);
+    spin_unlock(&q->idle.lock);
+}
+
+// brings an idle worker in to steal what `home` can't get to soon
+static void wake_peer(unsigned int home)
+{
+    for(unsigned int i = 1; i < workers; i++)
+    {
+        WorkQueue *q = &queues[(home + i) % workers];
+        spin_lock(&q->idle.lock);
+        bool woken = waitqueue_wake_one(&q->idle);
+        spin_unlock(&q->idle.lock);
+        if(woken)
+            return;
+    }
+}
+
+static void kick_epilogue(unsigned int count)
+{
+    (void)count;
+    wake(&queues[cpu_id()]);
+}
+
+bool workqueue_queue(Work *work)
+{
+    if(__atomic_exchange_n(&work->queued, true, __ATOMIC_ACQ_REL))
+        return false;
+
+    unsigned long flags = int_save();
+    unsigned int cpu = cpu_id();
+    WorkQueue *q = &queues[cpu < workers ? cpu : 0];
+    queue_push(q, work);
+    int_restore(flags);
+    if(!__atomic_load_n(&workers, __ATOMIC_ACQUIRE))
+        return true; // picked up once the workers start
+
+    // interrupts off: possibly a prologue, which must not touch the scheduler
+    if(!int_enabled())
+        guard_defer(&q->kick);
+    else if(cpu_this()->guard_locked)
+        wake(q);
+    else
+    {
+        guard_enter();
+        wake(q);
+        guard_leave();
+    }
+    return true;
+}
+
+// runs a batch without the guard, the caller holds it
+static void run(Work *batch)
+{
+    while(batch)
+    {
+        Work *work = batch;
+        batch = batch->next;
+        // may be queued again while it runs
+        __atomic_store_n(&work->queued, false, __ATOMIC_RELEASE);
+        guard_leave();
+        work->fn(work);
+        guard_enter();
+    }
+}
+
+// a whole backlog of another worker, for an idle one
+static Work *steal(unsigned int home)
+{
+    for(unsigned int i = 1; i < workers; i++)
+    {
+        Work *batch = queue_take(&queues[(home + i) % workers]);
+        if(batch)
+            return batch;
+    }
+    return NULL;
+}
+
+static void worker_action(void *arg)
+{
+    WorkQueue *q = arg;
+    unsigned int home = q - queues;
+    guard_enter();
+    for(;;)
+    {
+        Work *batch = queue_take(q);
+        if(!batch)
+            batch = steal(home);
+        if(batch)
+        {
+            // at most WORKQUEUE_BATCH at a time, the rest is queued again
+            // for an idle worker to steal
+            Work *tail = batch;
+            for(unsigned int n = 1; n < WORKQUEUE_BATCH && tail->next; n++)
+                tail = tail->next;
+            Work *rest = tail->next;
+            tail->next = NULL;
+            if(rest)
+            {
+                while(rest)
+                {
+                    Work *next = rest->next;
+                    queue_push(q, rest);
+                    rest = next;
+                }
+                wake_peer(home);
+            }
+            run(batch);
+            continue;
+        }
+
+        // queued before checking again, a queueing CPU is sure to wake us
+        spin_lock(&q->idle.lock);
+        if(__atomic_load_n(&q->incoming, __ATOMIC_ACQUIRE))
+            spin_unlock(&q->idle.lock);
+        else
+            waitqueue_sleep(&q->idle);
+    }
+}
+
+void workqueue_init()
+{
+    unsigned int n = cpu_count();
+    for(unsigned int i = 0; i < n; i++)
+    {
+        WaitQueue idle = WAITQUEUE_INIT;
+        queues[i].idle = idle;
+        queues[i].kick = new_interrupt_handler(NULL, kick_epilogue);
+        Coroutine *worker = coroutine_spawn(worker_action, &queues[i], NULL);
+        if(!worker)
+            panic("workqueue_init: out of memory");
+        coroutine_detach(worker);
+    }
+    __atomic_store_n(&workers, n, __ATOMIC_RELEASE);
+}
@@ -1,8 +1,23 @@
 #include "user/app.h"
 #include "guard.h"
 #include "cgascr.h"
+#include "device/ps2_keyboard.h"
+#include "panic.h"
+#include "thread/channel.h"
+#include "memory/paging.h"
 #include "stdlib/stdio.h"
 
+// app1 counts and hands every value to app2 through a channel, app2 shows
+// what arrives; it blocks while the ring is empty, app1 while it is full
+static Channel *counter;
+
+// by whichever of the two is created first, both are before they run
+static void counter_create()
+{
+    if(!counter && !(counter = channel_create(PAGE_SIZE)))
+        panic("app: out of channels");
+}
+
 void action()
 {
     for(int i = 0;;i=(i%100)+1)
@@ -11,35 +26,66 @@ void action()
             guard_enter();
             CGA_setpos(0, 2);
             printf("app1: %c", i);
+            channel_send(counter, &i, sizeof(i));
             guard_leave();
         }
     }
 }
 void action2()
 {
-    for(int i = 0;;i=(i%100)+1)
+    for(;;)
     {
         {
+            int i = 0;
             guard_enter();
+            channel_receive(counter, &i, sizeof(i));
             CGA_setpos(2, 4);
             printf("app2: %c", i);
             guard_leave();
         }
     }
 }
+// echoes typed keys, sleeping in between. Shift+PgUp/PgDn page through the
+// scrollback, any other key returns to the live screen.
+void echo_action()
+{
+    guard_enter();
+    for(;;)
+    {
+        Key key = keyboard_read();
+        if(key.shift && key.scancode == key_pgup)
+            CGA_scrollback(CGA_ROWS / 2);
+        else if(key.shift && key.scancode == key_pgdwn)
+            CGA_scrollback(-CGA_ROWS / 2);
+        else
+        {
+            CGA_scrollback(-CGA_SCROLLBACK);
+            CGA_putchar(key.ascii);
+            CGA_flush();
+        }
+    }
+}
 
-Coroutine a1;
-Coroutine a2;
-
-Coroutine *app(void *tos)
+Coroutine *app()
+{
+    counter_create();
+    Coroutine *c = coroutine_create(action);
+    if(!c)
+        panic("app: out of memory");
+    return c;
+}
+Coroutine *app2()
 {
-    a1 = new_coroutine(action);
-    coroutine_init(&a1, tos);
-    return &a1;
+    counter_create();
+    Coroutine *c = coroutine_create(action2);
+    if(!c)
+        panic("app2: out of memory");
+    return c;
 }
-Coroutine *app2(void *tos)
+Coroutine *echo()
 {
-    a2 = new_coroutine(action2);
-    coroutine_init(&a2, tos);
-    return &a2;
+    Coroutine *c = coroutine_create(echo_action);
+    if(!c)
+        panic("echo: out of memory");
+    return c;
 }
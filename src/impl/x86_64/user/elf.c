@@ -0,0 +1,142 @@
+#include "user/elf.h"
+#include "memory/paging.h"
+#include "memory/frame.h"
+#include "stdlib/algorithm.h"
+#include "klog.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// boot/main64.asm
+extern void enter_usermode(uint64_t start_addr, uint64_t stack);
+
+#define page_down(x) ((x) & ~(uintptr_t)(PAGE_SIZE - 1))
+#define page_up(x) page_down((x) + PAGE_SIZE - 1)
+
+static bool valid(const ElfHeader *elf, size_t size)
+{
+    return size >= sizeof(ElfHeader) && elf->magic == ELF_MAGIC
+        && elf->class == ELF_CLASS64 && elf->data == ELF_DATA2LSB
+        && elf->type == ELF_TYPE_EXEC && elf->machine == ELF_MACHINE_X86_64
+        && elf->phentsize == sizeof(ElfSegment)
+        && elf->phoff <= size && elf->phnum <= (size - elf->phoff) / sizeof(ElfSegment);
+}
+
+// maps one PT_LOAD segment, the image starts at physical `image`
+static bool load_segment(AddressSpace *space, uintptr_t image, const ElfSegment *segment)
+{
+    uintptr_t start = page_down(segment->vaddr);
+    uintptr_t end = page_up(segment->vaddr + segment->memsz);
+    uintptr_t file_end = segment->vaddr + segment->filesz;
+    uint64_t flags = pte_user | (segment->flags & ELF_PF_W ? pte_writable : 0);
+    if(!address_space_reserve(space, start, end - start, flags))
+        return false;
+
+    // in place only if the image and the segment share their page offsets
+    bool in_place = !(image & (PAGE_SIZE - 1))
+        && !((segment->offset ^ segment->vaddr) & (PAGE_SIZE - 1));
+    uint64_t borrowed = pte_user | pte_borrowed | (flags & pte_writable ? pte_cow : 0);
+
+    // 4 KiB pages, the granularity of forks and copy-on-write
+    for(uintptr_t page = start; page < file_end; page += PAGE_SIZE)
+    {
+        uintptr_t offset = segment->offset + (page - segment->vaddr);
+        if(in_place && (page + PAGE_SIZE <= file_end || segment->memsz == segment->filesz))
+        {
+            if(!paging_map(space->root, page, image + offset, PAGE_SIZE, borrowed))
+                return false;
+            continue;
+        }
+
+        // a page shared with .bss or misaligned: a copy of just the file's bytes
+        uintptr_t frame = frame_alloc();
+        if(!frame)
+            return false;
+        uint8_t *copy = phys_to_virt(frame);
+        memset(copy, 0, FRAME_SIZE);
+        uintptr_t from = page < segment->vaddr ? segment->vaddr : page;
+        uintptr_t to = page + PAGE_SIZE < file_end ? page + PAGE_SIZE : file_end;
+        memcpy(copy + (from - page), phys_to_virt(image + segment->offset + (from - segment->vaddr)), to - from);
+        if(!paging_map(space->root, page, frame, PAGE_SIZE, flags))
+        {
+            frame_free(frame);
+            return false;
+        }
+    }
+    return true;
+}
+
+AddressSpace *elf_load(uintptr_t start, uintptr_t end, uintptr_t *entry)
+{
+    const ElfHeader *elf = phys_to_virt(start);
+    size_t size = end - start;
+    if(!valid(elf, size))
+        return NULL;
+
+    AddressSpace *space = address_space_create();
+    if(!space)
+        return NULL;
+
+    const ElfSegment *segments = (const ElfSegment *)((const uint8_t *)elf + elf->phoff);
+    for(unsigned int i = 0; i < elf->phnum; i++)
+    {
+        const ElfSegment *s = &segments[i];
+        if(s->type != ELF_PT_LOAD || !s->memsz)
+            continue;
+        bool fits = s->filesz <= s->memsz && s->offset <= size && s->filesz <= size - s->offset
+            && s->vaddr >= USER_BASE && s->vaddr < USER_END && s->memsz <= USER_END - s->vaddr;
+        if(!fits || !load_segment(space, start, s))
+        {
+            address_space_destroy(space);
+            return NULL;
+        }
+    }
+
+    *entry = elf->entry;
+    return space;
+}
+
+static void run(void *entry)
+{
+    enter_usermode((uint64_t)entry, USER_END);
+}
+
+// gives the loaded space a stack and a coroutine, or destroys it
+static Coroutine *spawn(AddressSpace *space, uintptr_t entry)
+{
+    Coroutine *c;
+    if(!address_space_stack(space, USER_END, USER_STACK_SIZE, pte_user) || !(c = coroutine_create(run)))
+    {
+        address_space_destroy(space);
+        return NULL;
+    }
+    c->arg = (void *)entry;
+    c->space = space;
+    return c;
+}
+
+Coroutine *elf_spawn(uintptr_t start, uintptr_t end)
+{
+    uintptr_t entry;
+    AddressSpace *space = elf_load(start, end, &entry);
+    if(!space)
+    {
+        klog_at(KLOG_WARNING, "elf: no executable at 0x%lx\n", start);
+        return NULL;
+    }
+    return spawn(space, entry);
+}
+
+Coroutine *user_spawn_page(void (*code)())
+{
+    uintptr_t page = page_down((uintptr_t)code);
+    AddressSpace *space = address_space_create();
+    if(!space)
+        return NULL;
+    if(!address_space_reserve(space, USER_BASE, PAGE_SIZE, pte_user)
+        || !paging_map(space->root, USER_BASE, kernel_to_phys(page), PAGE_SIZE, pte_user | pte_borrowed))
+    {
+        address_space_destroy(space);
+        return NULL;
+    }
+    return spawn(space, USER_BASE + ((uintptr_t)code - page));
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "thread/coroutine.h"
+
+// Micro-benchmarks of the switch, interrupt and guard paths, run by the
+// `bench-x86_64` kernel in place of the demo apps. Results go out over
+// CGA and serial as `bench: <name> <cycles> cycles/<unit>`.
+Coroutine *bench();
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+// Each mark closes a boot phase, which started with the previous mark. The
+// trace starts in long_mode_start, before the BSS is cleared.
+void boottrace_start(uint64_t tsc);
+void boottrace_mark(const char *phase);
+// closes the phase of a global constructor, called by _init after each one
+void boottrace_constructor(void (*constructor)());
+// calibrates the TSC and prints the phases, longest first
+void boottrace_report();
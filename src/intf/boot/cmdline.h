@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernel options from the boot loader: `key=value` or a bare `key`,
+// separated by spaces, the last occurrence wins. Lookups scan the multiboot
+// string in place through the direct map, so nothing can be looked up
+// before frame_init.
+//
+//   quantum=<us>           time slice of a coroutine of default weight
+//   slice_tick=<us>        how often the scheduler checks for used up slices
+//   tick=<us>              longest one-shot of the timer, a small value
+//                          makes it tick periodically
+//   console=cga,serial     output sinks of printf
+//   loglevel=<0-3>         klog messages above it are dropped
+//   cpus=<n>               CPUs to bring up, including the BSP
+//   profile=<us>           starts the sampling profiler at boot
+//   profile_cycles=<n>     samples every n cycles with the PMU instead
+//   rdpmc                  lets user mode read the performance counters
+//   mwait=off              idle CPUs halt instead of using MONITOR/MWAIT
+void cmdline_set(const char *cmdline);
+// the value of `key` is the `length` bytes at `value`, empty for a bare key
+bool cmdline_find(const char *key, const char **value, size_t *length);
+uint64_t cmdline_uint(const char *key, uint64_t fallback);
+// true for a bare key or any value but 0, off or no
+bool cmdline_flag(const char *key, bool fallback);
+// whether `item` is among the comma separated values of `key`
+bool cmdline_has(const char *key, const char *item);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+#define MAX_MODULES 8
+
+// A multiboot2 module, left where the boot loader put it. Its frames are
+// reserved for good, so they can be mapped in place.
+typedef struct
+{
+    uintptr_t start; // physical, page aligned as the multiboot header asks
+    uintptr_t end;
+    const char *cmdline; // through the direct map
+} BootModule;
+
+// called for every module tag, before frame_init
+void module_add(uintptr_t start, uintptr_t end, const char *cmdline);
+unsigned int module_count();
+const BootModule *module_get(unsigned int index);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+// The kernel is linked and mapped this far above its physical load address,
+// at -2 GiB for the kernel code model (see linker.ld)
+#define KERNEL_OFFSET 0xFFFFFFFF80000000UL
+#define PAGE_SIZE 4096
+#define phys_to_kernel(addr) ((void *)((uintptr_t)(addr) + KERNEL_OFFSET))
+#define kernel_to_phys(addr) ((uintptr_t)(addr) - KERNEL_OFFSET)
+
+// page table entry flags
+enum
+{
+    pte_present = 1 << 0,
+    pte_writable = 1 << 1,
+    pte_user = 1 << 2,
+    pte_write_through = 1 << 3,
+    pte_cache_disable = 1 << 4,
+    pte_huge = 1 << 7,
+    pte_pat = 1 << 7, // the same bit in 4 KiB entries, see paging_cpu_init
+    pte_global = 1 << 8,
+    pte_cow = 1 << 9, // available to software: read-only until written, see paging_fork
+    pte_borrowed = 1 << 10, // software: the frame isn't the space's to free, e.g. a boot module
+};
+
+#define PTE_ADDRESS 0x000ffffffffff000UL
+
+// static boot hierarchy built by setup_page_tables in boot/main.asm
+// (its symbol is a physical address, use the accessors below after boot)
+extern uint64_t page_table[];
+#define boot_l4() ((uint64_t *)phys_to_kernel(page_table))
+#define boot_l3() ((uint64_t *)phys_to_kernel(page_table + 512))
+// four consecutive PDs, covering the first 4 GiB
+#define boot_l2() ((uint64_t *)phys_to_kernel(page_table + 2 * 512))
+// PTs of the first BOOT_MAPPED bytes, i.e. the kernel image, mapped at 0
+// and KERNEL_OFFSET; all of it supervisor-only
+#define boot_l1() ((uint64_t *)phys_to_kernel(page_table + 6 * 512))
+#define BOOT_MAPPED (8UL << 20)
+
+static inline void invlpg(const void *addr)
+{
+    asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+static inline uint64_t read_cr3()
+{
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+static inline void write_cr3(uint64_t cr3)
+{
+    asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
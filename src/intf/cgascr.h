@@ -1,7 +1,12 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
+#define CGA_COLUMNS 80
+#define CGA_ROWS 25
+#define CGA_SCROLLBACK 256 // lines kept, including the screen, power of two
+
 typedef enum
 {
     CGA_F_BLACK = 0,
@@ -32,6 +37,8 @@ typedef enum
     CGA_DEFAULT_COLOR = CGA_F_LIGHT_GRAY | CGA_B_BLACK,
 } CGA_Color;
 
+// Output goes to a shadow buffer, video memory and the cursor are only
+// updated at line ends, by CGA_clear and by CGA_flush.
 void CGA_clear();
 void CGA_show(size_t x, size_t y, char c);
 void CGA_setpos(size_t x, size_t y);
@@ -39,4 +46,13 @@ void CGA_getpos(size_t *x, size_t *y);
 void CGA_scroll();
 void CGA_putchar(char c);
 void CGA_puts(const char *s);
+void CGA_write(const char *s, size_t n);
+void CGA_flush();
+// Moves the view `delta` lines back in history (forward if negative),
+// clamped to what is kept. Output continues on the live screen meanwhile.
+void CGA_scrollback(int delta);
 void CGA_set_color(CGA_Color c);
+void CGA_force_unlock();
+// Moves the console onto the boot loader's framebuffer, if it set one up
+// (fbcon.h). Needs paging; false keeps CGA text mode.
+bool CGA_use_framebuffer();
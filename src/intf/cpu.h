@@ -1,6 +1,11 @@
 #pragma once
 
+#include <stdbool.h>
+
 void int_enable();
 void int_disable();
+unsigned long int_save();
+void int_restore(unsigned long flags);
+bool int_enabled();
 void cpu_idle();
 void cpu_halt();
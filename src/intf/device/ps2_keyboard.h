@@ -1,3 +1,8 @@
 #pragma once
 
+#include "key.h"
+
 void ps2kbd_plugin();
+// Next key from the buffer, blocks the calling coroutine until there is one.
+// Must be called with the guard held.
+Key keyboard_read();
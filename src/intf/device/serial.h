@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+
+// COM1 console. Until serial_plugin every byte is polled out, afterwards
+// output is queued and the transmit interrupt refills the FIFO.
+void serial_init();
+void serial_plugin();
+// drops what doesn't fit into the buffer, see serial_dropped
+void serial_write(const char *s, size_t n);
+// Waits for room instead, for bulk exports. The lock is only held while a
+// buffer's worth is queued, so the wait spins with interrupts enabled.
+void serial_write_all(const char *s, size_t n);
+// bytes lost to a full buffer so far
+unsigned int serial_dropped();
+void serial_putchar(char c);
+void serial_puts(const char *s);
+// for panics: drains what is queued and polls from then on
+void serial_panic();
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// One-shot software timer, its callback runs as part of the timer epilogue
+typedef struct Timer
+{
+    uint64_t deadline; // in us, see timer_now()
+    void (*callback)(struct Timer *timer);
+    bool armed;
+    unsigned int bucket; // wheel slot it is linked into
+    struct Timer *next;
+    struct Timer **pprev;
+} Timer;
+
+Timer new_timer(void (*callback)(Timer *timer));
+void timer_init();
+uint64_t timer_now();
+void timer_arm(Timer *timer, uint64_t deadline);
+void timer_cancel(Timer *timer);
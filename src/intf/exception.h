@@ -1,3 +1,29 @@
 #pragma once
 
+#include <stdint.h>
+
+// What the interrupt stubs leave on the stack (see boot/main64.asm), for
+// vectors without an error code it is 0
+typedef struct ExceptionFrame
+{
+    uint64_t error_code;
+    uint64_t rip;
+    uint64_t cs;
+    uint64_t rflags;
+    uint64_t rsp;
+    uint64_t ss;
+} ExceptionFrame;
+
+// page fault error code bits
+enum
+{
+    pf_present = 1 << 0,  // protection violation rather than a missing page
+    pf_write = 1 << 1,
+    pf_user = 1 << 2,
+    pf_reserved = 1 << 3, // reserved bit set in a paging structure
+    pf_fetch = 1 << 4,
+};
+
 void exception_defaults();
+// frame of the exception whose prologue runs on this CPU
+ExceptionFrame *exception_frame();
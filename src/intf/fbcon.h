@@ -0,0 +1,25 @@
+#pragma once
+
+#include "boot/multiboot2.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Graphical backend of the console on a linear 32 bpp framebuffer. The text
+// grid keeps its CGA_COLUMNS x CGA_ROWS cells, 8x16 pixels each, centered on
+// the screen. cgascr.c hands it the rows it would copy to video memory.
+#define FBCON_CELL_WIDTH 8
+#define FBCON_CELL_HEIGHT 16
+
+// remembers the framebuffer the boot loader set up, parsed before frame_init
+void fbcon_set_info(struct multiboot_tag_framebuffer *tag);
+// maps it write-combining after paging_cpu_init, false keeps text mode
+bool fbcon_init();
+bool fbcon_enabled();
+// draws the cells [from, to) of `row`, given as CGA character/attribute pairs;
+// cells unchanged since they were last drawn are skipped
+void fbcon_draw(size_t row, size_t from, size_t to, const uint8_t *cells);
+// underlines cell (x, y), a position off the grid hides the cursor
+void fbcon_cursor(size_t x, size_t y);
+// drains the write-combining buffers, everything drawn so far is visible
+void fbcon_flush();
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+// 8x8 bitmap font for the framebuffer console: ' ' to '~', then a box that
+// stands in for every other character. NUL is blank, as in CGA text mode.
+#define FONT_WIDTH 8
+#define FONT_HEIGHT 8
+#define FONT_FIRST ' '
+#define FONT_GLYPHS 96
+
+extern const uint8_t font8x8[FONT_GLYPHS][FONT_HEIGHT];
+
+static inline const uint8_t *font_glyph(unsigned char c)
+{
+    if(!c)
+        return font8x8[0];
+    return font8x8[c >= FONT_FIRST && c < FONT_FIRST + FONT_GLYPHS - 1 ? c - FONT_FIRST : FONT_GLYPHS - 1];
+}
@@ -1,8 +1,14 @@
 #pragma once
 
 #include "plugbox.h"
+#include <stdint.h>
 
 void guard_enter();
 
 void guard_leave();
-void guard_relay(interrupt_handler *item);
+// `raised` is the TSC at the end of the prologue
+void guard_relay(interrupt_handler *item, uint64_t raised);
+// queues the epilogue of `item` on this CPU without running it, even with the guard free
+void guard_defer(interrupt_handler *item);
+// runs what guard_defer queued, unless the guard is held and its holder will
+void guard_poll();
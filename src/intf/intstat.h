@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Per-vector interrupt statistics, kept by guardian() and the guard. Vectors
+// taking the fast path of the interrupt stubs bypass both, the stub only
+// counts them in intstat_fast.
+// Latencies are TSC cycles sorted into log2 buckets: bucket b holds
+// [2^b, 2^(b+1)), the last one everything above.
+#define INTSTAT_BUCKETS 28
+
+typedef enum
+{
+    intstat_prologue, // guardian entry to prologue end
+    intstat_queued,   // prologue end to epilogue start
+    intstat_epilogue, // epilogue run, includes other coroutines if it switched away
+    INTSTAT_PHASES,
+} intstat_phase;
+
+typedef struct
+{
+    uint64_t fired;     // prologue runs
+    uint64_t relayed;   // prologues asking for an epilogue
+    uint64_t coalesced; // occurrences folded into an already pending epilogue
+    uint64_t fast;      // prologue runs straight from the stub, not in `fired`
+    uint32_t histogram[INTSTAT_PHASES][INTSTAT_BUCKETS];
+} IntStat;
+
+void intstat_fired(unsigned int slot, uint64_t cycles, bool relayed);
+void intstat_record(unsigned int slot, intstat_phase phase, uint64_t cycles);
+void intstat_coalesced(unsigned int slot, unsigned int count);
+// bumped by boot/main64.asm, by vector
+extern uint64_t intstat_fast[256];
+
+// counters are updated without locking, the copy may be slightly torn
+void intstat_report(unsigned int slot, IntStat *out);
+void intstat_reset();
+// prints every vector that fired since the last reset
+void intstat_dump();
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "stdlib/stdio.h"
+
+#define KLOG_TEXT 118 // longer messages are cut off
+
+typedef enum
+{
+    KLOG_ERROR = 0,
+    KLOG_WARNING = 1,
+    KLOG_INFO = 2,
+    KLOG_DEBUG = 3,
+} klog_level;
+
+// Formats a message into the log without taking the guard or any lock, safe
+// from prologues. klogd writes it out later. Messages above the loglevel=
+// option are dropped before formatting.
+SYSV void klog_at(klog_level level, const char *fmt, ...);
+SYSV void klog(const char *fmt, ...); // at KLOG_INFO
+// prints everything queued so far, returns the number of messages
+unsigned int klog_flush();
+// reads loglevel= and starts klogd, which flushes periodically
+void klog_init();
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+// common header of all system description tables
+typedef struct
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header;
+
+// takes the RSDP copy the boot loader passed in the MBI
+void acpi_set_rsdp(const void *rsdp);
+// table with that signature (e.g. "APIC"), NULL if there is none
+const acpi_header *acpi_find(const char signature[4]);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "machine/tsc.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Monotonic nanoseconds since timer_init(). With an invariant TSC the time is
+// interpolated from it, otherwise it advances in PIT interrupts.
+//
+// The same parameters are published read-only at CLOCK_PAGE in every address
+// space, user code calls clock_read() on it and needs no syscall.
+#define CLOCK_PAGE 0x7FFFFFFFF000UL
+
+__extension__ typedef unsigned __int128 clock_wide;
+
+enum clock_source
+{
+    clock_pit = 0,
+    clock_tsc = 1,
+};
+
+typedef struct
+{
+    uint32_t sequence; // odd while the kernel updates the page
+    uint32_t source;
+    uint64_t tsc_base; // TSC at ns_base
+    uint64_t ns_base;
+    uint64_t mult;     // ns per cycle, 32.32 fixed point
+} ClockPage;
+
+static inline uint64_t clock_read(const volatile ClockPage *page)
+{
+    for(;;)
+    {
+        uint32_t sequence = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        uint64_t ns = page->ns_base;
+        if(page->source == clock_tsc)
+            ns += (clock_wide)(rdtsc() - page->tsc_base) * page->mult >> 32;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(!(sequence & 1) && sequence == page->sequence)
+            return ns;
+        asm volatile("pause");
+    }
+}
+
+// called after timer_init(), calibrates the TSC unless boottrace did already
+void clock_init();
+uint64_t clock_now_ns();
+bool clock_precise(); // runs on the TSC
+// the PIT fallback, called by the timer prologue with its time in us
+void clock_pit_update(uint64_t us);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+} cpuid_regs;
+
+static inline cpuid_regs cpuid(uint32_t leaf, uint32_t subleaf)
+{
+    cpuid_regs r;
+    asm volatile("cpuid"
+                 : "=a"(r.eax), "=b"(r.ebx), "=c"(r.ecx), "=d"(r.edx)
+                 : "a"(leaf), "c"(subleaf));
+    return r;
+}
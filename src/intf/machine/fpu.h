@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+
+struct Coroutine;
+
+// The x87/SSE registers are handed over lazily: a switch only sets CR0.TS,
+// and the first FPU instruction of the next coroutine traps (#NM) into
+// fpu_restore, which saves the previous owner and loads the new state.
+void fpu_init();
+void fpu_switch(struct Coroutine *current, struct Coroutine *next);
+bool fpu_restore();
+void fpu_release(struct Coroutine *c);
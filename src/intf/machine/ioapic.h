@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+
+// ISA IRQ lines (pic_number) are translated to GSIs with the MADT overrides
+bool ioapic_init();
+void ioapic_mask(unsigned int irq, bool masked);
+bool ioapic_masked(unsigned int irq);
+void ioapic_route(unsigned int irq, unsigned int apic_id);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "pic.h"
+#include <stdbool.h>
+
+// Device IRQ lines, through the IOAPIC if there is one, else the 8259s
+void irq_init();
+void irq_allow(pic_number line);
+void irq_forbid(pic_number line);
+bool irq_masked(pic_number line);
+bool irq_route(pic_number line, unsigned int cpu);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void lapic_init();
+bool lapic_available();
+bool lapic_enabled();
+unsigned int lapic_id();
+void lapic_eoi();
+void lapic_pmu_nmi();
+void lapic_send_ipi(unsigned int apic_id, uint8_t vector);
+void lapic_send_init_all();
+void lapic_send_startup_all(uint8_t page);
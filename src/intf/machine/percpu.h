@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_CPUS 8
+
+struct Coroutine;
+struct AddressSpace;
+struct ExceptionFrame;
+
+// 64-bit task state segment
+typedef struct
+{
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iopb;
+} __attribute__((packed)) task_state;
+
+// Stacks of their own for the interrupts that may hit on a user RSP, the
+// IST numbers the IDT gives them (boot/main64.asm)
+enum
+{
+    IST_NMI = 1,
+    IST_DF = 2,
+    IST_MC = 3,
+};
+#define IST_STACKS 3
+#define IST_STACK_SIZE 4096
+
+// State private to one CPU, reached through the GS base.
+// The offsets of `self`, `tss` and `user_rsp` are used by assembly code
+// (gs:0, gs:16, gs:24).
+typedef struct PerCPU
+{
+    struct PerCPU *self;
+    unsigned int id;
+    unsigned int lapic_id;
+    task_state *tss;
+    uint64_t user_rsp; // scratch for the syscall entry
+    struct Coroutine *active;
+    struct Coroutine *previous; // switched away from, until its context is saved
+    struct Coroutine *exited;   // released after the next switch
+    bool guard_locked;
+    struct Coroutine *fpu_owner; // whose state is loaded in the FPU
+    struct AddressSpace *space;  // loaded in CR3
+    uint64_t pcid_generation;
+    unsigned int pcid_next;
+    struct ExceptionFrame *exception; // handed to exception prologues by guardian
+    uint64_t rsp0; // the TSS's RSP0 while no process runs, see scheduler.c
+    bool online;
+} __attribute__((aligned(64))) PerCPU;
+
+extern PerCPU percpu[MAX_CPUS];
+
+void percpu_init(unsigned int id);
+// points the IST entries of the CPU's TSS at its stacks
+void percpu_ist_init(unsigned int id, task_state *tss);
+unsigned int cpu_count();
+
+static inline PerCPU *cpu_this()
+{
+    PerCPU *self;
+    asm volatile("mov %%gs:0, %0" : "=r"(self));
+    return self;
+}
+
+static inline unsigned int cpu_id()
+{
+    unsigned int id;
+    asm volatile("movl %%gs:8, %0" : "=r"(id));
+    return id;
+}
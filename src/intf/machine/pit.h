@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+#define PIT_HZ 1193182
+
+// one-shot mode 0 on counter 0, the IRQ fires once `ticks` have passed
+void pit_oneshot(uint16_t ticks);
+uint16_t pit_count();
+// busy-waits on counter 2, which is gated through port 0x61 and raises no IRQ
+void pit_delay(uint16_t ticks);
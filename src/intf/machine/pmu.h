@@ -0,0 +1,82 @@
+#pragma once
+
+#include "machine/tsc.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Architectural performance monitoring (CPUID leaf 0xA). Every CPU counts
+// the same events from pmu_init() on, in ring 0 and ring 3:
+//   fixed counter 0   instructions retired
+//   fixed counter 1   unhalted core cycles
+//   PMC0              last level cache misses
+//   PMC1              mispredicted branches
+// Counters the CPU lacks read as 0, without a PMU cycles come from the TSC.
+enum
+{
+    pmu_fixed_instructions = 0,
+    pmu_fixed_cycles = 1,
+    pmu_pmc_cache_misses = 0,
+    pmu_pmc_branch_misses = 1,
+};
+
+typedef struct
+{
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t cache_misses;
+    uint64_t branch_misses;
+} PmuCounts;
+
+// begin/end pair around a region, nestable and cheap enough for hot paths
+typedef struct
+{
+    PmuCounts start;
+} PmuRegion;
+
+extern unsigned int pmu_fixed;   // fixed counters in use
+extern unsigned int pmu_general; // general purpose counters in use
+// counters are narrower than 64 bits, differences have to be masked
+extern uint64_t pmu_fixed_mask;
+extern uint64_t pmu_general_mask;
+
+static inline uint64_t pmu_rdpmc(uint32_t counter)
+{
+    uint32_t low, high;
+    asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return ((uint64_t)high << 32) | low;
+}
+
+#define PMU_FIXED(n) ((1u << 30) | (n)) // rdpmc index of a fixed counter
+
+static inline void pmu_read(PmuCounts *out)
+{
+    out->instructions = pmu_fixed > pmu_fixed_instructions ? pmu_rdpmc(PMU_FIXED(pmu_fixed_instructions)) : 0;
+    out->cycles = pmu_fixed > pmu_fixed_cycles ? pmu_rdpmc(PMU_FIXED(pmu_fixed_cycles)) : rdtsc();
+    out->cache_misses = pmu_general > pmu_pmc_cache_misses ? pmu_rdpmc(pmu_pmc_cache_misses) : 0;
+    out->branch_misses = pmu_general > pmu_pmc_branch_misses ? pmu_rdpmc(pmu_pmc_branch_misses) : 0;
+}
+
+static inline void pmu_begin(PmuRegion *region)
+{
+    pmu_read(&region->start);
+}
+
+// counts since pmu_begin, on this CPU
+static inline void pmu_end(const PmuRegion *region, PmuCounts *out)
+{
+    PmuCounts now;
+    pmu_read(&now);
+    out->cycles = (now.cycles - region->start.cycles) & (pmu_fixed > pmu_fixed_cycles ? pmu_fixed_mask : UINT64_MAX);
+    out->instructions = (now.instructions - region->start.instructions) & pmu_fixed_mask;
+    out->cache_misses = (now.cache_misses - region->start.cache_misses) & pmu_general_mask;
+    out->branch_misses = (now.branch_misses - region->start.branch_misses) & pmu_general_mask;
+}
+
+// per CPU, the rdpmc option allows user mode to read the counters
+void pmu_init();
+bool pmu_available();
+// Makes PMC2 overflow into an NMI every `period` (< 2^31) cycles on this
+// CPU, for the profiler. Needs version 2 and a LAPIC, false without.
+bool pmu_sample(uint64_t period);
+// called by guardian() for NMIs, true if the PMU raised it
+bool pmu_nmi(const uint64_t *frame);
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void smp_init();
+// ends the wait of an idle CPU, with MWAIT a store to its line is enough
+void smp_wakeup(unsigned int cpu);
+// sends `vector` to every other online CPU whose bit isn't set in `skip`
+void smp_broadcast(uint8_t vector, uint64_t skip);
+// Waits for a wakeup or an interrupt unless has_work() is true already.
+// Called with interrupts disabled, returns with them enabled.
+void smp_idle(bool (*has_work)());
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Built with LOCK_STATS, every lock counts how it is used. Named locks can
+// be listed with lock_stats_dump.
+#ifdef LOCK_STATS
+typedef struct LockStats
+{
+    const char *name;
+    uint64_t acquisitions;
+    uint64_t contended;   // acquisitions that had to wait
+    uint64_t spins;       // pause loops while waiting
+    uint64_t hold_cycles; // time held, exclusive holds only
+    uint64_t acquired_at;
+    struct LockStats *next;
+} LockStats;
+#define LOCK_STATS_FIELD LockStats stats;
+#define LOCK_STATS_INIT , {0}
+#define lock_name(lock, name) lock_stats_register(&(lock)->stats, name)
+void lock_stats_register(LockStats *stats, const char *name);
+#else
+#define LOCK_STATS_FIELD
+#define LOCK_STATS_INIT
+#define lock_name(lock, name) ((void)0)
+#endif
+void lock_stats_dump();
+
+// Test-and-test-and-set, the cheapest when hardly contended
+typedef struct
+{
+    volatile bool locked;
+    LOCK_STATS_FIELD
+} Spinlock;
+
+#define SPINLOCK_INIT {false LOCK_STATS_INIT}
+
+void spin_lock(Spinlock *lock);
+bool spin_trylock(Spinlock *lock);
+void spin_unlock(Spinlock *lock);
+
+// First come, first served, nobody starves under contention
+typedef struct
+{
+    union
+    {
+        uint32_t word;
+        struct
+        {
+            uint16_t owner; // ticket being served
+            uint16_t next;  // ticket of the next one to arrive
+        };
+    };
+    LOCK_STATS_FIELD
+} TicketLock;
+
+#define TICKETLOCK_INIT {{0} LOCK_STATS_INIT}
+
+void ticket_lock(TicketLock *lock);
+bool ticket_trylock(TicketLock *lock);
+void ticket_unlock(TicketLock *lock);
+
+// Queue lock, every waiter spins on its own node instead of the shared lock
+// word. The node lives on the locker's stack until mcs_unlock.
+typedef struct McsNode
+{
+    struct McsNode *next;
+    bool locked;
+} McsNode;
+
+typedef struct
+{
+    McsNode *tail;
+    LOCK_STATS_FIELD
+} McsLock;
+
+#define MCSLOCK_INIT {NULL LOCK_STATS_INIT}
+
+void mcs_lock(McsLock *lock, McsNode *node);
+void mcs_unlock(McsLock *lock, McsNode *node);
+
+// Any number of readers or one writer. A waiting writer keeps new readers
+// out, so read-mostly data doesn't starve its writers.
+typedef struct
+{
+    uint32_t state; // bit 0 writer holds, bit 1 writer waits, readers count in steps of 4
+    LOCK_STATS_FIELD
+} RwLock;
+
+#define RWLOCK_INIT {0 LOCK_STATS_INIT}
+
+void read_lock(RwLock *lock);
+void read_unlock(RwLock *lock);
+void write_lock(RwLock *lock);
+void write_unlock(RwLock *lock);
+
+// Forms for locks also taken by prologues, interrupts stay off while held
+static inline unsigned long spin_lock_irqsave(Spinlock *lock)
+{
+    unsigned long flags = int_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(Spinlock *lock, unsigned long flags)
+{
+    spin_unlock(lock);
+    int_restore(flags);
+}
+
+static inline unsigned long ticket_lock_irqsave(TicketLock *lock)
+{
+    unsigned long flags = int_save();
+    ticket_lock(lock);
+    return flags;
+}
+
+static inline void ticket_unlock_irqrestore(TicketLock *lock, unsigned long flags)
+{
+    ticket_unlock(lock);
+    int_restore(flags);
+}
+
+static inline unsigned long mcs_lock_irqsave(McsLock *lock, McsNode *node)
+{
+    unsigned long flags = int_save();
+    mcs_lock(lock, node);
+    return flags;
+}
+
+static inline void mcs_unlock_irqrestore(McsLock *lock, McsNode *node, unsigned long flags)
+{
+    mcs_unlock(lock, node);
+    int_restore(flags);
+}
+
+static inline unsigned long write_lock_irqsave(RwLock *lock)
+{
+    unsigned long flags = int_save();
+    write_lock(lock);
+    return flags;
+}
+
+static inline void write_unlock_irqrestore(RwLock *lock, unsigned long flags)
+{
+    write_unlock(lock);
+    int_restore(flags);
+}
@@ -9,8 +9,10 @@ typedef struct
     void* r15;
     void* rbp;
     void* rsp;
-    char fpu[108]; // Optional: 108 Byte extended CPU state (MMX, SSE, ...)
+    // FXSAVE image of the x87/MMX/SSE state, saved lazily, see machine/fpu.h
+    char fpu[512] __attribute__((aligned(16)));
 } toc;
 
 toc new_toc();
-typedef void (*kickoff_func)(void*, void*, void*, void*, void*, void*, void*);
+// first function of a new coroutine, toc_start passes it the settled argument
+typedef void (*kickoff_func)(void *coroutine);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+// cycles per second, 0 until tsc_calibrate()
+extern uint64_t tsc_hz;
+
+static inline uint64_t rdtsc()
+{
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// measures the TSC against the PIT, busy-waits ~10 ms
+void tsc_calibrate();
+uint64_t tsc_to_us(uint64_t cycles);
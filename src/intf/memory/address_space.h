@@ -0,0 +1,58 @@
+#pragma once
+
+#include "machine/percpu.h"
+#include "machine/spinlock.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Regions live between the identity window in l4[0] and the clock page in
+// l4[255]. Every space has tables of its own there, the rest is shared.
+#define USER_BASE (1UL << 39)
+#define USER_END (255UL << 39)
+
+// Anonymous memory backed on first touch. A stack also covers the pages from
+// `floor` up to `start`, which it grows into when pushed below `start`.
+// A channel's region maps its ring instead.
+typedef struct Region
+{
+    uintptr_t floor;
+    uintptr_t start;
+    uintptr_t end;
+    uint64_t flags;  // pte_* bits of its pages
+    struct Channel *channel; // holds a reference to it, dropped with the space
+    struct Region *next; // sorted by address
+} Region;
+
+// A page table hierarchy coroutines can run in. With PCIDs every CPU tags
+// the TLB entries of each space it ran, so switching back keeps them warm.
+typedef struct AddressSpace
+{
+    uint64_t *root;
+    uintptr_t root_phys;
+    uint64_t generation[MAX_CPUS]; // pcid[n] is valid while this is CPU n's generation
+    uint16_t pcid[MAX_CPUS];
+    Region *regions;
+    Spinlock lock; // protects the regions
+} AddressSpace;
+
+extern AddressSpace kernel_space;
+
+void address_space_init();
+AddressSpace *address_space_create();
+void address_space_destroy(AddressSpace *space);
+void address_space_switch(AddressSpace *space);
+void address_space_flush_inactive();
+
+// Regions must be page aligned and inside [USER_BASE, USER_END), nothing is
+// committed until touched. A stack of `size` bytes ends at `top`, its lowest
+// page stays unmapped as a guard. Both fail on overlaps or out of memory.
+bool address_space_reserve(AddressSpace *space, uintptr_t start, size_t size, uint64_t flags);
+bool address_space_stack(AddressSpace *space, uintptr_t top, size_t size, uint64_t flags);
+// for channel_map, the region takes over a reference the caller holds
+bool address_space_reserve_channel(AddressSpace *space, uintptr_t start, size_t size, uint64_t flags, struct Channel *channel);
+// a copy of the space's regions, their pages shared copy-on-write
+AddressSpace *address_space_fork(AddressSpace *space);
+// Resolves a page fault at `addr` from the #PF error code, `rsp` at the time,
+// false if it was a genuine access violation
+bool address_space_fault(AddressSpace *space, uintptr_t addr, uint64_t error, uint64_t rsp);
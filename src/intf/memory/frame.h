@@ -0,0 +1,34 @@
+#pragma once
+
+#include "boot/multiboot2.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_SIZE 4096
+
+// All physical memory below DIRECT_MAP_SIZE is mapped at DIRECT_MAP_BASE
+#define DIRECT_MAP_BASE 0xFFFF800000000000UL
+#define DIRECT_MAP_SIZE (4UL << 30)
+#define phys_to_virt(addr) ((void *)((uintptr_t)(addr) + DIRECT_MAP_BASE))
+#define virt_to_phys(addr) ((uintptr_t)(addr) - DIRECT_MAP_BASE)
+
+// Ranges the allocator must never hand out, registered before frame_init
+void frame_add_reserved(uintptr_t start, uintptr_t end);
+void frame_init(struct multiboot_tag_mmap *mmap);
+
+// Physical frame addresses, 0 means out of memory
+uintptr_t frame_alloc();
+void frame_free(uintptr_t frame);
+uintptr_t frame_alloc_contiguous(size_t count);
+void frame_free_contiguous(uintptr_t base, size_t count);
+
+// Copy-on-write sharing of single frames: a frame starts out with one owner,
+// frame_share adds one (false if it can't take more), frame_release drops one
+// and frees the frame with the last.
+bool frame_share(uintptr_t frame);
+bool frame_shared(uintptr_t frame);
+void frame_release(uintptr_t frame);
+
+// free frames not cached by any CPU
+size_t frame_available();
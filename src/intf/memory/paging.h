@@ -0,0 +1,36 @@
+#pragma once
+
+#include "boot/page_table.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGE_SIZE_2M (1UL << 21)
+#define PAGE_SIZE_1G (1UL << 30)
+
+// Address spaces are given by the virtual address of their L4 table. Ranges
+// must be page aligned; where virt, phys and size line up, 2 MiB or 1 GiB
+// pages are used. `flags` are pte_* bits, pte_present is implied.
+void paging_init();
+// Called on every CPU. Sets up the memory types selected by the PAT, PCD and
+// PWT bits of the leaves: pte_pat alone gives write-combining in 4 KiB pages,
+// where paging_write_combining() says the CPU has a PAT.
+void paging_cpu_init();
+bool paging_write_combining();
+uint64_t *paging_kernel_root();
+bool paging_map(uint64_t *root, uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags);
+void paging_unmap(uint64_t *root, uintptr_t virt, size_t size);
+bool paging_protect(uint64_t *root, uintptr_t virt, size_t size, uint64_t flags);
+bool paging_translate(uint64_t *root, uintptr_t virt, uintptr_t *phys);
+
+// Demand paging of anonymous memory, 4 KiB pages only. paging_populate maps
+// a zeroed frame at `virt` unless something is mapped there already.
+// paging_fork shares the pages of a range with `dst`, writable ones
+// copy-on-write, and paging_unshare resolves a write to such a page.
+// paging_release unmaps a range, drops its frames and the tables it covers.
+// Pages mapped with pte_borrowed are shared and released without references.
+// Writable ones stay shared across forks, copy-on-write ones are always copied.
+bool paging_populate(uint64_t *root, uintptr_t virt, uint64_t flags);
+bool paging_fork(uint64_t *dst, uint64_t *src, uintptr_t virt, size_t size);
+bool paging_unshare(uint64_t *root, uintptr_t virt);
+void paging_release(uint64_t *root, uintptr_t virt, size_t size);
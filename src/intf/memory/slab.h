@@ -0,0 +1,48 @@
+#pragma once
+
+#include "machine/percpu.h"
+#include "machine/spinlock.h"
+#include "memory/frame.h"
+#include <stddef.h>
+
+// Every slab is one frame, starting with its Slab header
+#define SLAB_HEADER 64
+#define SLAB_MAGAZINE 16
+#define SLAB_OBJECT_SIZE(size) (((size) + 15) & ~(size_t)15)
+
+typedef struct Slab
+{
+    struct SlabCache *cache; // NULL for multi-page kmalloc blocks
+    struct Slab *prev;
+    struct Slab *next;
+    void *free;              // objects linked through their first word
+    unsigned int inuse;
+    size_t pages;
+} Slab;
+
+// Objects freed and reused by one CPU never touch the cache lock
+typedef struct
+{
+    unsigned int count;
+    void *objects[SLAB_MAGAZINE];
+} __attribute__((aligned(64))) SlabCpu;
+
+typedef struct SlabCache
+{
+    const char *name;
+    size_t size;
+    unsigned int per_slab;
+    Spinlock lock;
+    Slab *partial;      // slabs with free objects
+    unsigned int empty; // of those, slabs without any object in use
+    SlabCpu cpu[MAX_CPUS];
+} SlabCache;
+
+// static initializer for a cache of `size` byte objects (16-byte aligned)
+#define SLAB_CACHE(name, size) \
+    {(name), SLAB_OBJECT_SIZE(size), (FRAME_SIZE - SLAB_HEADER) / SLAB_OBJECT_SIZE(size), SPINLOCK_INIT, NULL, 0, {{0, {NULL}}}}
+
+#define slab_of(object) ((Slab *)((uintptr_t)(object) & ~(uintptr_t)(FRAME_SIZE - 1)))
+
+void *slab_alloc(SlabCache *cache);
+void slab_free(SlabCache *cache, void *object);
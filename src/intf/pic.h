@@ -23,3 +23,4 @@ typedef enum
 void pic_allow(pic_number device);
 void pic_forbid(pic_number device);
 bool pic_ismasked(pic_number device);
+void pic_disable();
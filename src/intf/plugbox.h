@@ -1,6 +1,8 @@
 #pragma once
 
+#include "thread/rcu.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef enum
 {
@@ -33,16 +35,48 @@ typedef enum
     // IRQs
     int_timer = 32,
     int_keyboard = 33,
+    int_com1 = 36,
+
+    // software interrupts of the benchmark kernel
+    int_bench = 200,
+    int_bench_relay = 201,
+
+    // IPIs & APIC
+    int_wakeup = 240,
+    int_tlb = 241,
+    int_tick = 242,   // scheduler tick, fanned out from the CPU the PIT interrupts
+    int_sample = 243, // profiler sample, likewise
+    int_spurious = 255,
 } interrupt_number;
 
+// An epilogue runs once for all occurrences requested since its last run,
+// `count` tells how many there were. Handlers are owned by whoever assigns
+// them. Interrupts reach them without a lock, so a replaced handler stays
+// valid until retired: a grace period later, with no epilogue pending.
+// `retire` is called then, NULL for static handlers.
 typedef struct interrupt_handler
 {
+    RcuHead rcu; // has to come first, see plugbox_assign
     bool (*prologue)();
-    void (*epilogue)();
-    bool queued;
-    struct interrupt_handler *next;
+    void (*epilogue)(unsigned int count);
+    unsigned int pending;
+    unsigned int slot;        // set by plugbox_assign
+    uint64_t raised;          // TSC when the first pending occurrence was relayed
+    struct interrupt_handler *next;   // in the queue of pending epilogues
+    struct interrupt_handler *shared; // next handler on the same vector
+    void (*retire)(struct interrupt_handler *handler);
 } interrupt_handler;
 
-interrupt_handler new_interrupt_handler(bool (*prologue)(), void (*epilogue)());
-void plugbox_assign(interrupt_number slot, interrupt_handler handler);
+#define INTERRUPT_HANDLER(prologue, epilogue) {{NULL, NULL}, prologue, epilogue, 0, 0, 0, NULL, NULL, NULL}
+// handlers sharing an IRQ line, each prologue checks whether it is meant
+#define PLUGBOX_SHARED 4
+
+interrupt_handler new_interrupt_handler(bool (*prologue)(), void (*epilogue)(unsigned int count));
+// Both take effect atomically, interrupts on other CPUs see either the old or
+// the new handlers. Assigning replaces everything on the vector, from any
+// context but prologues.
+void plugbox_assign(interrupt_number slot, interrupt_handler *handler);
+void plugbox_share(interrupt_number slot, interrupt_handler *handler);
+// First handler of the vector, NULL if there is none. Lock-free like the
+// rest of the chain through `shared`, valid until the reader is quiescent.
 interrupt_handler *plugbox_report(unsigned int slot);
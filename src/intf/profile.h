@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Statistical sampling profiler. While it runs, timer interrupts record the
+// interrupted RIP and a short frame pointer backtrace on the CPU they hit;
+// the other CPUs are sampled by an IPI sent along with every period.
+// Every CPU writes its own ring, the oldest samples are overwritten.
+#define PROFILE_SAMPLES 512 // per CPU, power of two
+#define PROFILE_DEPTH 8     // return addresses above the RIP
+
+typedef struct
+{
+    uint64_t sequence; // position + 1 once the sample is complete
+    uint64_t rip;
+    uint64_t stack[PROFILE_DEPTH];
+    uint8_t depth;
+    bool user;         // interrupted in ring 3, no backtrace
+} ProfileSample;
+
+typedef enum
+{
+    profile_off,
+    profile_timer, // timer interrupts, see profile_start
+    profile_pmu,   // cycle counter overflows, see profile_cycles= and pmu_sample
+} profile_source;
+
+extern profile_source profiling;
+
+// Allocates the sample rings of the online CPUs that have none yet, from
+// frames; false if out of memory. Both sources call it before sampling.
+bool profile_buffers();
+// samples at least every `period_us`, the timer also samples its other deadlines
+void profile_start(uint64_t period_us);
+// stops either source, a stopped PMU stays masked until it is set up again
+void profile_stop();
+// `frame` is the interrupt frame from the error code on, see the stubs
+void profile_sample(const uint64_t *frame);
+unsigned int profile_read(unsigned int cpu, ProfileSample *out, unsigned int max);
+// Writes all samples to the serial port, in hex:
+//   K <kernel start> <kernel end>
+//   P <cpu> <user> <rip> <return addresses, innermost first>...
+//   D <bytes of other output the serial port dropped so far>
+// The kernel range lets the host resolve symbols from the ELF, e.g. with
+// addr2line, and fold the stacks into a flame graph. Waits for the serial
+// port, call it from a coroutine, e.g. a workqueue item.
+void profile_export();
@@ -1,3 +1,8 @@
 #pragma once
 
+#include <stddef.h>
 
+// Blocks up to 1 KiB come from power-of-two slab caches, larger ones are
+// whole frames. All blocks are 16-byte aligned.
+void *kmalloc(size_t size);
+void kfree(void *ptr);
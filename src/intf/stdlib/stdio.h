@@ -4,10 +4,13 @@
 #include <stddef.h>
 #include <stdarg.h>
 
-// TODO: uppercase hex, floats, length modifiers, keep track of amount printed in printf()
+// TODO: floats
 SYSV int printf(const char *fmt, ...);
 SYSV int vprintf(const char *fmt, va_list args);
-/*
 SYSV int sprintf(char *buffer, const char *fmt, ...);
 SYSV int snprintf(char *buffer, size_t bufsz, const char *fmt, ...);
-*/
+SYSV int vsnprintf(char *buffer, size_t bufsz, const char *fmt, va_list args);
+// picks the sinks given by the console= option
+void stdio_init();
+// hands already formatted output to the console and the serial port
+void stdio_write(const char *s, size_t n);
@@ -4,8 +4,15 @@
 #include <stdint.h>
 
 void reverse_str(char str[], int length);
+// Conversions store at most 65 characters (64 binary digits and the 0), plus
+// a sign for itoa. Bases go up to 36.
 int n_digits(int64_t n, int base);
 char *itoa(int64_t n, char str[], int base);
 char *uitoa(uint64_t n, char str[], int base);
+char *uitoa_upper(uint64_t n, char str[], int base);
 char *strcat(char *dest, const char *src);
 size_t strlen(const char *s);
+char *strncpy(char *dest, const char *src, size_t n);
+int strcmp(const char *s1, const char *s2);
+void *memchr(const void *s, int c, size_t n);
+int memcmp(const void *s1, const void *s2, size_t n);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+#define SYSCALL_COUNT 64
+
+typedef enum
+{
+    sys_null = 0, // does nothing, for measuring the round trip
+    sys_show = 1, // (x, y, character)
+    sys_channel_wait = 2, // (channel, end, seen), see thread/channel.h
+    sys_channel_wake = 3, // (channel, end)
+    sys_channel_create = 4, // (size, addr), the new channel mapped at addr
+    sys_channel_map = 5, // (channel, addr), returns the size of its ring
+} syscall_number;
+
+// handlers take up to six uint64_t arguments
+typedef int64_t (*syscall_handler)();
+
+// indexed by boot/syscall.asm, unused entries return -1
+extern syscall_handler syscall_table[SYSCALL_COUNT];
+
+void syscall_init();
+void syscall_register(syscall_number nr, syscall_handler handler);
+
+// user side
+static inline int64_t syscall(uint64_t nr, uint64_t a, uint64_t b, uint64_t c)
+{
+    int64_t ret;
+    asm volatile("syscall"
+                 : "=a"(ret)
+                 : "a"(nr), "D"(a), "S"(b), "d"(c)
+                 : "rcx", "r11", "memory");
+    return ret;
+}
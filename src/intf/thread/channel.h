@@ -0,0 +1,168 @@
+#pragma once
+
+#include "thread/waitqueue.h"
+#include "thread/rcu.h"
+#include "memory/address_space.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Single-producer/single-consumer message channel. The ring lives in frames
+// both ends map, kernel coroutines through the direct map, processes
+// anywhere in their user range with channel_map. Messages are written and
+// read in place with the inline functions below, which never enter the
+// kernel. Only an end that finds the ring full or empty goes to sleep, like
+// on a futex: channel_wait blocks while the other end's index still has the
+// value it saw, and the other end calls channel_wake once it moved it and
+// found the sleeper's flag set.
+//
+// The ring page is writable by every process that maps it, so nothing in it
+// is trusted: the size comes from the creator, indices are cut to an aligned
+// offset inside the ring and every length is checked against the space left.
+// A corrupted ring looks full or empty, it never reaches outside itself.
+
+#define CHANNEL_MAX 32
+#define CHANNEL_WRAP UINT32_MAX // record length: the rest of the ring is padding
+
+typedef enum
+{
+    channel_reader = 0,
+    channel_writer = 1,
+} channel_end;
+
+// First page of a channel, followed by `size` bytes of records. A record is
+// a uint32_t length and the message, padded to 8 bytes. Both indices only
+// grow, each is written by one end only and has a cache line of its own.
+typedef struct
+{
+    uint32_t head; // consumer, bytes read so far
+    uint32_t waiting_reader;
+    uint8_t pad0[56];
+    uint32_t tail; // producer, bytes written so far
+    uint32_t waiting_writer;
+    uint8_t pad1[56];
+} ChannelRing;
+
+#define CHANNEL_DATA(ring) ((uint8_t *)(ring) + 4096)
+#define CHANNEL_RECORD(length) ((sizeof(uint32_t) + (length) + 7) & ~(uint32_t)7)
+// where a record starts, 8-byte aligned and inside the ring whatever the index
+#define CHANNEL_OFFSET(index, size) ((index) & ((size) - 8))
+
+// Room for a message of `length` bytes to be written in place, NULL while
+// the ring is full. A message is at most a quarter of the ring, `size` is
+// the one the channel was created with.
+static inline void *channel_reserve(ChannelRing *ring, uint32_t size, uint32_t length)
+{
+    if(length > size / 4)
+        return NULL;
+    uint32_t need = CHANNEL_RECORD(length);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t used = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t offset = CHANNEL_OFFSET(tail, size);
+    if(used > size)
+        return NULL;
+
+    if(size - offset < need)
+    {
+        // doesn't fit before the end, pad and start over at offset 0
+        if(used + (size - offset) + need > size)
+            return NULL;
+        *(uint32_t *)(CHANNEL_DATA(ring) + offset) = CHANNEL_WRAP;
+        tail += size - offset;
+        used += size - offset;
+        offset = 0;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    if(used + need > size)
+        return NULL;
+    return CHANNEL_DATA(ring) + offset + sizeof(uint32_t);
+}
+
+// Publishes the message reserved last, true if the reader needs channel_wake
+static inline bool channel_commit(ChannelRing *ring, uint32_t size, uint32_t length)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    *(uint32_t *)(CHANNEL_DATA(ring) + CHANNEL_OFFSET(tail, size)) = length;
+    __atomic_store_n(&ring->tail, tail + CHANNEL_RECORD(length), __ATOMIC_RELEASE);
+    // orders the store before the load, see channel_wait
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->waiting_reader, __ATOMIC_RELAXED);
+}
+
+// The oldest message, read in place until channel_consume; NULL while empty
+// and for a record that claims more than the ring holds
+static inline const void *channel_peek(ChannelRing *ring, uint32_t size, uint32_t *length)
+{
+    for(;;)
+    {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        uint32_t used = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+        if(!used || used > size)
+            return NULL;
+        uint32_t offset = CHANNEL_OFFSET(head, size);
+        // loaded once, the writer may change it behind our back
+        uint32_t n = __atomic_load_n((const uint32_t *)(CHANNEL_DATA(ring) + offset), __ATOMIC_RELAXED);
+        if(n != CHANNEL_WRAP)
+        {
+            if(n > size / 4 || CHANNEL_RECORD(n) > size - offset || CHANNEL_RECORD(n) > used)
+                return NULL;
+            *length = n;
+            return CHANNEL_DATA(ring) + offset + sizeof(uint32_t);
+        }
+        __atomic_store_n(&ring->head, head + (size - offset), __ATOMIC_RELEASE);
+    }
+}
+
+// Frees the message channel_peek returned, true if the writer needs channel_wake
+static inline bool channel_consume(ChannelRing *ring, uint32_t length)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, head + CHANNEL_RECORD(length), __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->waiting_writer, __ATOMIC_RELAXED);
+}
+
+// Largest ring sys_channel_create hands out, each one is contiguous frames
+#define CHANNEL_USER_MAX (64 * 1024)
+
+typedef struct Channel
+{
+    RcuHead rcu;       // has to come first, see channel_put
+    ChannelRing *ring; // through the direct map
+    uintptr_t frames;  // physical, the ring's first page
+    size_t pages;
+    uint32_t size;     // of the records, never read back from the ring
+    unsigned int id;   // names the channel in syscalls
+    unsigned int users; // regions mapping it and syscalls waiting on it
+    bool destroyed;    // by its creator, it goes along with the last user
+    WaitQueue waiters[2]; // by channel_end
+} Channel;
+
+// A channel with `size` bytes of records, a power of two from a page to 1 GiB.
+// NULL if out of memory or channels.
+Channel *channel_create(size_t size);
+// Drops the creator's hold. The id is taken back once no region maps the
+// channel and nobody waits on it, the memory a grace period later since
+// channel_get is lock-free.
+void channel_destroy(Channel *channel);
+// Unreferenced, valid until the caller passes a quiescent point
+Channel *channel_get(unsigned int id);
+// channel_get holding a reference, channel_put drops it again. channel_ref
+// takes another on a channel the caller already holds.
+Channel *channel_acquire(unsigned int id);
+void channel_ref(Channel *channel);
+void channel_put(Channel *channel);
+// Maps the ring at `addr` of the space, as memory shared by forks. The caller
+// holds the channel, the region takes a reference of its own until the
+// space is destroyed.
+bool channel_map(Channel *channel, AddressSpace *space, uintptr_t addr);
+
+// The slow path, callers hold the guard. `seen` is the value of the other
+// end's index (tail for the reader, head for the writer) that made it wait.
+void channel_wait(Channel *channel, channel_end end, uint32_t seen);
+void channel_wake(Channel *channel, channel_end end);
+
+// Copying wrappers for kernel coroutines, blocking while full or empty.
+// channel_receive returns the length of the message, cut to `max` bytes.
+void channel_send(Channel *channel, const void *message, uint32_t length);
+uint32_t channel_receive(Channel *channel, void *buffer, uint32_t max);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "thread/waitqueue.h"
+#include "thread/mutex.h"
+
+// Waiters must re-check their condition after waking up
+typedef struct
+{
+    WaitQueue waiters;
+} Condvar;
+
+#define CONDVAR_INIT {WAITQUEUE_INIT}
+
+Condvar new_condvar();
+// releases `m` while blocked, holds it again on return
+void condvar_wait(Condvar *cv, Mutex *m);
+void condvar_signal(Condvar *cv);
+void condvar_broadcast(Condvar *cv);
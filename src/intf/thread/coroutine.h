@@ -1,15 +1,68 @@
 #pragma once
 
 #include "machine/toc.h"
+#include "machine/spinlock.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of scheduling levels, level 0 is the most urgent one
+#define COROUTINE_PRIORITIES 32
+#define COROUTINE_PRIORITY_DEFAULT (COROUTINE_PRIORITIES / 2)
+// a coroutine's time slice is the scheduler quantum scaled by weight / default
+#define COROUTINE_WEIGHT_DEFAULT 1024
 
 typedef struct Coroutine
 {
-    void (*action)();
+    void (*action)(void *arg);
+    void *arg;
     toc mtoc;
+    unsigned int priority;
+    unsigned int weight;
+    bool latency;       // latency-critical, runs before and preempts batch coroutines
+    bool queued;
+    unsigned int cpu;   // run queue the coroutine was last put on
+    bool killed;        // by scheduler_kill, dropped where it would run or be woken next
+    bool on_cpu;        // running, or its context is still being saved
+    bool fpu_used;      // mtoc.fpu holds a valid FPU state
+    void *stack;        // top of its pooled stack, NULL if the caller provided one
+    bool allocated;     // from coroutine_create, freed with the last reference
+    unsigned int refs;  // the running coroutine holds one, a joinable handle another
+    Spinlock join_lock; // protects `finished` and `joiner`
+    bool finished;      // returned, exited or was killed
+    struct Coroutine *joiner;
+    struct AddressSpace *space; // NULL runs in kernel_space
+    unsigned int id;    // names the coroutine in the switch trace
+    // accounting in TSC cycles, kept by the scheduler
+    uint64_t runtime;   // on a CPU
+    uint64_t waited;    // ready but queued
+    uint64_t switches;  // times it was switched to
+    uint64_t instructions; // retired on a CPU, 0 without a PMU
+    uint64_t ran_at;    // when it went on the CPU
+    uint64_t retired_at; // instruction counter at that point
+    uint64_t ready_at;  // when it was queued, 0 while it isn't
+    uint64_t budget;    // cycles it may run counted from ran_at, granted per slice
+    struct Coroutine *prev;
     struct Coroutine *next;
 } Coroutine;
 
 Coroutine new_coroutine(void (*action)());
 void coroutine_init(Coroutine* c, void* tos);
+bool coroutine_init_pooled(Coroutine *c);
+Coroutine *coroutine_create(void (*action)());
+// Creates a coroutine running fn(arg) and readies it, NULL if out of memory.
+// A NULL `stack` takes one from the pool, otherwise it is the caller's top of
+// stack. The result must be given to coroutine_join or coroutine_detach.
+// Callers hold the guard, like for all of the following.
+Coroutine *coroutine_spawn(void (*fn)(void *arg), void *arg, void *stack);
+// waits until `c` is finished and releases it
+void coroutine_join(Coroutine *c);
+// `c` is released on its own once it is finished
+void coroutine_detach(Coroutine *c);
+// ends the active coroutine, also reached by returning from its action
+__attribute__((noreturn)) void coroutine_exit();
+// wakes the joiner, `c` is done for good
+void coroutine_finish(Coroutine *c);
+// gives back the stack and drops the reference of the running coroutine
+void coroutine_release(Coroutine *c);
 void coroutine_go(Coroutine *c);
 void coroutine_resume(Coroutine *c, Coroutine *next);
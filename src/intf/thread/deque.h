@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEQUE_SIZE 256
+
+// Bounded Chase-Lev work-stealing deque. The owning CPU pushes and pops at
+// the bottom, any other CPU may steal from the top without taking a lock.
+typedef struct
+{
+    int64_t top;
+    char padding[64 - sizeof(int64_t)]; // keep thieves and owner on separate cache lines
+    int64_t bottom;
+    void *items[DEQUE_SIZE];
+} Deque;
+
+bool deque_push(Deque *d, void *item);
+void *deque_pop(Deque *d);
+void *deque_steal(Deque *d);
+bool deque_empty(Deque *d);
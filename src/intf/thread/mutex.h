@@ -0,0 +1,17 @@
+#pragma once
+
+#include "thread/waitqueue.h"
+
+// Sleeping lock, contenders block instead of spinning. Not recursive.
+typedef struct
+{
+    WaitQueue waiters;
+    Coroutine *owner;
+} Mutex;
+
+#define MUTEX_INIT {WAITQUEUE_INIT, NULL}
+
+Mutex new_mutex();
+void mutex_lock(Mutex *m);
+bool mutex_trylock(Mutex *m);
+void mutex_unlock(Mutex *m);
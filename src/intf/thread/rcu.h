@@ -0,0 +1,20 @@
+#pragma once
+
+// Quiescent-state based reclamation. Lock-free readers need no marking at
+// all, as long as they don't switch coroutines while holding a reference:
+// prologues, epilogues and other guard holders qualify. A CPU is quiescent
+// whenever it switches coroutines, leaves the guard or idles, and memory
+// unlinked before every CPU was quiescent once can't be referenced anymore.
+typedef struct RcuHead
+{
+    struct RcuHead *next;
+    void (*fn)(struct RcuHead *head);
+} RcuHead;
+
+// Calls fn(head) once all current readers are done, from any context but
+// prologues. Callbacks are batched per CPU and run at guard level.
+void rcu_call(RcuHead *head, void (*fn)(RcuHead *head));
+// blocks until a grace period passed, caller holds the guard
+void rcu_synchronize();
+// called by the scheduler and the guard, see above
+void rcu_quiescent();
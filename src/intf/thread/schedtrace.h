@@ -0,0 +1,42 @@
+#pragma once
+
+#include "thread/coroutine.h"
+#include <stdint.h>
+
+// Every CPU records its context switches into its own ring, the oldest
+// events are overwritten. A switch happens under the guard, so each ring
+// has a single writer and needs no atomic read-modify-write.
+#define SCHEDTRACE_EVENTS 256 // per CPU, power of two
+
+typedef enum
+{
+    switch_start,   // first coroutine of a CPU
+    switch_preempt, // time slice over, the coroutine was queued again
+    switch_block,   // waits for scheduler_ready
+    switch_exit,
+    switch_idle,    // the idle coroutine found work
+} switch_reason;
+
+typedef struct
+{
+    uint64_t sequence; // position + 1 once the event is complete
+    uint64_t tsc;
+    uint32_t from;     // coroutine ids, from is meaningless for switch_start
+    uint32_t to;
+    uint8_t reason;
+    uint8_t priority;  // of `to`
+} SwitchEvent;
+
+void schedtrace_switch(Coroutine *from, Coroutine *to, switch_reason reason, uint64_t now);
+// copies up to `max` events of `cpu`, oldest first, skipping those overwritten meanwhile
+unsigned int schedtrace_read(unsigned int cpu, SwitchEvent *out, unsigned int max);
+
+// Writes the trace to the serial port, one line per record:
+//   H <tsc_hz>
+//   S <cpu> <tsc> <from> <to> <reason> <priority>
+//   C <id> <runtime> <waited> <switches> <instructions>
+//   D <bytes of other output the serial port dropped so far>
+// everything in hex, times in TSC cycles. Waits for the serial port, call it
+// from a coroutine, e.g. a workqueue item.
+void schedtrace_export();
+void schedtrace_export_coroutine(const Coroutine *c);
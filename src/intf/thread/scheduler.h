@@ -5,5 +5,24 @@
 void scheduler_ready(Coroutine *that);
 void scheduler_schedule();
 void scheduler_exit();
+// Switches away without queueing the active coroutine, the caller must have
+// stored it where scheduler_ready will be called on it later.
+void scheduler_block();
+// `that` never runs again and counts as finished right away. A blocked one
+// gives back its stack once it is woken up, it is dropped instead.
 void scheduler_kill(Coroutine *that);
+// preempts the active coroutine for the next ready one
 void scheduler_resume();
+// Periodic, preempts the active coroutine once its slice is used up. Slices
+// are granted when a coroutine is switched to, so the tick only bounds how
+// late a slice ends, not how long it is. Called on one CPU, it forwards the
+// tick to every other busy one by IPI.
+void scheduler_tick();
+// default slice length in us, before weighting
+void scheduler_set_quantum(uint64_t us);
+void scheduler_finish_switch();
+void scheduler_set_priority(Coroutine *that, unsigned int priority);
+// Coroutines of one priority share the CPU in proportion to their weights.
+void scheduler_set_weight(Coroutine *that, unsigned int weight);
+// with `latency` set, waking `that` up preempts a batch coroutine right away
+void scheduler_set_latency(Coroutine *that, bool latency);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "thread/waitqueue.h"
+
+typedef struct
+{
+    WaitQueue waiters;
+    unsigned int count;
+} Semaphore;
+
+#define SEMAPHORE_INIT(count) {WAITQUEUE_INIT, count}
+
+Semaphore new_semaphore(unsigned int count);
+// blocks while the count is zero, then takes one
+void semaphore_wait(Semaphore *s);
+bool semaphore_trywait(Semaphore *s);
+void semaphore_signal(Semaphore *s);
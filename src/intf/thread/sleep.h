@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+// Block the active coroutine, must be called with the guard held
+void sleep(uint64_t us);
+void sleep_until(uint64_t deadline); // in us, see timer_now()
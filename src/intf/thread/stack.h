@@ -0,0 +1,12 @@
+#pragma once
+
+// Coroutine stacks of a fixed size, mapped from frames on demand in a window
+// of the kernel half. Every stack has an unmapped guard page below it, so an
+// overflow faults instead of corrupting its neighbour. Freed stacks stay
+// mapped and are handed out again first.
+#define STACK_SIZE (8 * 1024)
+#define STACK_MAX 4096 // slots in the window, 48 MiB of address space
+
+// returns the top of a free stack, NULL if out of frames or slots
+void *stack_alloc();
+void stack_free(void *tos);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "thread/coroutine.h"
+#include "machine/spinlock.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// FIFO of blocked coroutines, linked through their `next`. `lock` also
+// protects whatever condition the sleepers wait for. All functions must be
+// called with the guard held.
+typedef struct
+{
+    Spinlock lock;
+    Coroutine *head;
+    Coroutine *tail;
+} WaitQueue;
+
+#define WAITQUEUE_INIT {SPINLOCK_INIT, NULL, NULL}
+
+// Queues the active coroutine, releases `wq->lock` and blocks until woken
+void waitqueue_sleep(WaitQueue *wq);
+// The following expect `wq->lock` held and return whether anybody was woken
+bool waitqueue_wake_one(WaitQueue *wq);
+bool waitqueue_wake_all(WaitQueue *wq);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Deferred work run by a pool of kernel coroutines, one per CPU, without the
+// guard, so a long item can be preempted and doesn't hold up epilogues.
+// Items go to the worker of the queueing CPU, idle workers take over the
+// backlog of busy ones.
+typedef struct Work
+{
+    void (*fn)(struct Work *work);
+    struct Work *next;
+    bool queued;
+} Work;
+
+#define WORK_INIT(fn) {fn, NULL, false}
+
+// Allowed anywhere, prologues included. Returns false if `work` is still
+// queued, it runs once for both then. Out of a prologue the worker is woken
+// by an epilogue; prologues on the fast path (no epilogue of their own)
+// leave that to the next guard_leave on the CPU.
+bool workqueue_queue(Work *work);
+// starts the workers, once the CPUs are up
+void workqueue_init();
@@ -2,6 +2,7 @@
 
 #include "thread/coroutine.h"
 
-Coroutine *app(void *tos);
-Coroutine *app2(void *tos);
+Coroutine *app();
+Coroutine *app2();
+Coroutine *echo();
 void init();
\ No newline at end of file
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "memory/address_space.h"
+#include "thread/coroutine.h"
+#include <stdint.h>
+
+// ELF64 executables, as far as the loader needs them
+#define ELF_MAGIC 0x464c457f // "\x7fELF"
+#define ELF_CLASS64 2
+#define ELF_DATA2LSB 1
+#define ELF_TYPE_EXEC 2
+#define ELF_MACHINE_X86_64 62
+#define ELF_PT_LOAD 1
+#define ELF_PF_X 1
+#define ELF_PF_W 2
+
+typedef struct
+{
+    uint32_t magic;
+    uint8_t class;
+    uint8_t data;
+    uint8_t version;
+    uint8_t abi;
+    uint8_t padding[8];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t elf_version;
+    uint64_t entry;
+    uint64_t phoff;
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} ElfHeader;
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t filesz;
+    uint64_t memsz;
+    uint64_t align;
+} ElfSegment;
+
+// Each process gets a growable stack below USER_END
+#define USER_STACK_SIZE (1UL << 20)
+
+// Loads the statically linked executable at physical [start, end) into a
+// fresh space. Programs are linked inside [USER_BASE, USER_END). Pages whose
+// file offset lines up with their address are mapped straight from the
+// image, writable ones copy-on-write; the rest of .bss is zeroed on demand.
+// NULL if it isn't an executable we can run or out of memory.
+AddressSpace *elf_load(uintptr_t start, uintptr_t end, uintptr_t *entry);
+// a coroutine entering the executable in user mode, not readied yet
+Coroutine *elf_spawn(uintptr_t start, uintptr_t end);
+// The same for the kernel page holding `code`, mapped read-only at USER_BASE.
+// The kernel image is supervisor-only, code run this way has to sit in a
+// page of its own and reference nothing outside it (see .user.text).
+Coroutine *user_spawn_page(void (*code)());